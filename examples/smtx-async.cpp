@@ -0,0 +1,89 @@
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+
+#include "../smtx.hpp"
+
+#define NUM_TASKS 10000
+#define WRITER_RATIO 4 // every 4th task is a writer
+
+// Single-threaded run queue, all tasks below share one OS thread.
+struct scheduler {
+    std::deque<std::coroutine_handle<>> ready;
+
+    void run() {
+        while (!ready.empty()) {
+            std::coroutine_handle<> handle = ready.front();
+            ready.pop_front();
+            handle.resume();
+        }
+    }
+};
+
+struct queue_executor {
+    scheduler *sched;
+
+    void operator()(std::coroutine_handle<> handle) const {
+        sched->ready.push_back(handle);
+    }
+};
+
+struct reschedule {
+    scheduler &sched;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) const { sched.ready.push_back(handle); }
+    void await_resume() const noexcept {}
+};
+
+struct task {
+    struct promise_type {
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::abort(); }
+    };
+};
+
+scheduler sched;
+smtx::basic_async_shared_mutex<queue_executor> mutex(queue_executor{&sched});
+int global_value = 0;
+int write_count = 0;
+int read_count = 0;
+
+static task writer() {
+    co_await mutex.lock();
+    int value = global_value;
+    co_await reschedule{sched}; // hold the lock across a suspension, other tasks keep running
+    global_value = value + 1;
+    write_count += 1;
+    mutex.unlock();
+}
+
+static task reader() {
+    co_await mutex.lock_shared();
+    co_await reschedule{sched};
+    read_count += 1;
+    mutex.unlock_shared();
+}
+
+int main() {
+    std::printf("[TEST] Starting %d coroutine tasks on a single thread...\n", NUM_TASKS);
+
+    for (int i = 0; i < NUM_TASKS; ++i) {
+        if (i % WRITER_RATIO == 0) {
+            writer();
+        } else {
+            reader();
+        }
+    }
+    sched.run();
+
+    std::printf("[TEST] Final global value = %d\n", global_value);
+    std::printf("[TEST] Total write count  = %d\n", write_count);
+    std::printf("[TEST] Total read count   = %d\n", read_count);
+
+    return global_value == write_count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,853 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+// Same layout as examples/smtx.c, the lock is embedded in larger structs below.
+#define SMTX_CACHE_LINE_SIZE CACHE_LINE_SIZE
+#define SMTX_PREVENT_FALSE_SHARING
+#include "../smtx.h"
+
+#define NS_PER_US 1000LL
+#define NS_PER_MS 1000000LL
+#define NS_PER_S 1000000000LL
+
+typedef struct {
+    const char *name;
+    const char *description;
+    void (*run)(void);
+} scenario_t;
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+static struct timespec timespec_from_ns(int64_t ns) {
+    return (struct timespec){.tv_sec = ns / NS_PER_S, .tv_nsec = ns % NS_PER_S};
+}
+
+static void busy_for(int64_t ns) {
+    const int64_t until = now_ns() + ns;
+    while (now_ns() < until) {
+    }
+}
+
+static void sleep_for(int64_t ns) {
+    const struct timespec ts = timespec_from_ns(ns);
+    thrd_sleep(&ts, NULL);
+}
+
+static int compare_i64(const void *a, const void *b) {
+    const int64_t lhs = *(const int64_t *)a, rhs = *(const int64_t *)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+/* --- priority inversion ---------------------------------------------------------------------- */
+
+#define PI_DURATION_MS 1000
+#define PI_WRITER_HOLD_US 200
+#define PI_HOG_BURST_MS 5
+#define PI_READER_TIMEOUT_MS 50
+#define PI_MAX_SAMPLES 4096
+
+typedef struct {
+    smtx_t smtx;
+    atomic_bool stop;
+    int64_t samples[PI_MAX_SAMPLES];
+    int sample_count;
+    int timeouts;
+} pi_state_t;
+
+typedef struct {
+    pi_state_t *state;
+    int priority;
+} pi_thread_t;
+
+static bool make_realtime(int priority) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(0, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    const struct sched_param param = {.sched_priority = priority};
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+}
+
+static int pi_low_writer(void *arg) {
+    pi_thread_t *self = arg;
+    make_realtime(self->priority);
+    while (!atomic_load(&self->state->stop)) {
+        smtx_lock_exclusive(&self->state->smtx);
+        busy_for(PI_WRITER_HOLD_US * NS_PER_US);
+        smtx_unlock_exclusive(&self->state->smtx);
+        sleep_for(1 * NS_PER_MS);
+    }
+    return 0;
+}
+
+static int pi_medium_hog(void *arg) {
+    pi_thread_t *self = arg;
+    make_realtime(self->priority);
+    while (!atomic_load(&self->state->stop)) {
+        sleep_for(3 * NS_PER_MS);
+        busy_for(PI_HOG_BURST_MS * NS_PER_MS);
+    }
+    return 0;
+}
+
+static int pi_high_reader(void *arg) {
+    pi_thread_t *self = arg;
+    pi_state_t *state = self->state;
+    make_realtime(self->priority);
+    while (!atomic_load(&state->stop) && state->sample_count < PI_MAX_SAMPLES) {
+        sleep_for(2 * NS_PER_MS);
+
+        const int64_t start = now_ns();
+        const struct timespec deadline = timespec_from_ns(start + PI_READER_TIMEOUT_MS * NS_PER_MS);
+        if (smtx_timedlock_shared(&state->smtx, &deadline) != thrd_success) {
+            state->timeouts += 1;
+            continue;
+        }
+        state->samples[state->sample_count++] = now_ns() - start;
+        smtx_unlock_shared(&state->smtx);
+    }
+    return 0;
+}
+
+static void pi_run(const char *name, unsigned flags) {
+    static pi_state_t state;
+    memset(&state, 0, sizeof(state));
+    smtx_init_flags(&state.smtx, flags);
+
+    pi_thread_t low = {&state, 10}, medium = {&state, 20}, high = {&state, 30};
+    thrd_t threads[3];
+    thrd_create(&threads[0], pi_low_writer, &low);
+    thrd_create(&threads[1], pi_medium_hog, &medium);
+    thrd_create(&threads[2], pi_high_reader, &high);
+
+    sleep_for(PI_DURATION_MS * NS_PER_MS);
+    atomic_store(&state.stop, true);
+    for (int i = 0; i < 3; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+
+    qsort(state.samples, state.sample_count, sizeof(state.samples[0]), compare_i64);
+    const int64_t p99 = state.sample_count ? state.samples[state.sample_count * 99 / 100] : 0;
+    const int64_t max = state.sample_count ? state.samples[state.sample_count - 1] : 0;
+    printf("[BENCH] %-12s high-priority reader: p99 = %8.1f us, max = %8.1f us, timeouts (>%d ms) = %d of %d\n",
+           name, (double)p99 / NS_PER_US, (double)max / NS_PER_US, PI_READER_TIMEOUT_MS,
+           state.timeouts, state.timeouts + state.sample_count);
+}
+
+static void bench_priority_inversion(void) {
+    if (!make_realtime(1)) {
+        printf("[BENCH] skipped, SCHED_FIFO not permitted (needs CAP_SYS_NICE)\n");
+        return;
+    }
+    const struct sched_param normal = {.sched_priority = 0};
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &normal);
+
+    printf("[BENCH] SCHED_FIFO on one CPU: writer (prio 10) holds %d us, hog (prio 20) bursts %d ms, reader (prio 30)\n",
+           PI_WRITER_HOLD_US, PI_HOG_BURST_MS);
+    pi_run("default", 0);
+    pi_run("SMTX_FLAG_PI", SMTX_FLAG_PI);
+}
+
+/* --- flat combining -------------------------------------------------------------------------- */
+
+#define COMBINE_THREADS 16
+#define COMBINE_DURATION_MS 1000
+
+typedef struct {
+    smtx_t smtx;
+    atomic_bool stop;
+    atomic_long ops;
+    long counter;
+    bool combine;
+} combine_state_t;
+
+static void combine_increment(void *arg) {
+    combine_state_t *state = arg;
+    state->counter += 1;
+}
+
+static int combine_worker(void *arg) {
+    combine_state_t *state = arg;
+    long ops = 0;
+    while (!atomic_load_explicit(&state->stop, memory_order_relaxed)) {
+        if (state->combine) {
+            smtx_combine_exclusive(&state->smtx, combine_increment, state);
+        } else {
+            smtx_lock_exclusive(&state->smtx);
+            combine_increment(state);
+            smtx_unlock_exclusive(&state->smtx);
+        }
+        ++ops;
+    }
+    atomic_fetch_add(&state->ops, ops);
+    return 0;
+}
+
+static void combine_run(const char *name, bool combine) {
+    static combine_state_t state;
+    memset(&state, 0, sizeof(state));
+    smtx_init(&state.smtx);
+    state.combine = combine;
+
+    thrd_t threads[COMBINE_THREADS];
+    for (int i = 0; i < COMBINE_THREADS; ++i) {
+        thrd_create(&threads[i], combine_worker, &state);
+    }
+    sleep_for(COMBINE_DURATION_MS * NS_PER_MS);
+    atomic_store(&state.stop, true);
+    for (int i = 0; i < COMBINE_THREADS; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+    smtx_destroy(&state.smtx);
+
+    printf("[BENCH] %-24s %12.0f increments/s (counter %s)\n", name, atomic_load(&state.ops) * 1000.0 / COMBINE_DURATION_MS,
+           state.counter == atomic_load(&state.ops) ? "consistent" : "MISMATCH");
+}
+
+static void bench_flat_combining(void) {
+    printf("[BENCH] %d threads bumping one counter for %d ms\n", COMBINE_THREADS, COMBINE_DURATION_MS);
+    combine_run("smtx_lock_exclusive", false);
+    combine_run("smtx_combine_exclusive", true);
+}
+
+/* --- delegation ------------------------------------------------------------------------------ */
+
+#define DELEGATE_MAX_CLIENTS 64
+#define DELEGATE_DURATION_MS 500
+
+typedef struct {
+    smtx_server_t server;
+    smtx_mailbox_t mailboxes[DELEGATE_MAX_CLIENTS];
+    atomic_bool stop;
+    atomic_long ops;
+    long counter;
+    bool delegate;
+} delegate_state_t;
+
+typedef struct {
+    delegate_state_t *state;
+    size_t client;
+} delegate_client_t;
+
+static void delegate_increment(void *arg) {
+    delegate_state_t *state = arg;
+    state->counter += 1;
+}
+
+static int delegate_server(void *arg) {
+    delegate_state_t *state = arg;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(sysconf(_SC_NPROCESSORS_ONLN) - 1, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    return smtx_server_run(&state->server);
+}
+
+static int delegate_worker(void *arg) {
+    delegate_client_t *self = arg;
+    delegate_state_t *state = self->state;
+    long ops = 0;
+    while (!atomic_load_explicit(&state->stop, memory_order_relaxed)) {
+        if (state->delegate) {
+            smtx_delegate(&state->server, self->client, delegate_increment, state);
+        } else {
+            smtx_lock_exclusive(&state->server.smtx);
+            delegate_increment(state);
+            smtx_unlock_exclusive(&state->server.smtx);
+        }
+        ++ops;
+    }
+    atomic_fetch_add(&state->ops, ops);
+    return 0;
+}
+
+static void delegate_run(int clients, bool delegate) {
+    static delegate_state_t state;
+    memset(&state, 0, sizeof(state));
+    smtx_server_init(&state.server, state.mailboxes, clients);
+    state.delegate = delegate;
+
+    thrd_t server;
+    if (delegate) {
+        thrd_create(&server, delegate_server, &state);
+    }
+
+    thrd_t threads[DELEGATE_MAX_CLIENTS];
+    delegate_client_t args[DELEGATE_MAX_CLIENTS];
+    for (int i = 0; i < clients; ++i) {
+        args[i] = (delegate_client_t){&state, i};
+        thrd_create(&threads[i], delegate_worker, &args[i]);
+    }
+    sleep_for(DELEGATE_DURATION_MS * NS_PER_MS);
+    atomic_store(&state.stop, true);
+    for (int i = 0; i < clients; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+
+    if (delegate) {
+        smtx_server_stop(&state.server);
+        thrd_join(server, NULL);
+    }
+
+    printf("[BENCH] %2d clients %-20s %12.0f ops/s (counter %s)\n", clients, delegate ? "smtx_delegate" : "smtx_lock_exclusive",
+           atomic_load(&state.ops) * 1000.0 / DELEGATE_DURATION_MS, state.counter == atomic_load(&state.ops) ? "consistent" : "MISMATCH");
+}
+
+static void bench_delegation(void) {
+    for (int clients = 8; clients <= DELEGATE_MAX_CLIENTS; clients *= 2) {
+        delegate_run(clients, false);
+        delegate_run(clients, true);
+    }
+}
+
+/* --- SNZI reader indicator -------------------------------------------------------------------- */
+
+#define SNZI_MAX_READERS 256
+#define SNZI_DURATION_MS 500
+
+typedef struct {
+    smtx_t smtx;
+    smtx_snzi_t snzi;
+    smtx_snzi_node_t nodes[SMTX_SNZI_NODES(64)];
+    atomic_bool stop;
+    atomic_long ops;
+} snzi_state_t;
+
+static int snzi_reader(void *arg) {
+    snzi_state_t *state = arg;
+    long ops = 0;
+    while (!atomic_load_explicit(&state->stop, memory_order_relaxed)) {
+        smtx_lock_shared(&state->smtx);
+        smtx_unlock_shared(&state->smtx);
+        ++ops;
+    }
+    atomic_fetch_add(&state->ops, ops);
+    return 0;
+}
+
+static void snzi_run(int readers, bool snzi) {
+    static snzi_state_t state;
+    memset(&state, 0, sizeof(state));
+    smtx_init(&state.smtx);
+    if (snzi) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        const size_t leaves = cpus < 1 ? 1 : cpus > 64 ? 64 : (size_t)cpus;
+        smtx_snzi_init(&state.snzi, state.nodes, SMTX_SNZI_NODES(leaves));
+        smtx_use_snzi(&state.smtx, &state.snzi);
+    }
+
+    thrd_t threads[SNZI_MAX_READERS];
+    for (int i = 0; i < readers; ++i) {
+        thrd_create(&threads[i], snzi_reader, &state);
+    }
+    sleep_for(SNZI_DURATION_MS * NS_PER_MS);
+    atomic_store(&state.stop, true);
+    for (int i = 0; i < readers; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+    smtx_destroy(&state.smtx);
+
+    printf("[BENCH] %3d readers %-14s %12.0f lock_shared/s\n", readers, snzi ? "SNZI tree" : "reader_count",
+           atomic_load(&state.ops) * 1000.0 / SNZI_DURATION_MS);
+}
+
+static void bench_snzi(void) {
+    for (int readers = 16; readers <= SNZI_MAX_READERS; readers *= 4) {
+        snzi_run(readers, false);
+        snzi_run(readers, true);
+    }
+}
+
+/* --- wait strategies under oversubscription ----------------------------------------------------- */
+
+#define WAIT_THREADS_PER_CPU 4
+#define WAIT_MAX_THREADS 256
+#define WAIT_DURATION_MS 500
+#define WAIT_WRITER_PERMILLE 100
+#define WAIT_HOLD_NS 2000
+
+typedef struct {
+    smtx_t smtx;
+    atomic_bool stop;
+    atomic_long ops;
+} wait_state_t;
+
+static int wait_worker(void *arg) {
+    wait_state_t *state = arg;
+    unsigned rng = (unsigned)(uintptr_t)&rng;
+    long ops = 0;
+    while (!atomic_load_explicit(&state->stop, memory_order_relaxed)) {
+        rng = rng * 1103515245u + 12345u;
+        if ((rng >> 16) % 1000 < WAIT_WRITER_PERMILLE) {
+            smtx_lock_exclusive(&state->smtx);
+            busy_for(WAIT_HOLD_NS);
+            smtx_unlock_exclusive(&state->smtx);
+        } else {
+            smtx_lock_shared(&state->smtx);
+            busy_for(WAIT_HOLD_NS);
+            smtx_unlock_shared(&state->smtx);
+        }
+        ++ops;
+    }
+    atomic_fetch_add(&state->ops, ops);
+    return 0;
+}
+
+static double cpu_seconds(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void wait_run(const char *name, const smtx_wait_strategy_t *strategy, int threads) {
+    static wait_state_t state;
+    memset(&state, 0, sizeof(state));
+    smtx_attr_t attr;
+    smtx_attr_init(&attr);
+    attr.wait = strategy;
+    smtx_init_attr(&state.smtx, &attr);
+
+    const double cpu_before = cpu_seconds();
+    thrd_t workers[WAIT_MAX_THREADS];
+    for (int i = 0; i < threads; ++i) {
+        thrd_create(&workers[i], wait_worker, &state);
+    }
+    sleep_for(WAIT_DURATION_MS * NS_PER_MS);
+    atomic_store(&state.stop, true);
+    for (int i = 0; i < threads; ++i) {
+        thrd_join(workers[i], NULL);
+    }
+    smtx_destroy(&state.smtx);
+
+    const double seconds = WAIT_DURATION_MS / 1000.0;
+    printf("[BENCH] %-26s %12.0f ops/s, %6.2f CPUs busy\n", name, atomic_load(&state.ops) / seconds, (cpu_seconds() - cpu_before) / seconds);
+}
+
+static void bench_wait_strategies(void) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = (int)(cpus < 2 ? 2 : cpus) * WAIT_THREADS_PER_CPU;
+    threads = threads > WAIT_MAX_THREADS ? WAIT_MAX_THREADS : threads;
+    printf("[BENCH] %d threads on %ld CPUs, %d%% writes, %d ns critical sections\n", threads, cpus, WAIT_WRITER_PERMILLE / 10, WAIT_HOLD_NS);
+
+    wait_run("default (spin-yield-park)", NULL, threads);
+    wait_run("smtx_wait_spin", &smtx_wait_spin, threads);
+    wait_run("smtx_wait_spin_yield", &smtx_wait_spin_yield, threads);
+    wait_run("smtx_wait_spin_futex", &smtx_wait_spin_futex, threads);
+    wait_run("smtx_wait_spin_nanosleep", &smtx_wait_spin_nanosleep, threads);
+}
+
+/* --- CPU quota --------------------------------------------------------------------------------- */
+
+static void bench_quota(void) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const unsigned effective = smtx_parallelism();
+    int threads = (int)(cpus < 2 ? 2 : cpus) * WAIT_THREADS_PER_CPU;
+    threads = threads > WAIT_MAX_THREADS ? WAIT_MAX_THREADS : threads;
+    printf("[BENCH] %d threads on %ld CPUs, %u effective after affinity and cgroup cpu.max\n", threads, cpus, effective);
+    if (effective == (unsigned)cpus) {
+        printf("[BENCH] no CPU quota below the CPU count, try: systemd-run --scope -p CPUQuota=200%% smtx-bench quota\n");
+    }
+
+    wait_run("detected policy", NULL, threads);
+    smtx_set_parallelism((unsigned)cpus);
+    wait_run("bare-metal policy", NULL, threads);
+    smtx_set_parallelism(0);
+}
+
+/* --- deadline order ------------------------------------------------------------------------------ */
+
+#define DEADLINE_THREADS 16
+#define DEADLINE_DURATION_MS 1000
+#define DEADLINE_HOLD_US 100
+#define DEADLINE_TIERS 3
+
+static const int64_t deadline_slack_us[DEADLINE_TIERS] = {1000, 5000, 50000};
+
+typedef struct {
+    smtx_t smtx;
+    atomic_bool stop;
+    atomic_long requests[DEADLINE_TIERS];
+    atomic_long misses[DEADLINE_TIERS];
+} deadline_state_t;
+
+static int deadline_worker(void *arg) {
+    deadline_state_t *state = arg;
+    unsigned rng = (unsigned)(uintptr_t)&rng;
+    while (!atomic_load_explicit(&state->stop, memory_order_relaxed)) {
+        rng = rng * 1103515245u + 12345u;
+        const int tier = (int)((rng >> 16) % DEADLINE_TIERS);
+        const struct timespec deadline = timespec_from_ns(now_ns() + deadline_slack_us[tier] * NS_PER_US);
+        atomic_fetch_add_explicit(&state->requests[tier], 1, memory_order_relaxed);
+        if (smtx_timedlock_exclusive(&state->smtx, &deadline) != thrd_success) {
+            atomic_fetch_add_explicit(&state->misses[tier], 1, memory_order_relaxed);
+            continue;
+        }
+        busy_for(DEADLINE_HOLD_US * NS_PER_US);
+        smtx_unlock_exclusive(&state->smtx);
+    }
+    return 0;
+}
+
+static void deadline_run(const char *name, smtx_fairness_t fairness) {
+    static deadline_state_t state;
+    memset(&state, 0, sizeof(state));
+    smtx_attr_t attr;
+    smtx_attr_init(&attr);
+    attr.fairness = fairness;
+    smtx_init_attr(&state.smtx, &attr);
+
+    thrd_t workers[DEADLINE_THREADS];
+    for (int i = 0; i < DEADLINE_THREADS; ++i) {
+        thrd_create(&workers[i], deadline_worker, &state);
+    }
+    sleep_for(DEADLINE_DURATION_MS * NS_PER_MS);
+    atomic_store(&state.stop, true);
+    for (int i = 0; i < DEADLINE_THREADS; ++i) {
+        thrd_join(workers[i], NULL);
+    }
+    smtx_destroy(&state.smtx);
+
+    long requests = 0, misses = 0;
+    printf("[BENCH] %-24s misses:", name);
+    for (int tier = 0; tier < DEADLINE_TIERS; ++tier) {
+        const long tier_requests = atomic_load(&state.requests[tier]), tier_misses = atomic_load(&state.misses[tier]);
+        printf(" %5.1f%% (%2" PRId64 " ms)", tier_requests ? 100.0 * tier_misses / tier_requests : 0.0, deadline_slack_us[tier] / 1000);
+        requests += tier_requests;
+        misses += tier_misses;
+    }
+    printf(", %5.1f%% overall, %ld granted\n", requests ? 100.0 * misses / requests : 0.0, requests - misses);
+}
+
+static void bench_deadline_order(void) {
+    printf("[BENCH] %d threads, %d us exclusive holds, deadlines %" PRId64 "/%" PRId64 "/%" PRId64 " ms out, drawn evenly\n",
+           DEADLINE_THREADS, DEADLINE_HOLD_US, deadline_slack_us[0] / 1000, deadline_slack_us[1] / 1000, deadline_slack_us[2] / 1000);
+    deadline_run("default", SMTX_PREFER_WRITERS);
+    deadline_run("SMTX_EARLIEST_DEADLINE", SMTX_EARLIEST_DEADLINE);
+}
+
+/* --- priority classes ---------------------------------------------------------------------------- */
+
+#define PRIO_READERS 8
+#define PRIO_WRITERS 4
+#define PRIO_DURATION_MS 1000
+#define PRIO_READER_HOLD_US 20
+#define PRIO_READER_PAUSE_US 200
+#define PRIO_WRITER_HOLD_US 500
+#define PRIO_MAX_SAMPLES 65536
+
+typedef struct {
+    smtx_t smtx;
+    bool classes;
+    atomic_bool stop;
+    atomic_int sample_count;
+    atomic_long writes;
+    int64_t samples[PRIO_MAX_SAMPLES];
+} prio_state_t;
+
+static int prio_reader(void *arg) {
+    prio_state_t *state = arg;
+    while (!atomic_load_explicit(&state->stop, memory_order_relaxed)) {
+        sleep_for(PRIO_READER_PAUSE_US * NS_PER_US);
+        const int64_t start = now_ns();
+        if (state->classes) {
+            smtx_lock_prio(&state->smtx, SMTX_MODE_SHARED, SMTX_PRIO_HIGH, NULL);
+        } else {
+            smtx_lock_shared(&state->smtx);
+        }
+        const int sample = atomic_fetch_add_explicit(&state->sample_count, 1, memory_order_relaxed);
+        if (sample < PRIO_MAX_SAMPLES) {
+            state->samples[sample] = now_ns() - start;
+        }
+        busy_for(PRIO_READER_HOLD_US * NS_PER_US);
+        smtx_unlock_shared(&state->smtx);
+    }
+    return 0;
+}
+
+static int prio_writer(void *arg) {
+    prio_state_t *state = arg;
+    while (!atomic_load_explicit(&state->stop, memory_order_relaxed)) {
+        if (state->classes) {
+            smtx_lock_prio(&state->smtx, SMTX_MODE_EXCLUSIVE, SMTX_PRIO_BATCH, NULL);
+        } else {
+            smtx_lock_exclusive(&state->smtx);
+        }
+        busy_for(PRIO_WRITER_HOLD_US * NS_PER_US);
+        smtx_unlock_exclusive(&state->smtx);
+        atomic_fetch_add_explicit(&state->writes, 1, memory_order_relaxed);
+    }
+    return 0;
+}
+
+static void prio_run(const char *name, bool classes) {
+    static prio_state_t state;
+    memset(&state, 0, sizeof(state));
+    smtx_attr_t attr;
+    smtx_attr_init(&attr);
+    attr.fairness = classes ? SMTX_EARLIEST_DEADLINE : SMTX_PREFER_WRITERS;
+    smtx_init_attr(&state.smtx, &attr);
+    state.classes = classes;
+
+    thrd_t threads[PRIO_READERS + PRIO_WRITERS];
+    for (int i = 0; i < PRIO_READERS + PRIO_WRITERS; ++i) {
+        thrd_create(&threads[i], i < PRIO_READERS ? prio_reader : prio_writer, &state);
+    }
+    sleep_for(PRIO_DURATION_MS * NS_PER_MS);
+    atomic_store(&state.stop, true);
+    for (int i = 0; i < PRIO_READERS + PRIO_WRITERS; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+    smtx_destroy(&state.smtx);
+
+    int count = atomic_load(&state.sample_count);
+    count = count > PRIO_MAX_SAMPLES ? PRIO_MAX_SAMPLES : count;
+    qsort(state.samples, count, sizeof(state.samples[0]), compare_i64);
+    const int64_t p50 = count ? state.samples[count / 2] : 0, p99 = count ? state.samples[count * 99 / 100] : 0;
+    printf("[BENCH] %-24s interactive reads: p50 = %8.1f us, p99 = %8.1f us (%d), batch writes/s = %6ld\n",
+           name, (double)p50 / NS_PER_US, (double)p99 / NS_PER_US, count, atomic_load(&state.writes) * 1000 / PRIO_DURATION_MS);
+}
+
+static void bench_priority_classes(void) {
+    printf("[BENCH] %d readers (%d us holds, %d us apart) against %d back-to-back writers (%d us holds)\n",
+           PRIO_READERS, PRIO_READER_HOLD_US, PRIO_READER_PAUSE_US, PRIO_WRITERS, PRIO_WRITER_HOLD_US);
+    prio_run("writer preference", false);
+    prio_run("HIGH reads, BATCH writes", true);
+}
+
+/* --- writer admission ------------------------------------------------------------------------------ */
+
+#define ADMISSION_READERS 8
+#define ADMISSION_WRITERS 4
+#define ADMISSION_DURATION_MS 1000
+#define ADMISSION_READER_HOLD_US 20
+#define ADMISSION_READER_PAUSE_US 200
+#define ADMISSION_WRITER_HOLD_US 50
+#define ADMISSION_MAX_SAMPLES 65536
+
+typedef struct {
+    smtx_t smtx;
+    smtx_stats_t stats;
+    smtx_admission_t admission;
+    atomic_bool stop;
+    atomic_int sample_count;
+    atomic_long writes;
+    int64_t samples[ADMISSION_MAX_SAMPLES];
+} admission_state_t;
+
+static int admission_reader(void *arg) {
+    admission_state_t *state = arg;
+    while (!atomic_load_explicit(&state->stop, memory_order_relaxed)) {
+        sleep_for(ADMISSION_READER_PAUSE_US * NS_PER_US);
+        const int64_t start = now_ns();
+        smtx_lock_shared(&state->smtx);
+        const int sample = atomic_fetch_add_explicit(&state->sample_count, 1, memory_order_relaxed);
+        if (sample < ADMISSION_MAX_SAMPLES) {
+            state->samples[sample] = now_ns() - start;
+        }
+        busy_for(ADMISSION_READER_HOLD_US * NS_PER_US);
+        smtx_unlock_shared(&state->smtx);
+    }
+    return 0;
+}
+
+static int admission_writer(void *arg) {
+    admission_state_t *state = arg;
+    while (!atomic_load_explicit(&state->stop, memory_order_relaxed)) {
+        smtx_lock_exclusive(&state->smtx);
+        busy_for(ADMISSION_WRITER_HOLD_US * NS_PER_US);
+        smtx_unlock_exclusive(&state->smtx);
+        atomic_fetch_add_explicit(&state->writes, 1, memory_order_relaxed);
+    }
+    return 0;
+}
+
+static void admission_run(const char *name, unsigned long long interval_ns, unsigned burst, unsigned long long read_window_ns) {
+    static admission_state_t state;
+    memset(&state, 0, sizeof(state));
+    smtx_attr_t attr;
+    smtx_attr_init(&attr);
+    attr.stats = &state.stats;
+    if (interval_ns != 0 || read_window_ns != 0) {
+        smtx_admission_init(&state.admission, interval_ns, burst, read_window_ns);
+        attr.admission = &state.admission;
+    }
+    smtx_init_attr(&state.smtx, &attr);
+
+    thrd_t threads[ADMISSION_READERS + ADMISSION_WRITERS];
+    for (int i = 0; i < ADMISSION_READERS + ADMISSION_WRITERS; ++i) {
+        thrd_create(&threads[i], i < ADMISSION_READERS ? admission_reader : admission_writer, &state);
+    }
+    sleep_for(ADMISSION_DURATION_MS * NS_PER_MS);
+    atomic_store(&state.stop, true);
+    for (int i = 0; i < ADMISSION_READERS + ADMISSION_WRITERS; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+    smtx_destroy(&state.smtx);
+
+    int count = atomic_load(&state.sample_count);
+    count = count > ADMISSION_MAX_SAMPLES ? ADMISSION_MAX_SAMPLES : count;
+    qsort(state.samples, count, sizeof(state.samples[0]), compare_i64);
+    const int64_t p50 = count ? state.samples[count / 2] : 0, p99 = count ? state.samples[count * 99 / 100] : 0;
+    const unsigned long long delays = atomic_load(&state.stats.admission_delays);
+    printf("[BENCH] %-22s reads: p50 = %8.1f us, p99 = %8.1f us, writes/s = %6ld, admission delays = %6llu (avg %7.1f us)\n",
+           name, (double)p50 / NS_PER_US, (double)p99 / NS_PER_US, atomic_load(&state.writes) * 1000 / ADMISSION_DURATION_MS,
+           delays, delays ? (double)atomic_load(&state.stats.admission_delay_ns) / delays / NS_PER_US : 0.0);
+}
+
+static void bench_writer_admission(void) {
+    printf("[BENCH] %d readers (%d us holds, %d us apart) against a storm of %d writers (%d us holds, back to back)\n",
+           ADMISSION_READERS, ADMISSION_READER_HOLD_US, ADMISSION_READER_PAUSE_US, ADMISSION_WRITERS, ADMISSION_WRITER_HOLD_US);
+    admission_run("unlimited", 0, 0, 0);
+    admission_run("token bucket 2k/s, 4", 500 * NS_PER_US, 4, 0);
+    admission_run("read window 300 us", 0, 0, 300 * NS_PER_US);
+}
+
+/* --- yield points in long critical sections ------------------------------------------------------ */
+
+#define RESCHED_SCANNERS 2
+#define RESCHED_CHUNKS 200
+#define RESCHED_CHUNK_US 25
+#define RESCHED_WRITE_EVERY_US 1000
+#define RESCHED_WRITER_HOLD_US 5
+#define RESCHED_DURATION_MS 1000
+#define RESCHED_MAX_SAMPLES 4096
+
+typedef enum { RESCHED_NONE, RESCHED_COND, RESCHED_ALWAYS } resched_mode_t;
+
+typedef struct {
+    smtx_t smtx;
+    resched_mode_t mode;
+    atomic_bool stop;
+    atomic_long scans;
+    int sample_count;
+    int64_t samples[RESCHED_MAX_SAMPLES];
+} resched_state_t;
+
+/* A long shared scan, broken into chunks with a yield point between them. */
+static int resched_scanner(void *arg) {
+    resched_state_t *state = arg;
+    while (!atomic_load_explicit(&state->stop, memory_order_relaxed)) {
+        smtx_lock_shared(&state->smtx);
+        for (int chunk = 0; chunk < RESCHED_CHUNKS; ++chunk) {
+            busy_for(RESCHED_CHUNK_US * NS_PER_US);
+            if (state->mode == RESCHED_COND) {
+                smtx_shared_cond_resched(&state->smtx);
+            } else if (state->mode == RESCHED_ALWAYS) {
+                smtx_unlock_shared(&state->smtx);
+                smtx_lock_shared(&state->smtx);
+            }
+        }
+        smtx_unlock_shared(&state->smtx);
+        atomic_fetch_add_explicit(&state->scans, 1, memory_order_relaxed);
+    }
+    return 0;
+}
+
+static int resched_writer(void *arg) {
+    resched_state_t *state = arg;
+    while (!atomic_load_explicit(&state->stop, memory_order_relaxed)) {
+        sleep_for(RESCHED_WRITE_EVERY_US * NS_PER_US);
+        const int64_t start = now_ns();
+        smtx_lock_exclusive(&state->smtx);
+        if (state->sample_count < RESCHED_MAX_SAMPLES) {
+            state->samples[state->sample_count++] = now_ns() - start;
+        }
+        busy_for(RESCHED_WRITER_HOLD_US * NS_PER_US);
+        smtx_unlock_exclusive(&state->smtx);
+    }
+    return 0;
+}
+
+static void resched_run(const char *name, resched_mode_t mode, bool writer) {
+    static resched_state_t state;
+    memset(&state, 0, sizeof(state));
+    smtx_init(&state.smtx);
+    state.mode = mode;
+
+    thrd_t threads[RESCHED_SCANNERS + 1];
+    for (int i = 0; i < RESCHED_SCANNERS; ++i) {
+        thrd_create(&threads[i], resched_scanner, &state);
+    }
+    if (writer) {
+        thrd_create(&threads[RESCHED_SCANNERS], resched_writer, &state);
+    }
+    sleep_for(RESCHED_DURATION_MS * NS_PER_MS);
+    atomic_store(&state.stop, true);
+    for (int i = 0; i < RESCHED_SCANNERS + writer; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+
+    const long scans = atomic_load(&state.scans) * 1000 / RESCHED_DURATION_MS;
+    if (!writer) {
+        printf("[BENCH] %-16s no writer:  scans/s = %5ld\n", name, scans);
+        return;
+    }
+    const int count = state.sample_count;
+    qsort(state.samples, count, sizeof(state.samples[0]), compare_i64);
+    printf("[BENCH] %-16s one writer: scans/s = %5ld, writer wait p50 = %8.1f us, p99 = %8.1f us\n", name, scans,
+           count ? (double)state.samples[count / 2] / NS_PER_US : 0.0, count ? (double)state.samples[count * 99 / 100] / NS_PER_US : 0.0);
+}
+
+static void bench_cond_resched(void) {
+    printf("[BENCH] %d readers scanning %d x %d us under one shared hold, a writer every %d us\n", RESCHED_SCANNERS,
+           RESCHED_CHUNKS, RESCHED_CHUNK_US, RESCHED_WRITE_EVERY_US);
+    const char *names[] = {"no yield points", "cond_resched", "unlock/relock"};
+    for (resched_mode_t mode = RESCHED_NONE; mode <= RESCHED_ALWAYS; ++mode) {
+        resched_run(names[mode], mode, false);
+        resched_run(names[mode], mode, true);
+    }
+}
+
+/* --------------------------------------------------------------------------------------------- */
+
+static const scenario_t scenarios[] = {
+    {"pi", "priority inversion: worst-case reader latency with and without SMTX_FLAG_PI", bench_priority_inversion},
+    {"combine", "flat combining: tiny exclusive updates from many threads", bench_flat_combining},
+    {"delegate", "delegation: server thread executes critical sections posted to mailboxes", bench_delegation},
+    {"snzi", "reader fan-in: flat reader_count against an SNZI tree", bench_snzi},
+    {"wait", "wait strategies: throughput and CPU burnt with more threads than CPUs", bench_wait_strategies},
+    {"quota", "spin policy adapted to the cgroup CPU quota vs. spinning as on bare metal", bench_quota},
+    {"deadline", "deadline-miss rate of timed exclusive waits, racing vs. earliest deadline first", bench_deadline_order},
+    {"prio", "interactive readers vs. batch writers, writer preference vs. priority classes", bench_priority_classes},
+    {"admission", "write storm against readers, without and with writer admission control", bench_writer_admission},
+    {"resched", "writer latency against long reader scans, with and without smtx_shared_cond_resched", bench_cond_resched},
+};
+
+int main(int argc, char **argv) {
+    const size_t count = sizeof(scenarios) / sizeof(scenarios[0]);
+    bool found = argc < 2;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (argc < 2 || strcmp(argv[1], scenarios[i].name) == 0) {
+            printf("[BENCH] === %s: %s ===\n", scenarios[i].name, scenarios[i].description);
+            scenarios[i].run();
+            found = true;
+        }
+    }
+
+    if (!found) {
+        fprintf(stderr, "usage: %s [scenario]\n", argv[0]);
+        for (size_t i = 0; i < count; ++i) {
+            fprintf(stderr, "  %-12s %s\n", scenarios[i].name, scenarios[i].description);
+        }
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
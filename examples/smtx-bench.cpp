@@ -0,0 +1,69 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include "../smtx.hpp"
+
+#define NUM_THREADS 16
+#define TEST_DURATION_MS 1000
+#define WRITER_PERMILLE 100 // 10% of operations are writes
+
+template <class Mutex>
+static void bench(const char *name) {
+    Mutex mutex;
+    std::atomic<bool> stop{false};
+    std::atomic<long> total{0};
+    std::atomic<long> checksum{0};
+    long value = 0;
+
+    std::vector<std::thread> threads;
+    for (unsigned tid = 0; tid < NUM_THREADS; ++tid) {
+        threads.emplace_back([&, tid] {
+            std::minstd_rand rng(tid * 7919 + 17); // deterministic per-thread
+            long ops = 0;
+            long observed = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                if (rng() % 1000 < WRITER_PERMILLE) {
+                    std::unique_lock lock(mutex);
+                    value += 1;
+                } else {
+                    std::shared_lock lock(mutex);
+                    observed += value;
+                }
+                ++ops;
+            }
+            total.fetch_add(ops, std::memory_order_relaxed);
+            checksum.fetch_add(observed, std::memory_order_relaxed);
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(TEST_DURATION_MS));
+    stop.store(true);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::printf("[BENCH] %-28s %12.0f ops/s (writes = %ld)\n", name, total.load() * 1000.0 / TEST_DURATION_MS, value);
+}
+
+int main() {
+    std::printf("[BENCH] %d threads, %d%% writes, %d ms per mutex\n", NUM_THREADS, WRITER_PERMILLE / 10, TEST_DURATION_MS);
+
+    bench<std::shared_mutex>("std::shared_mutex");
+    bench<smtx::shared_mutex>("smtx::shared_mutex");
+    bench<smtx::basic_shared_mutex<smtx::spin_policy<64, 64, 32>, smtx::futex_wait>>("smtx futex_wait");
+    bench<smtx::basic_shared_mutex<smtx::spin_policy<>, smtx::yield_wait, smtx::prefer_readers>>("smtx prefer_readers");
+    bench<smtx::basic_shared_mutex<smtx::spin_policy<>, smtx::yield_wait, smtx::prefer_writers, smtx::padded_layout<64>>>("smtx padded_layout");
+
+    // std::scoped_lock over several smtx locks works through the Lockable requirements.
+    smtx::shared_mutex first, second;
+    std::scoped_lock both(first, second);
+
+    return EXIT_SUCCESS;
+}
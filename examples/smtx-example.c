@@ -7,6 +7,9 @@
 #include <threads.h>
 #include <unistd.h>
 
+// Same layout as examples/smtx.c, which compiles the implementation.
+#define SMTX_CACHE_LINE_SIZE CACHE_LINE_SIZE
+#define SMTX_PREVENT_FALSE_SHARING
 #include "../smtx.h"
 
 #define NUM_THREADS 32
@@ -0,0 +1,270 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <threads.h>
+#include <ucontext.h>
+
+// Same layout as examples/smtx.c, which compiles the implementation.
+#define SMTX_CACHE_LINE_SIZE CACHE_LINE_SIZE
+#define SMTX_PREVENT_FALSE_SHARING
+#include "../smtx.h"
+
+#define NUM_SCHEDULERS 2
+#define FIBERS_PER_SCHEDULER 64
+#define ITERATIONS 2000
+#define WRITER_RATIO 8 // every 8th acquisition is exclusive
+#define STACK_SIZE (64 * 1024)
+
+#define NS_PER_S 1000000000LL
+
+/* Minimal reference fiber runtime: every OS thread runs one scheduler with its own fibers and run
+   queue. Fibers never migrate; unpark from another thread pushes onto the owner's queue. */
+
+typedef enum { FIBER_READY, FIBER_RUNNING, FIBER_PARKING, FIBER_PARKED, FIBER_DONE } fiber_state_t;
+
+typedef struct fiber fiber_t;
+
+typedef struct {
+    mtx_t lock; // guards the run queue and every fiber's state and permit
+    cnd_t ready;
+    fiber_t *queue[FIBERS_PER_SCHEDULER];
+    size_t head, count;
+    size_t live;
+    ucontext_t context;
+    fiber_t *current;
+    smtx_fiber_hooks_t hooks;
+} scheduler_t;
+
+struct fiber {
+    ucontext_t context;
+    scheduler_t *sched;
+    fiber_state_t state;
+    bool permit; // unpark arrived before the park it was meant for
+    void (*fn)(void);
+    char *stack;
+};
+
+static _Thread_local scheduler_t *this_scheduler;
+
+static void push_ready(scheduler_t *sched, fiber_t *fiber) {
+    fiber->state = FIBER_READY;
+    sched->queue[(sched->head + sched->count++) % FIBERS_PER_SCHEDULER] = fiber;
+    cnd_signal(&sched->ready);
+}
+
+static void *fiber_current(void *ctx) {
+    return ((scheduler_t *)ctx)->current;
+}
+
+/* Deadlines are not supported, the benchmark only uses untimed locks. */
+static void fiber_park(void *ctx, const struct timespec *deadline) {
+    scheduler_t *sched = ctx;
+    fiber_t *fiber = sched->current;
+    (void)deadline;
+
+    mtx_lock(&sched->lock);
+    if (fiber->permit) {
+        fiber->permit = false;
+        mtx_unlock(&sched->lock);
+        return;
+    }
+    fiber->state = FIBER_PARKING; // the scheduler settles it once we are off this stack
+    mtx_unlock(&sched->lock);
+    swapcontext(&fiber->context, &sched->context);
+}
+
+static void fiber_unpark(void *ctx, void *arg) {
+    fiber_t *fiber = arg;
+    scheduler_t *sched = fiber->sched;
+    (void)ctx;
+
+    mtx_lock(&sched->lock);
+    if (fiber->state == FIBER_PARKED) {
+        push_ready(sched, fiber);
+    } else {
+        fiber->permit = true;
+    }
+    mtx_unlock(&sched->lock);
+}
+
+static void fiber_yield(void) {
+    scheduler_t *sched = this_scheduler;
+    fiber_t *fiber = sched->current;
+    mtx_lock(&sched->lock);
+    push_ready(sched, fiber);
+    mtx_unlock(&sched->lock);
+    swapcontext(&fiber->context, &sched->context);
+}
+
+static void fiber_entry(void) {
+    scheduler_t *sched = this_scheduler;
+    sched->current->fn();
+    sched->current->state = FIBER_DONE;
+    swapcontext(&sched->current->context, &sched->context);
+}
+
+static void scheduler_init(scheduler_t *sched) {
+    assert(mtx_init(&sched->lock, mtx_plain) == thrd_success);
+    assert(cnd_init(&sched->ready) == thrd_success);
+    sched->head = sched->count = sched->live = 0;
+    sched->hooks = (smtx_fiber_hooks_t){fiber_current, fiber_park, fiber_unpark, sched};
+}
+
+static void scheduler_spawn(scheduler_t *sched, fiber_t *fiber, void (*fn)(void)) {
+    fiber->sched = sched;
+    fiber->permit = false;
+    fiber->fn = fn;
+    fiber->stack = malloc(STACK_SIZE);
+    assert(fiber->stack != NULL);
+    getcontext(&fiber->context);
+    fiber->context.uc_stack.ss_sp = fiber->stack;
+    fiber->context.uc_stack.ss_size = STACK_SIZE;
+    fiber->context.uc_link = NULL;
+    makecontext(&fiber->context, fiber_entry, 0);
+
+    mtx_lock(&sched->lock);
+    sched->live += 1;
+    push_ready(sched, fiber);
+    mtx_unlock(&sched->lock);
+}
+
+static int scheduler_run(void *arg) {
+    scheduler_t *sched = arg;
+    this_scheduler = sched;
+    assert(smtx_set_fiber_hooks(&sched->hooks) == thrd_success);
+
+    mtx_lock(&sched->lock);
+    while (sched->live > 0) {
+        if (sched->count == 0) {
+            cnd_wait(&sched->ready, &sched->lock); // every fiber is parked on a lock held elsewhere
+            continue;
+        }
+        fiber_t *fiber = sched->queue[sched->head];
+        sched->head = (sched->head + 1) % FIBERS_PER_SCHEDULER;
+        sched->count -= 1;
+        fiber->state = FIBER_RUNNING;
+        sched->current = fiber;
+        mtx_unlock(&sched->lock);
+
+        swapcontext(&sched->context, &fiber->context);
+
+        mtx_lock(&sched->lock);
+        if (fiber->state == FIBER_DONE) {
+            free(fiber->stack);
+            sched->live -= 1;
+        } else if (fiber->state == FIBER_PARKING) {
+            if (fiber->permit) {
+                fiber->permit = false;
+                push_ready(sched, fiber);
+            } else {
+                fiber->state = FIBER_PARKED;
+            }
+        }
+    }
+    mtx_unlock(&sched->lock);
+
+    smtx_set_fiber_hooks(NULL);
+    return 0;
+}
+
+/* Workload: shared and exclusive holds that stay held across a switch to another task, like an
+   awaited read inside the critical section. */
+
+smtx_t smtx;
+long global_value = 0;
+atomic_long write_count = 0;
+
+static void run_iterations(void (*switch_task)(void)) {
+    for (int i = 0; i < ITERATIONS; ++i) {
+        if (i % WRITER_RATIO == 0) {
+            assert(smtx_lock_exclusive(&smtx) == thrd_success);
+            const long value = global_value;
+            switch_task();
+            global_value = value + 1;
+            atomic_fetch_add_explicit(&write_count, 1, memory_order_relaxed);
+            smtx_unlock_exclusive(&smtx);
+        } else {
+            assert(smtx_lock_shared(&smtx) == thrd_success);
+            switch_task();
+            smtx_unlock_shared(&smtx);
+        }
+    }
+}
+
+static void fiber_task(void) {
+    run_iterations(fiber_yield);
+}
+
+static void thread_yield(void) {
+    thrd_yield();
+}
+
+static int thread_task(void *arg) {
+    (void)arg;
+    run_iterations(thread_yield);
+    return 0;
+}
+
+static int64_t now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+static int64_t cpu_ns(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * NS_PER_S
+         + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000LL;
+}
+
+static bool report(const char *name, int64_t wall, int64_t cpu) {
+    const long tasks = NUM_SCHEDULERS * FIBERS_PER_SCHEDULER;
+    printf("[BENCH] %-12s %8.1f ms wall %8.1f ms CPU %10.0f acquisitions/s, value = %ld (expected %ld)\n",
+           name, wall / 1e6, cpu / 1e6, tasks * ITERATIONS / (wall / 1e9), global_value, atomic_load(&write_count));
+    return global_value == atomic_load(&write_count);
+}
+
+int main(void) {
+    static scheduler_t schedulers[NUM_SCHEDULERS];
+    static fiber_t fibers[NUM_SCHEDULERS][FIBERS_PER_SCHEDULER];
+    thrd_t threads[NUM_SCHEDULERS * FIBERS_PER_SCHEDULER];
+    bool ok = true;
+
+    assert(smtx_init(&smtx) == thrd_success);
+    printf("[TEST] %d fibers on %d scheduler threads vs. %d OS threads, holds span a task switch\n",
+           NUM_SCHEDULERS * FIBERS_PER_SCHEDULER, NUM_SCHEDULERS, NUM_SCHEDULERS * FIBERS_PER_SCHEDULER);
+
+    int64_t wall = now_ns(CLOCK_MONOTONIC), cpu = cpu_ns();
+    for (int s = 0; s < NUM_SCHEDULERS; ++s) {
+        scheduler_init(&schedulers[s]);
+        for (int f = 0; f < FIBERS_PER_SCHEDULER; ++f) {
+            scheduler_spawn(&schedulers[s], &fibers[s][f], fiber_task);
+        }
+    }
+    for (int s = 0; s < NUM_SCHEDULERS; ++s) {
+        assert(thrd_create(&threads[s], scheduler_run, &schedulers[s]) == thrd_success);
+    }
+    for (int s = 0; s < NUM_SCHEDULERS; ++s) {
+        thrd_join(threads[s], NULL);
+    }
+    ok &= report("fibers", now_ns(CLOCK_MONOTONIC) - wall, cpu_ns() - cpu);
+
+    global_value = 0;
+    atomic_store(&write_count, 0);
+    wall = now_ns(CLOCK_MONOTONIC);
+    cpu = cpu_ns();
+    for (int t = 0; t < NUM_SCHEDULERS * FIBERS_PER_SCHEDULER; ++t) {
+        assert(thrd_create(&threads[t], thread_task, NULL) == thrd_success);
+    }
+    for (int t = 0; t < NUM_SCHEDULERS * FIBERS_PER_SCHEDULER; ++t) {
+        thrd_join(threads[t], NULL);
+    }
+    ok &= report("OS threads", now_ns(CLOCK_MONOTONIC) - wall, cpu_ns() - cpu);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
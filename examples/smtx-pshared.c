@@ -0,0 +1,88 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <threads.h>
+#include <unistd.h>
+
+// Same layout as examples/smtx.c, which compiles the implementation.
+#define SMTX_CACHE_LINE_SIZE CACHE_LINE_SIZE
+#define SMTX_PREVENT_FALSE_SHARING
+#include "../smtx.h"
+
+#define NUM_PROCESSES 8
+#define ITERATIONS 10000
+
+typedef struct {
+    smtx_t smtx;
+    long value;
+} shared_t;
+
+static void worker(shared_t *shared) {
+    for (int i = 0; i < ITERATIONS; ++i) {
+        if (i % 4 == 0) {
+            assert(smtx_lock_exclusive(&shared->smtx) == thrd_success);
+            shared->value += 1;
+            smtx_unlock_exclusive(&shared->smtx);
+        } else {
+            assert(smtx_lock_shared(&shared->smtx) == thrd_success);
+            (void)shared->value;
+            smtx_unlock_shared(&shared->smtx);
+        }
+    }
+}
+
+int main(void) {
+    shared_t *shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(shared != MAP_FAILED);
+    assert(smtx_init_flags(&shared->smtx, SMTX_FLAG_PSHARED | SMTX_FLAG_ROBUST) == thrd_success);
+    shared->value = 0;
+
+    printf("[TEST] %d processes sharing one lock...\n", NUM_PROCESSES);
+    for (int i = 0; i < NUM_PROCESSES; ++i) {
+        if (fork() == 0) {
+            worker(shared);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+    for (int i = 0; i < NUM_PROCESSES; ++i) {
+        wait(NULL);
+    }
+    printf("[TEST] Final value = %ld (expected %d)\n", shared->value, NUM_PROCESSES * ITERATIONS / 4);
+
+    printf("[TEST] Writer process dies while holding the lock...\n");
+    if (fork() == 0) {
+        smtx_lock_exclusive(&shared->smtx);
+        shared->value = -1; // half-done update
+        _exit(EXIT_FAILURE);
+    }
+    wait(NULL);
+
+    const int result = smtx_lock_shared(&shared->smtx);
+    if (result == SMTX_OWNERDEAD) {
+        printf("[TEST] Reader recovered the lock from the dead writer, repairing value\n");
+        shared->value = NUM_PROCESSES * ITERATIONS / 4;
+        smtx_unlock_exclusive(&shared->smtx);
+    } else {
+        smtx_unlock_shared(&shared->smtx);
+    }
+
+    assert(smtx_lock_exclusive(&shared->smtx) == thrd_success);
+    printf("[TEST] Lock usable again, value = %ld\n", shared->value);
+    smtx_unlock_exclusive(&shared->smtx);
+
+    // The parent has taken the lock itself by now, the child must not inherit its owner TID.
+    printf("[TEST] Child forked from a lock user dies while holding the lock...\n");
+    if (fork() == 0) {
+        smtx_lock_exclusive(&shared->smtx);
+        _exit(EXIT_FAILURE);
+    }
+    wait(NULL);
+
+    const int again = smtx_lock_exclusive(&shared->smtx);
+    printf("[TEST] Writer %s the lock from the dead child\n", again == SMTX_OWNERDEAD ? "recovered" : "did not recover");
+    smtx_unlock_exclusive(&shared->smtx);
+
+    return result == SMTX_OWNERDEAD && again == SMTX_OWNERDEAD ? EXIT_SUCCESS : EXIT_FAILURE;
+}
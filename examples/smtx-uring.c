@@ -0,0 +1,224 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <threads.h>
+#include <unistd.h>
+
+// Same layout as examples/smtx.c, which compiles the implementation.
+#define SMTX_CACHE_LINE_SIZE CACHE_LINE_SIZE
+#define SMTX_PREVENT_FALSE_SHARING
+#include "../smtx.h"
+
+#define NUM_WAITERS 64
+#define NUM_ROUNDS 50
+#define HOLD_MS 10
+
+#define NS_PER_MS 1000000
+#define NS_PER_S 1000000000LL
+
+typedef struct {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} ring_t;
+
+smtx_t smtx;
+int64_t acquired_at[NUM_WAITERS];
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+static int64_t cpu_ns(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * NS_PER_S
+         + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000LL;
+}
+
+static int ring_init(ring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -errno;
+    }
+
+    const size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    char *cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        return -ENOMEM;
+    }
+
+    ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head  = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+static struct io_uring_sqe *ring_next_sqe(ring_t *ring, unsigned *pending) {
+    const unsigned tail = *ring->sq_tail + *pending;
+    const unsigned index = tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    *pending += 1;
+    return &ring->sqes[index];
+}
+
+static int ring_submit_and_wait(ring_t *ring, unsigned *pending) {
+    atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, *ring->sq_tail + *pending, memory_order_release);
+    const int ret = (int)syscall(__NR_io_uring_enter, ring->fd, *pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    *pending = 0;
+    return ret < 0 ? -errno : ret;
+}
+
+/* Single event-loop thread that owns NUM_WAITERS pending shared acquisitions at once. */
+static int uring_waiter(void *arg) {
+    ring_t *ring = arg;
+    unsigned pending = 0;
+    int remaining = NUM_WAITERS;
+
+    for (uintptr_t task = 0; task < NUM_WAITERS; ++task) {
+        struct io_uring_sqe *sqe = ring_next_sqe(ring, &pending);
+        if (smtx_uring_prep_lock_shared(&smtx, sqe) == thrd_success) {
+            acquired_at[task] = now_ns();
+            smtx_unlock_shared(&smtx);
+            --pending;
+            --remaining;
+            continue;
+        }
+        sqe->user_data = task;
+    }
+
+    while (remaining > 0) {
+        if (ring_submit_and_wait(ring, &pending) < 0) {
+            return -1;
+        }
+
+        unsigned head = *ring->cq_head;
+        while (head != atomic_load_explicit((_Atomic unsigned *)ring->cq_tail, memory_order_acquire)) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            const uintptr_t task = (uintptr_t)cqe->user_data;
+            if (cqe->res < 0 && cqe->res != -EAGAIN) {
+                fprintf(stderr, "[URING] futex wait failed: %s (kernel without IORING_OP_FUTEX_WAIT?)\n", strerror(-cqe->res));
+                return -1;
+            }
+
+            struct io_uring_sqe *sqe = ring_next_sqe(ring, &pending);
+            if (smtx_uring_prep_lock_shared(&smtx, sqe) == thrd_success) {
+                acquired_at[task] = now_ns();
+                smtx_unlock_shared(&smtx);
+                --pending;
+                --remaining;
+            } else {
+                sqe->user_data = task;
+            }
+            ++head;
+        }
+        atomic_store_explicit((_Atomic unsigned *)ring->cq_head, head, memory_order_release);
+    }
+
+    return 0;
+}
+
+static int blocking_waiter(void *arg) {
+    const uintptr_t task = (uintptr_t)arg;
+    smtx_lock_shared(&smtx);
+    acquired_at[task] = now_ns();
+    smtx_unlock_shared(&smtx);
+    return 0;
+}
+
+static int64_t latest_acquire(void) {
+    int64_t latest = 0;
+    for (int i = 0; i < NUM_WAITERS; ++i) {
+        latest = acquired_at[i] > latest ? acquired_at[i] : latest;
+    }
+    return latest;
+}
+
+static void report(const char *name, int64_t cpu, int64_t latency) {
+    printf("[BENCH] %-16s cpu/round = %8.3f ms, release->last acquire = %8.3f ms\n",
+           name, (double)cpu / NUM_ROUNDS / NS_PER_MS, (double)latency / NUM_ROUNDS / NS_PER_MS);
+}
+
+int main(void) {
+    printf("[BENCH] %d shared waiters on a lock held exclusively for %d ms, %d rounds\n",
+           NUM_WAITERS, HOLD_MS, NUM_ROUNDS);
+
+    smtx_init(&smtx);
+    const struct timespec hold = {.tv_sec = 0, .tv_nsec = HOLD_MS * NS_PER_MS};
+
+    int64_t cpu = 0, latency = 0;
+    for (int round = 0; round < NUM_ROUNDS; ++round) {
+        thrd_t threads[NUM_WAITERS];
+        smtx_lock_exclusive(&smtx);
+        const int64_t cpu_start = cpu_ns();
+        for (uintptr_t i = 0; i < NUM_WAITERS; ++i) {
+            assert(thrd_create(&threads[i], blocking_waiter, (void *)i) == thrd_success);
+        }
+        thrd_sleep(&hold, NULL);
+        const int64_t released = now_ns();
+        smtx_unlock_exclusive(&smtx);
+        for (int i = 0; i < NUM_WAITERS; ++i) {
+            assert(thrd_join(threads[i], NULL) == thrd_success);
+        }
+        cpu += cpu_ns() - cpu_start;
+        latency += latest_acquire() - released;
+    }
+    report("thread-blocking", cpu, latency);
+
+    ring_t ring;
+    const int err = ring_init(&ring, 2 * NUM_WAITERS);
+    if (err < 0) {
+        printf("[BENCH] io_uring unavailable: %s\n", strerror(-err));
+        return EXIT_SUCCESS;
+    }
+
+    cpu = 0, latency = 0;
+    for (int round = 0; round < NUM_ROUNDS; ++round) {
+        thrd_t loop;
+        int result;
+        smtx_lock_exclusive(&smtx);
+        const int64_t cpu_start = cpu_ns();
+        assert(thrd_create(&loop, uring_waiter, &ring) == thrd_success);
+        thrd_sleep(&hold, NULL);
+        const int64_t released = now_ns();
+        smtx_unlock_exclusive(&smtx);
+        assert(thrd_join(loop, &result) == thrd_success);
+        if (result != 0) {
+            return EXIT_FAILURE;
+        }
+        cpu += cpu_ns() - cpu_start;
+        latency += latest_acquire() - released;
+    }
+    report("io_uring futex", cpu, latency);
+
+    return EXIT_SUCCESS;
+}
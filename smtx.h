@@ -24,10 +24,20 @@
      #define SMTX_MAX_WRITER_WAIT_SPINS  - maximum spin count when waiting for writers (default: 1024)
      #define SMTX_MAX_READER_WAIT_SPINS  - maximum spin count when waiting for readers (default: 1024)
      #define SMTX_YIELD_THRESHOLD        - spin count threshold before yielding the thread (default: 512)
+     #define SMTX_MAX_COMBINE_PASSES     - times a combiner re-checks for requests published while it was busy (default: 4)
+     #define SMTX_SPINNERS_PER_CPU       - process-wide cap on spinning waiters per usable CPU, 0 for no cap (default: 2)
+     #define SMTX_MAX_HELP_DEPTH         - nesting depth up to which smtx_lock_or_run calls help (default: 4)
+     #define SMTX_PRIO_NORMAL_AGE_NS     - wait after which a SMTX_PRIO_NORMAL waiter ranks with a new SMTX_PRIO_HIGH one (default: 1000000)
+     #define SMTX_PRIO_BATCH_AGE_NS      - wait after which a SMTX_PRIO_BATCH waiter ranks with a new SMTX_PRIO_HIGH one (default: 100000000)
+     #define SMTX_RESCHED_WINDOW_NS      - how long smtx_*_cond_resched waits for the waiters it yields to (default: 50000)
+     #define SMTX_ROBUST_POLL_NS         - longest sleep of a SMTX_FLAG_ROBUST waiter between checks for a dead writer (default: 1000000)
      #define SMTX_YIELD                  - override thread yielding mechanism (default: thrd_yield() from <threads.h>)
+     #define SMTX_WAIT_NANOSLEEP_NS      - sleep of the smtx_wait_spin_nanosleep strategy in ns (default: 50000)
      #define SMTX_CLOCK_ID               - clock ID to use for timeouts (default: CLOCK_MONOTONIC)
      #define SMTX_CACHE_LINE_SIZE        - cache line size in bytes (default: 64)
      #define SMTX_PREVENT_FALSE_SHARING  - add padding and enforce alignment of SMTX_CACHE_LINE_SIZE
+     #define SMTX_NO_FUTEX               - never issue futex syscalls, even where they are available (Linux)
+     #define SMTX_IO_URING               - expose io_uring futex wait helpers (Linux 6.7+, no liburing required)
 
    License: MIT (see end of file for license information)
 */
@@ -39,9 +49,55 @@
 #error "smtx library requires atomics support which is not provided on current machine, currently no fallback is provided."
 #endif
 
+#include <stdalign.h>
 #include <stdatomic.h>
+#include <stddef.h>
 #include <time.h>
 
+/* Both lock words are 32-bit so that they can be used directly as futex words. The top bit of
+   each word is set by a thread that is about to sleep on it, the remaining bits hold the actual
+   lock state (reader count, or non-zero while a writer holds the lock). */
+#define SMTX_WAITERS       0x80000000u
+#define SMTX_STATE_MASK    (~SMTX_WAITERS)
+#define SMTX_WRITER_LOCKED 1u
+
+/* Robust locks store the owner's TID in the writer word instead of SMTX_WRITER_LOCKED, and flag a
+   hold taken over from a dead owner with SMTX_OWNER_DIED (same layout as kernel robust futexes). */
+#define SMTX_OWNER_DIED 0x40000000u
+#define SMTX_TID_MASK   0x3fffffffu
+
+/* smtx_init_flags flags */
+#define SMTX_FLAG_PSHARED 0x1u /* lock lives in memory shared between processes, use non-private futex ops */
+#define SMTX_FLAG_ROBUST  0x2u /* record the writer's TID so waiters can recover from a dead writer (Linux) */
+#define SMTX_FLAG_PI      0x4u /* priority inheritance: blocked threads boost the writer through FUTEX_LOCK_PI (Linux 5.14+) */
+#define SMTX_FLAG_PREEMPT_AWARE 0x8u /* waiters park while the holder is preempted on their CPU, smtx_init_attr only (glibc 2.35+ rseq) */
+
+/* Returned by lock operations of a robust lock whose writer died while holding it. The caller now
+   holds the lock exclusively (even from a shared lock call), must repair the protected state and
+   release it with smtx_unlock_exclusive. Waiters tell a dead writer by kill(tid, 0) failing, which
+   has two limits: once the kernel reuses the TID for a new task the dead writer looks alive and its
+   waiters keep waiting, and all processes sharing the lock must be in the same PID namespace, as a
+   TID recorded in another one names a different task here (or none). */
+#define SMTX_OWNERDEAD 0x100
+
+/* Returned by smtx_shared_cond_resched / smtx_exclusive_cond_resched when they released the lock
+   and took it again: anything read under the lock may have changed since. */
+#define SMTX_RESCHEDULED 0x200
+
+typedef enum {
+    SMTX_MODE_SHARED,
+    SMTX_MODE_EXCLUSIVE,
+} smtx_mode_t;
+
+typedef enum {
+    SMTX_PRIO_HIGH,   /* latency critical, queues ahead of everything that has not aged */
+    SMTX_PRIO_NORMAL,
+    SMTX_PRIO_BATCH,  /* background work, ages into line after SMTX_PRIO_BATCH_AGE_NS */
+} smtx_prio_t;
+
+/* Maximum number of locks smtx_lock_any can wait on, matches the kernel's FUTEX_WAITV_MAX. */
+#define SMTX_LOCK_ANY_MAX 128
+
 #undef SMTX_DEF
 #ifdef SMTX_STATIC
     #define SMTX_DEF static
@@ -53,53 +109,476 @@
 #define SMTX_CACHE_LINE_SIZE 64
 #endif
 
+/* Flat combining publication record, lives on the stack of the thread waiting in smtx_combine_exclusive. */
+struct smtx_combine_req {
+    void (*fn)(void *arg);
+    void *arg;
+    struct smtx_combine_req *next;
+    atomic_uint done;
+};
+
+/* Scalable NonZero Indicator node, each on its own cache line. The word packs the node's surplus
+   in halves (low 32 bits, an odd value marks an arrival still propagating upwards) and a version. */
+typedef struct {
+    alignas(SMTX_CACHE_LINE_SIZE) atomic_ullong word;
+} smtx_snzi_node_t;
+
+/* SNZI tree as a binary heap over caller-owned `nodes`: node i reports to (i - 1) / 2 and node 0 to
+   the lock's reader_count, readers arrive at the leaves (upper half). 2 * leaves - 1 nodes give
+   `leaves` leaves, one per core is a good fit. */
+typedef struct smtx_snzi {
+    smtx_snzi_node_t *nodes;
+    size_t count;
+} smtx_snzi_t;
+
+#define SMTX_SNZI_NODES(leaves) (2 * (leaves) - 1)
+
+/* How a waiter blocks once spinning is no longer enough (where a plain lock calls SMTX_YIELD or
+   parks). wait blocks while *addr == expected, until `deadline` (SMTX_CLOCK_ID, NULL for none) at
+   the latest, and may return early. A strategy with a wake function is expected to sleep: waiters
+   then announce themselves on the lock word and releasers call wake(addr, n). Strategies without
+   one must only poll (spin, yield, short sleeps). ctx is passed through for user strategies. */
+typedef struct smtx_wait_strategy {
+    void (*wait)(void *ctx, atomic_uint *addr, unsigned expected, const struct timespec *deadline);
+    void (*wake)(void *ctx, atomic_uint *addr, int n);
+    void *ctx;
+} smtx_wait_strategy_t;
+
+typedef enum {
+    SMTX_PREFER_WRITERS, /* a waiting writer holds back new readers (default) */
+    SMTX_PREFER_READERS, /* writers only get in while no reader holds the lock */
+    SMTX_EARLIEST_DEADLINE, /* waiters queue by time_point, the lock goes to the earliest deadline first */
+} smtx_fairness_t;
+
+/* Counters a lock with smtx_attr_t.stats set keeps up to date (relaxed, approximate while in use). */
+typedef struct {
+    atomic_ullong shared;              /* shared acquisitions */
+    atomic_ullong exclusive;           /* exclusive acquisitions */
+    atomic_ullong contended_shared;    /* shared acquisitions that had to wait */
+    atomic_ullong contended_exclusive; /* exclusive acquisitions that had to wait */
+    atomic_ullong parks;               /* futex sleeps of waiters */
+    atomic_ullong timeouts;            /* timed acquisitions that gave up */
+    atomic_ullong holder_preempted;    /* waits that skipped spinning because the holder was off its CPU (SMTX_FLAG_PREEMPT_AWARE) */
+    atomic_ullong throttled;           /* waits that skipped spinning because the process had enough spinners */
+    atomic_ullong admission_delays;    /* exclusive acquisitions held back by writer admission control */
+    atomic_ullong admission_delay_ns;  /* total time they were held back */
+} smtx_stats_t;
+
+/* Writer admission control (smtx_attr_t.admission), one per lock. Exclusive acquisitions draw from
+   a token bucket of `burst` writer phases that refills one every `interval_ns` (GCRA, a single
+   atomic word), and a writer phase starts no sooner than `read_window_ns` after the previous one
+   ended, so bursts of writers leave readers regular windows. Writers wait for admission before they
+   hold back readers; a timed one whose token comes after its time_point fails without using it,
+   and one that times out waiting for the lock hands its token back. */
+typedef struct smtx_admission {
+    unsigned long long interval_ns;    /* 0 = no rate limit */
+    unsigned long long read_window_ns; /* 0 = no read window */
+    unsigned burst;
+    atomic_ullong due;                 /* theoretical arrival time of the next writer */
+    atomic_ullong released;            /* end of the last writer phase */
+} smtx_admission_t;
+
+/* Where a holder of a SMTX_FLAG_PREEMPT_AWARE lock runs: its CPU when it took the lock and its rseq
+   area, whose cpu_id says whether it is still there. */
+typedef struct {
+    atomic_int cpu;
+    _Atomic(const void *) rseq;
+} smtx_holder_t;
+
+/* Per-lock tuning, see smtx_attr_init for the defaults (today's compile-time behavior). Only read
+   by smtx_init_attr, which copies what the lock needs, so one attr may configure any number of
+   locks and be discarded afterwards. */
+typedef struct {
+    unsigned flags;               /* SMTX_FLAG_*, as for smtx_init_flags */
+    unsigned long long spin_ns;   /* park once a wait has lasted this long, 0 = never on time */
+    unsigned yield_threshold;     /* backoff spin count past which waiters also yield */
+    unsigned park_after;          /* park after this many backoff rounds, 0 = never, 1 = immediately */
+    smtx_fairness_t fairness;
+    smtx_stats_t *stats;          /* counters to update, NULL = off */
+    const char *name;             /* for debuggers, not copied */
+    const smtx_wait_strategy_t *wait; /* NULL = built-in spin, yield and futex park */
+    smtx_admission_t *admission;  /* writer admission control, NULL = off */
+} smtx_attr_t;
+
+/* The settings of smtx_attr_t that waits and acquisitions read, as the lock keeps them. */
+typedef struct {
+    unsigned yield_threshold;
+    unsigned park_after;
+    unsigned long long spin_ns;
+    const smtx_wait_strategy_t *wait;
+    smtx_admission_t *admission;
+    smtx_stats_t *stats;
+} smtx_tuning_t;
+
+/* State only some locks need: the tuning (compact layout), deadline queue, holder samples and name
+   of smtx_init_attr locks, which allocates it when they have any, and that of flat combining, SNZI
+   readers, drain notification and condition requeueing, allocated by the first call that uses one
+   of them. A lock that never needs it stays at its lock words, and smtx_destroy frees it. Never
+   allocated for SMTX_FLAG_PSHARED locks, which every feature using it rejects (other processes map
+   the lock elsewhere and could not follow the pointer). */
+typedef struct smtx_ext {
+#ifndef SMTX_PREVENT_FALSE_SHARING
+    smtx_tuning_t tuning;                            /* of locks whose tuning is not the default */
+#endif
+    const char *name;                                /* smtx_attr_t.name */
+    _Atomic(struct smtx_deadline_waiter *) deadline_queue; /* SMTX_EARLIEST_DEADLINE waiters */
+    atomic_flag deadline_lock;                       /* guards the deadline queue */
+    smtx_holder_t writer, reader;                    /* SMTX_FLAG_PREEMPT_AWARE: the writer and one sampled reader */
+    _Atomic(struct smtx_combine_req *) combine_head; /* flat combining requests */
+    struct smtx_snzi *snzi;                          /* reader indicator tree of smtx_use_snzi */
+    _Atomic(void (*)(void *)) drain_fn;              /* smtx_notify_drained callback and its argument */
+    void *drain_arg;
+    atomic_uint requeued;                            /* futex word of condition waiters requeued onto the lock */
+} smtx_ext_t;
+
+/* The compact layout notes what each field beyond the two lock words costs every lock, the padded
+   one splits the same fields between the reader and the writer line, where it also keeps the tuning
+   next to the writer word. The compact layout keeps the tuning of smtx_init_attr locks in the
+   extension instead, with the state of optional features. */
 #ifdef SMTX_PREVENT_FALSE_SHARING
-#include <stdalign.h>
 typedef struct {
     alignas(SMTX_CACHE_LINE_SIZE) union {
-        atomic_uint reader_count;
+        struct {
+            atomic_uint reader_count;
+            atomic_ushort waiting;
+        };
         char _pad0[SMTX_CACHE_LINE_SIZE];
     };
 
     alignas(SMTX_CACHE_LINE_SIZE) union {
-        atomic_bool writer_locked;
+        struct {
+            atomic_uint writer_locked;
+            unsigned short flags;
+#ifndef SMTX_NDEBUG
+            atomic_uint owner;
+#endif
+            _Atomic(smtx_ext_t *) ext;
+            smtx_tuning_t tuning;
+        };
         char _pad1[SMTX_CACHE_LINE_SIZE];
     };
 } smtx_t;
+
+_Static_assert(offsetof(smtx_t, writer_locked) == SMTX_CACHE_LINE_SIZE, "smtx reader fields must fit one cache line");
+_Static_assert(sizeof(smtx_t) == 2 * SMTX_CACHE_LINE_SIZE, "smtx writer fields must fit one cache line");
 #else
 typedef struct {
     atomic_uint reader_count;
-    atomic_bool writer_locked;
+    atomic_uint writer_locked;
+    unsigned short flags;           /* SMTX_FLAG_* and the fairness, 2 bytes */
+    atomic_ushort waiting;          /* SMTX_WAITING_* hints of spinning waiters for the yield points, 2 bytes */
+#ifndef SMTX_NDEBUG
+    atomic_uint owner;              /* TID of the exclusive holder, debug builds only, in what is padding otherwise */
+#endif
+    _Atomic(smtx_ext_t *) ext;      /* tuning and optional feature state, NULL until a lock needs it, a pointer */
 } smtx_t;
 #endif
 
-SMTX_DEF int smtx_init(smtx_t *smtx);
+_Static_assert(sizeof(atomic_uint) == 4, "smtx lock words must be 32-bit to be usable as futex words");
+
+typedef struct {
+    atomic_uint seq;
+    atomic_uint waiters; /* threads between reading seq and returning, signals without any skip the futex call */
+    _Atomic(smtx_t *) smtx;
+} smtx_cond_t;
+
+/* Delegation: one client's request slot, always on its own cache line so that the client spins
+   locally and only the server touches it remotely. */
+typedef struct {
+    alignas(SMTX_CACHE_LINE_SIZE) atomic_uint state;
+    void (*fn)(void *arg);
+    void *arg;
+} smtx_mailbox_t;
+
+typedef struct {
+    smtx_t smtx;
+    smtx_mailbox_t *mailboxes;
+    size_t count;
+    atomic_uint doorbell;
+    atomic_bool stop;
+} smtx_server_t;
+
+SMTX_DEF int smtx_init      (smtx_t *smtx);
+SMTX_DEF int smtx_init_flags(smtx_t *smtx, unsigned flags);
+
+/* Free the extension smtx_init_attr or the features of an unused lock allocated, after which it may
+   be initialised again. Locks from smtx_init or smtx_init_flags that never used
+   smtx_combine_exclusive, smtx_use_snzi, smtx_notify_drained or smtx_cond_broadcast have none,
+   destroying them is optional. */
+SMTX_DEF int smtx_destroy(smtx_t *smtx);
+
+/* Configure a lock at run time instead of through the global defines. The lock copies what it needs
+   from `attr`, which stays the caller's to reuse or discard. The padded layout keeps the tuning on
+   the writer line; the compact one, so that smtx_t does not grow for everyone, keeps it in the
+   lock's extension with the deadline queue, holder samples and name, allocated here for locks that
+   have any (thrd_nomem if it cannot be; release it with smtx_destroy). A SMTX_FLAG_PSHARED lock,
+   which other processes map elsewhere, only takes flags and fairness, other settings must be left
+   at their defaults. A NULL attr is smtx_init.
+   park_after and spin_ns make waiters sleep on the futex word instead of spinning on, they have no
+   effect on SMTX_FLAG_ROBUST locks (whose waiters sleep for at most SMTX_ROBUST_POLL_NS at a time
+   once they check for a dead writer, who would never wake them) and SMTX_FLAG_PI locks (they park
+   through FUTEX_LOCK_PI). SMTX_PREFER_READERS cannot be combined with SMTX_FLAG_PI.
+   SMTX_EARLIEST_DEADLINE queues the waiters of lock and timedlock calls in order of their
+   time_point (untimed ones last, ties first come first served) and lets only the head of the queue
+   compete for the lock, timed out waiters leave the queue. smtx_lock_prio queues by priority class.
+   Trylock fails while anyone is queued, other acquisitions do not queue, and smtx_lock_any and the
+   io_uring helpers reject such locks. Under fiber hooks the waiters behind the head park as fibers.
+   It is not available for SMTX_FLAG_PSHARED, ROBUST or PI locks. Writer admission control covers
+   lock, timedlock, trylock, begin, priority and lock_or_run acquisitions (not io_uring ones) and is
+   not available for SMTX_FLAG_PSHARED or PI locks.
+   A wait strategy replaces yielding and parking; it is not available for SMTX_FLAG_PSHARED, ROBUST
+   or PI locks, and such locks are left out of smtx_lock_any, io_uring waits and condition requeueing,
+   which all sleep in the kernel directly.
+   SMTX_FLAG_PREEMPT_AWARE has acquisitions record in the extension where the writer and one sampled
+   reader run, a store to its line each, so that a waiter on the CPU the holder was last seen on
+   parks instead of spinning once the holder's rseq area confirms it is still there, i.e. waiting
+   for that CPU. Only that case is detected: a holder preempted on another CPU looks running, and a
+   wait reads the area once per holder. It needs smtx_init_attr and is not available for SMTX_FLAG_PSHARED locks. */
+SMTX_DEF int smtx_attr_init(smtx_attr_t *attr);
+SMTX_DEF int smtx_init_attr(smtx_t *smtx, const smtx_attr_t *attr);
+SMTX_DEF int smtx_admission_init(smtx_admission_t *admission, unsigned long long interval_ns, unsigned burst, unsigned long long read_window_ns);
+
+/* Effective parallelism the process-wide spin policy adapts to: the CPUs in the affinity mask,
+   lowered to the cgroup v2 cpu.max quota (rounded up) of any enclosing cgroup. Detected once per
+   process, by the first contended wait or the first call here, 0 if unknown. With one CPU waiters
+   never spin, a quota below the affinity mask shortens spins and yields earlier.
+   smtx_set_parallelism overrides it, 0 detects it again (say, after the quota changed). */
+SMTX_DEF unsigned smtx_parallelism    (void);
+SMTX_DEF int      smtx_set_parallelism(unsigned cpus);
+
+/* Built-in wait strategies. smtx_wait_spin never leaves the CPU, smtx_wait_spin_yield yields (the
+   default behavior without parking), smtx_wait_spin_futex sleeps on the lock word and
+   smtx_wait_spin_nanosleep polls every SMTX_WAIT_NANOSLEEP_NS. */
+SMTX_DEF const smtx_wait_strategy_t smtx_wait_spin;
+SMTX_DEF const smtx_wait_strategy_t smtx_wait_spin_yield;
+SMTX_DEF const smtx_wait_strategy_t smtx_wait_spin_futex;
+SMTX_DEF const smtx_wait_strategy_t smtx_wait_spin_nanosleep;
+
+/* Spread reader arrivals over an SNZI tree instead of the single reader_count word, only 0 <-> 1
+   transitions of a node reach its parent and writers still just wait for reader_count to drop to 0.
+   Pays off with hundreds of concurrent readers. Call on an unused lock, `snzi` must outlive it and
+   serves this lock only. Not for SMTX_FLAG_PSHARED locks, thrd_nomem if the lock's extension could
+   not be allocated. */
+SMTX_DEF int smtx_snzi_init(smtx_snzi_t *snzi, smtx_snzi_node_t *nodes, size_t count);
+SMTX_DEF int smtx_use_snzi (smtx_t *smtx, smtx_snzi_t *snzi);
 
 SMTX_DEF int smtx_lock_shared     (smtx_t *smtx);
 SMTX_DEF int smtx_trylock_shared  (smtx_t *smtx);
 SMTX_DEF int smtx_timedlock_shared(smtx_t *smtx, const struct timespec *time_point);
 SMTX_DEF int smtx_unlock_shared   (smtx_t *smtx);
 
+/* Acquire `n` shared references in one atomic step, each released by its own smtx_unlock_shared,
+   from any thread: shared holds are not tied to the thread that took them. Lets a dispatcher hand
+   one reference to each of n workers. thrd_error if the references held then would exceed
+   SMTX_STATE_MASK, the reader count below the waiter bit. Not for locks counting readers through an
+   SNZI tree, whose references must be released by the thread that took them, nor for
+   SMTX_EARLIEST_DEADLINE locks, whose waiters queue one reference each (thrd_error). */
+SMTX_DEF int smtx_lock_shared_n(smtx_t *smtx, unsigned n);
+
 SMTX_DEF int smtx_lock_exclusive     (smtx_t *smtx);
 SMTX_DEF int smtx_trylock_exclusive  (smtx_t *smtx);
 SMTX_DEF int smtx_timedlock_exclusive(smtx_t *smtx, const struct timespec *time_point);
 SMTX_DEF int smtx_unlock_exclusive   (smtx_t *smtx);
 
+/* Acquire a SMTX_EARLIEST_DEADLINE lock in `mode` with priority class `prio`, until `time_point`
+   (NULL waits for good). A class is a virtual deadline: the waiter queues as if due its class's age
+   after it arrived (0 for SMTX_PRIO_HIGH), or at time_point if that is earlier. Higher classes so
+   pass queued lower ones, and a waiter that has waited out its age ranks with new high priority
+   arrivals, so batch work still gets in. A holder is never preempted. thrd_error for other locks. */
+SMTX_DEF int smtx_lock_prio(smtx_t *smtx, smtx_mode_t mode, smtx_prio_t prio, const struct timespec *time_point);
+
+/* Two-phase exclusive acquisition. smtx_begin_exclusive only waits for other writers: once it returns
+   new readers are held back, but readers already inside may still be, so the caller can prepare
+   work that does not touch the protected data while they leave. smtx_finish_exclusive waits for
+   them, after which the lock is held exclusively. Give up in between with smtx_unlock_exclusive.
+   Begin returns SMTX_OWNERDEAD like smtx_lock_exclusive; with SMTX_PREFER_READERS it already waits
+   for the readers, as such a writer only gets in while there are none. thrd_error for
+   SMTX_EARLIEST_DEADLINE locks, whose queue only grants whole acquisitions. */
+SMTX_DEF int smtx_begin_exclusive (smtx_t *smtx);
+SMTX_DEF int smtx_finish_exclusive(smtx_t *smtx);
+
+/* Drain notification for a writer between smtx_begin_exclusive and smtx_finish_exclusive that would
+   rather not block a thread on the drain. Returns thrd_success if no reader is left (fn is not
+   called), or thrd_busy once fn(arg) is due: the last reader to leave calls it from inside its
+   unlock (or a reader backing off from the held lock), possibly before this returns.
+   smtx_finish_exclusive then returns at once. fn must not wait for the lock; signalling an eventfd
+   the writer's reactor polls is the intended use. Not for SMTX_FLAG_PSHARED locks, thrd_nomem if
+   the lock's extension could not be allocated (finish still works). */
+SMTX_DEF int smtx_notify_drained(smtx_t *smtx, void (*fn)(void *arg), void *arg);
+
+/* Yield points for long critical sections, like the kernel's cond_resched. smtx_shared_should_yield
+   tells a reader whether a writer waits for the lock, smtx_exclusive_should_yield tells a writer
+   whether readers do (or a sleeping writer, both sleep on the writer word). Each is a few relaxed
+   loads and only a hint: sleeping waiters show through their sleeper bit, spinning ones through a
+   mark they leave once per wait. The cond_resched calls check the same and, if someone waits, release
+   the lock, give the waiters up to SMTX_RESCHED_WINDOW_NS to get in and take it again in the same
+   mode. They return thrd_success if the lock was kept, SMTX_RESCHEDULED once it was retaken, or
+   what retaking it returned (say SMTX_OWNERDEAD). A shared hold must be a single reference. */
+SMTX_DEF int smtx_shared_should_yield   (smtx_t *smtx);
+SMTX_DEF int smtx_exclusive_should_yield(smtx_t *smtx);
+SMTX_DEF int smtx_shared_cond_resched   (smtx_t *smtx);
+SMTX_DEF int smtx_exclusive_cond_resched(smtx_t *smtx);
+
+/* Hand an exclusive hold to another thread without releasing it. The holder calls
+   smtx_detach_exclusive, passes the lock on through something that orders memory (a queue, a
+   channel), and the new holder calls smtx_adopt_exclusive before using or releasing it. Debug
+   builds track the owner and assert on unlocks by anyone else. Robust locks keep naming the old
+   holder in the lock word until adopted, so it must not exit in between. Not for SMTX_FLAG_PI locks,
+   whose owner the kernel tracks. */
+SMTX_DEF int smtx_detach_exclusive(smtx_t *smtx);
+SMTX_DEF int smtx_adopt_exclusive (smtx_t *smtx);
+
+/* Run fn(arg) under the exclusive lock. The request is published on the lock and whichever thread
+   holds it next executes every pending request in one batch before releasing, so short updates
+   from many threads stay in one core's cache instead of moving the lock around. Returns once fn
+   has run, possibly on another thread. Not for SMTX_FLAG_PSHARED locks (fn is a local pointer),
+   thrd_nomem if the lock's extension could not be allocated. */
+SMTX_DEF int smtx_combine_exclusive(smtx_t *smtx, void (*fn)(void *arg), void *arg);
+
+/* Acquire whichever of `locks` becomes available first in `mode`, sleeping on all of them at once
+   (futex_waitv, Linux 5.16+) while none is. Returns the index of the acquired lock, or -1 if the
+   arguments are invalid: NULL locks or entries, n == 0, n > SMTX_LOCK_ANY_MAX, or an entry that is
+   a SMTX_FLAG_ROBUST, PI or deadline-ordered lock or has a wait strategy. Lower indices win when
+   several locks are free. An exclusive waiter does not hold back new readers of the locks it waits on. */
+SMTX_DEF int smtx_lock_any(smtx_t **locks, size_t n, smtx_mode_t mode);
+
+/* Acquire `smtx` in `mode` like smtx_lock_shared / smtx_lock_exclusive, but call help(ctx) between
+   attempts instead of yielding, so a work-stealing worker can run other tasks while it waits.
+   help returns non-zero if it did any work, 0 makes the wait back off as usual. Helping stops once
+   an exclusive waiter owns the writer word and only waits for readers, as a helped task taking the
+   lock shared would then wait for us. Nested calls from helped tasks help up to
+   SMTX_MAX_HELP_DEPTH deep and never while an outer frame on the same thread waits for the same
+   lock; beyond that they block. help must not run tasks that need locks the caller holds. Robust
+   and PI locks block without helping. On SMTX_EARLIEST_DEADLINE locks attempts fail while anyone is
+   queued, as trylock does, so the caller never passes the queue. */
+SMTX_DEF int smtx_lock_or_run(smtx_t *smtx, smtx_mode_t mode, int (*help)(void *ctx), void *ctx);
+
+/* Hooks of a user-space thread (fiber) runtime that multiplexes fibers onto OS threads. Where a
+   waiter on a thread with hooks installed would yield or sleep the OS thread, it queues the running
+   fiber (current) on the lock and calls park, which switches to another fiber until unpark(fiber)
+   makes it runnable again. Releasers call unpark, possibly from another OS thread. An unpark may
+   arrive before park has switched away and must then make the next park return; park may return
+   early, and should return by `deadline` (SMTX_CLOCK_ID, NULL for none) for timed acquisitions. */
+typedef struct smtx_fiber_hooks {
+    void *(*current)(void *ctx);
+    void (*park)(void *ctx, const struct timespec *deadline);
+    void (*unpark)(void *ctx, void *fiber);
+    void *ctx;
+} smtx_fiber_hooks_t;
+
+/* Install `hooks` (kept by pointer) for the calling OS thread, NULL removes them. Only lock, timed
+   lock and drain waits of process-private locks without SMTX_FLAG_ROBUST, SMTX_FLAG_PI or a wait
+   strategy park fibers; everything else keeps blocking the OS thread. */
+SMTX_DEF int smtx_set_fiber_hooks(const smtx_fiber_hooks_t *hooks);
+
+/* Condition variable companion of smtx_t. Waiters atomically release `smtx` held in `mode` and hold
+   it in the same mode again when they return. All waiters of a condition must use the same lock.
+   Broadcast wakes a single waiter and requeues the rest onto the lock, so they sleep until the
+   broadcaster releases it instead of waking only to find it still held. Each writer release then
+   lets one of them in, and a requeued waiter that got the lock lets in the next (a reader right
+   away, a writer when it releases), so they do not stampede at the release either. Requeueing
+   needs the lock's extension, a broadcast that cannot allocate it wakes every waiter instead.
+   If the writer of a SMTX_FLAG_ROBUST lock died meanwhile, waiting returns SMTX_OWNERDEAD and the
+   caller holds the lock exclusively, whichever mode it waited in, as after a lock call.
+   Conditions are process-private, even when used with a SMTX_FLAG_PSHARED lock. */
+SMTX_DEF int smtx_cond_init     (smtx_cond_t *cond);
+SMTX_DEF int smtx_cond_wait     (smtx_cond_t *cond, smtx_t *smtx, smtx_mode_t mode);
+SMTX_DEF int smtx_cond_timedwait(smtx_cond_t *cond, smtx_t *smtx, smtx_mode_t mode, const struct timespec *time_point);
+SMTX_DEF int smtx_cond_signal   (smtx_cond_t *cond);
+SMTX_DEF int smtx_cond_broadcast(smtx_cond_t *cond);
+
+/* Delegation (remote core locking): a dedicated, ideally pinned, thread runs smtx_server_run and
+   executes every critical section submitted with smtx_delegate itself, so the protected data never
+   leaves its core and writers never touch the lock. `mailboxes` is caller-owned storage, client i
+   submits through mailboxes[i] only. The server holds `server->smtx` exclusively while it has work
+   and releases it once a scan of all mailboxes comes up empty, readers use smtx_lock_shared on it. */
+SMTX_DEF int smtx_server_init(smtx_server_t *server, smtx_mailbox_t *mailboxes, size_t count);
+SMTX_DEF int smtx_server_run (smtx_server_t *server); /* returns after smtx_server_stop */
+SMTX_DEF int smtx_server_stop(smtx_server_t *server);
+SMTX_DEF int smtx_delegate   (smtx_server_t *server, size_t client, void (*fn)(void *arg), void *arg);
+
+#ifdef SMTX_IO_URING
+struct io_uring_sqe;
+
+/* Prepare `sqe` as an IORING_OP_FUTEX_WAIT on whichever lock word currently blocks the caller.
+   Returns thrd_success if the lock was acquired immediately (sqe is left untouched), thrd_busy if
+   sqe was prepared and must be submitted. Once its completion arrives (res 0 or -EAGAIN) call the
+   function again. `draining` must point to an int initialised to 0 and be passed unchanged on every
+   retry; it is non-zero while the writer owns `writer_locked` and only waits for readers to drain,
+   in which case giving up requires smtx_unlock_exclusive. On SMTX_PREFER_READERS locks the writer
+   waits for the readers to leave before it takes the writer word, so new readers are never held
+   back and `draining` stays 0. sqe->user_data is left to the caller.
+   SMTX_FLAG_PI locks are rejected with thrd_error, the kernel only hands them over to FUTEX_LOCK_PI,
+   and so are SMTX_FLAG_ROBUST locks, whose dead writer would never complete the wait, locks with a
+   wait strategy, whose releasers only wake through the strategy, and SMTX_EARLIEST_DEADLINE locks,
+   whose trylock fails while anyone is queued and whose queue has no word to wait on. */
+SMTX_DEF int smtx_uring_prep_lock_shared   (smtx_t *smtx, struct io_uring_sqe *sqe);
+SMTX_DEF int smtx_uring_prep_lock_exclusive(smtx_t *smtx, struct io_uring_sqe *sqe, int *draining);
+#endif
+
 #endif //SMTX_H
 
 #ifdef SMTX_IMPLEMENTATION
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <threads.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* glibc 2.35+ registers an rseq area for every thread, whose cpu_id the kernel keeps current. */
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 35) && defined(__has_builtin)
+#if __has_builtin(__builtin_thread_pointer)
+#define SMTX_RSEQ
+#include <sys/rseq.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+#if defined(__linux__) && !defined(SMTX_NO_FUTEX)
+#define SMTX_FUTEX
+#include <linux/futex.h>
+
+#ifndef FUTEX_LOCK_PI2
+#define FUTEX_LOCK_PI2 13
+#endif
+
+/* Not every distribution ships recent uapi headers yet, so the futex2 ABI values are spelled out. */
+#undef SMTX_FUTEX2_SIZE_U32
+#define SMTX_FUTEX2_SIZE_U32 0x02
+#undef SMTX_FUTEX2_PRIVATE
+#define SMTX_FUTEX2_PRIVATE 128
+#undef SMTX_SYS_FUTEX_WAITV
+#define SMTX_SYS_FUTEX_WAITV 449
+
+typedef struct {
+    uint64_t val;
+    uint64_t uaddr;
+    uint32_t flags;
+    uint32_t __reserved;
+} smtx_futex_waitv_t;
+#endif
 
 #undef SMTX_UTIL
 #define SMTX_UTIL static inline
 
 #undef SMTX_IMPL
+#undef SMTX_IMPL_DATA
 #ifdef SMTX_STATIC
 #define SMTX_IMPL static inline
+#define SMTX_IMPL_DATA static
 #else
 #define SMTX_IMPL extern inline
+#define SMTX_IMPL_DATA
 #endif
 
 typedef uint64_t smtx_ns_t;
@@ -129,6 +608,38 @@ typedef uint64_t smtx_ns_t;
 #define SMTX_YIELD_THRESHOLD 512
 #endif
 
+#ifndef SMTX_WAIT_NANOSLEEP_NS
+#define SMTX_WAIT_NANOSLEEP_NS 50000
+#endif
+
+#ifndef SMTX_MAX_COMBINE_PASSES
+#define SMTX_MAX_COMBINE_PASSES 4
+#endif
+
+#ifndef SMTX_SPINNERS_PER_CPU
+#define SMTX_SPINNERS_PER_CPU 2
+#endif
+
+#ifndef SMTX_MAX_HELP_DEPTH
+#define SMTX_MAX_HELP_DEPTH 4
+#endif
+
+#ifndef SMTX_PRIO_NORMAL_AGE_NS
+#define SMTX_PRIO_NORMAL_AGE_NS 1000000
+#endif
+
+#ifndef SMTX_PRIO_BATCH_AGE_NS
+#define SMTX_PRIO_BATCH_AGE_NS 100000000
+#endif
+
+#ifndef SMTX_RESCHED_WINDOW_NS
+#define SMTX_RESCHED_WINDOW_NS 50000
+#endif
+
+#ifndef SMTX_ROBUST_POLL_NS
+#define SMTX_ROBUST_POLL_NS 1000000
+#endif
+
 #ifndef SMTX_YIELD
 #include <threads.h>
 #define SMTX_YIELD thrd_yield()
@@ -179,194 +690,2622 @@ SMTX_UTIL void spin_with_yield(uint spins) {
     }
 }
 
-SMTX_IMPL int smtx_init(smtx_t *smtx) {
-    if (smtx == NULL) {
-        return thrd_error;
-    }
+/* Wake up to `count` sleepers on `addr`, returns how many were woken (-1 on error). */
+SMTX_UTIL int futex_wake(atomic_uint *addr, int count, uint flags) {
+#ifdef SMTX_FUTEX
+    return (int)syscall(SYS_futex, addr, (flags & SMTX_FLAG_PSHARED) ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+#else
+    (void)addr;
+    (void)count;
+    (void)flags;
+    return 0;
+#endif
+}
 
-    atomic_init(&smtx->reader_count, 0);
-    atomic_init(&smtx->writer_locked, false);
+/* Sleep while *addr == expected, returns false once `time_point` (SMTX_CLOCK_ID, NULL for none) passed. */
+SMTX_UTIL bool futex_wait(atomic_uint *addr, uint expected, const struct timespec *time_point, uint flags) {
+#ifdef SMTX_FUTEX
+    const int op = ((flags & SMTX_FLAG_PSHARED) ? FUTEX_WAIT_BITSET : FUTEX_WAIT_BITSET_PRIVATE)
+                 | (SMTX_CLOCK_ID == CLOCK_REALTIME ? FUTEX_CLOCK_REALTIME : 0);
+    return syscall(SYS_futex, addr, op, expected, time_point, NULL, FUTEX_BITSET_MATCH_ANY) == 0 || errno != ETIMEDOUT;
+#else
+    (void)addr;
+    (void)expected;
+    (void)flags;
+    return time_point == NULL || ns_since_epoch() < ns_from_timespec(time_point);
+#endif
+}
 
-    return thrd_success;
+SMTX_UTIL void wait_spin(void *ctx, atomic_uint *addr, unsigned expected, const struct timespec *deadline) {
+    (void)ctx;
+    (void)addr;
+    (void)expected;
+    (void)deadline;
 }
 
-SMTX_IMPL int smtx_lock_shared(smtx_t *smtx) {
-    if (smtx == NULL) {
-        return thrd_error;
+SMTX_UTIL void wait_yield(void *ctx, atomic_uint *addr, unsigned expected, const struct timespec *deadline) {
+    (void)ctx;
+    (void)addr;
+    (void)expected;
+    (void)deadline;
+    SMTX_YIELD;
+}
+
+SMTX_UTIL void wait_futex(void *ctx, atomic_uint *addr, unsigned expected, const struct timespec *deadline) {
+    (void)ctx;
+    futex_wait(addr, expected, deadline, 0);
+}
+
+SMTX_UTIL void wake_futex(void *ctx, atomic_uint *addr, int n) {
+    (void)ctx;
+    futex_wake(addr, n, 0);
+}
+
+SMTX_UTIL void wait_nanosleep(void *ctx, atomic_uint *addr, unsigned expected, const struct timespec *deadline) {
+    (void)ctx;
+    (void)addr;
+    (void)expected;
+    smtx_ns_t ns = SMTX_WAIT_NANOSLEEP_NS;
+    if (deadline != NULL) {
+        const smtx_ns_t now = ns_since_epoch(), until = ns_from_timespec(deadline);
+        ns = now >= until ? 0 : until - now < ns ? until - now : ns;
     }
+    const struct timespec duration = {.tv_sec = (time_t)(ns / SMTX_NS_PER_S), .tv_nsec = (long)(ns % SMTX_NS_PER_S)};
+    thrd_sleep(&duration, NULL);
+}
 
-    uint spins = 1;
-    while (true) {
-        while (atomic_load_explicit(&smtx->writer_locked, memory_order_acquire)) {
-            spin_with_yield(spins);
-            if (spins < SMTX_MAX_WRITER_WAIT_SPINS) {
-                spins = SMTX_NEXT_SPINS(spins);
-            }
-        }
+SMTX_IMPL_DATA const smtx_wait_strategy_t smtx_wait_spin = {wait_spin, NULL, NULL};
+SMTX_IMPL_DATA const smtx_wait_strategy_t smtx_wait_spin_yield = {wait_yield, NULL, NULL};
+#ifdef SMTX_FUTEX
+SMTX_IMPL_DATA const smtx_wait_strategy_t smtx_wait_spin_futex = {wait_futex, wake_futex, NULL};
+#else
+SMTX_IMPL_DATA const smtx_wait_strategy_t smtx_wait_spin_futex = {wait_yield, NULL, NULL}; // no futex, degrade to yielding
+#endif
+SMTX_IMPL_DATA const smtx_wait_strategy_t smtx_wait_spin_nanosleep = {wait_nanosleep, NULL, NULL};
 
-        atomic_fetch_add_explicit(&smtx->reader_count, 1, memory_order_relaxed);
+#ifdef __linux__
+SMTX_UTIL uint *cached_tid(void) {
+    static _Thread_local uint tid;
+    return &tid;
+}
 
-        if (!atomic_load_explicit(&smtx->writer_locked, memory_order_acquire)) {
-            return thrd_success;
-        }
+/* The forking thread lives on in the child under a new TID, robust and PI owners must not name
+   the parent. */
+SMTX_UTIL void forget_tid(void) {
+    *cached_tid() = 0;
+}
 
-        atomic_fetch_sub_explicit(&smtx->reader_count, 1, memory_order_release);
-    }
+SMTX_UTIL void forget_tid_on_fork(void) {
+    pthread_atfork(NULL, NULL, forget_tid);
 }
+#endif
 
-SMTX_IMPL int smtx_trylock_shared(smtx_t *smtx) {
-    if (smtx == NULL) {
-        return thrd_error;
+SMTX_UTIL uint current_tid(void) {
+#ifdef __linux__
+    uint *tid = cached_tid();
+    if (*tid == 0) {
+        static once_flag once = ONCE_FLAG_INIT;
+        call_once(&once, forget_tid_on_fork);
+        *tid = (uint)syscall(SYS_gettid);
     }
+    return *tid;
+#else
+    return SMTX_WRITER_LOCKED;
+#endif
+}
 
-    if (atomic_load_explicit(&smtx->writer_locked, memory_order_acquire)) {
-        return thrd_busy;
+#undef SMTX_NO_CPU
+#define SMTX_NO_CPU (-1)
+
+/* CPU the calling thread runs on, SMTX_NO_CPU if unknown. A plain load from the rseq area, cheap
+   enough to be recorded on every acquisition. */
+SMTX_UTIL int current_cpu(void) {
+#ifdef SMTX_RSEQ
+    if (__rseq_size > 0) {
+        const volatile struct rseq *rseq = (const volatile struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+        const int cpu = (int)rseq->cpu_id; // negative while unregistered
+        return cpu >= 0 ? cpu : SMTX_NO_CPU;
     }
+#endif
+    return SMTX_NO_CPU;
+}
 
-    atomic_fetch_add_explicit(&smtx->reader_count, 1, memory_order_relaxed);
-
-    if (atomic_load_explicit(&smtx->writer_locked, memory_order_acquire)) {
-        atomic_fetch_sub_explicit(&smtx->reader_count, 1, memory_order_release);
-        return thrd_busy;
+/* The calling thread's rseq area, NULL if it has none. */
+SMTX_UTIL const void *current_rseq(void) {
+#ifdef SMTX_RSEQ
+    if (__rseq_size > 0) {
+        return (const char *)__builtin_thread_pointer() + __rseq_offset;
     }
+#endif
+    return NULL;
+}
 
-    return thrd_success;
+/* CPU the thread owning the rseq area `rseq` runs on, or last ran on, SMTX_NO_CPU if unknown. The
+   thread may have exited since its area was recorded and its stack be unmapped, so the kernel
+   copies the field (a system call) rather than a load that could fault. */
+SMTX_UTIL int rseq_cpu(const void *rseq) {
+#ifdef SMTX_RSEQ
+    int32_t cpu = -1;
+    struct iovec local = {&cpu, sizeof(cpu)};
+    struct iovec remote = {(char *)rseq + offsetof(struct rseq, cpu_id), sizeof(cpu)};
+    if (rseq != NULL && syscall(SYS_process_vm_readv, getpid(), &local, 1, &remote, 1, 0) == (long)sizeof(cpu) && cpu >= 0) {
+        return (int)cpu;
+    }
+#else
+    (void)rseq;
+#endif
+    return SMTX_NO_CPU;
 }
 
-SMTX_IMPL int smtx_timedlock_shared(smtx_t *smtx, const struct timespec *time_point) {
-    if (smtx == NULL || time_point == NULL) {
-        return thrd_error;
+/* CPUs this thread may run on, 0 if unknown. */
+SMTX_UTIL uint affinity_cpus(void) {
+#ifdef __linux__
+    unsigned long long mask[16] = {0}; // up to 1024 CPUs, more leave the count unknown
+    const long bytes = syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask);
+    uint count = 0;
+    for (long i = 0; i < bytes / (long)sizeof(mask[0]); ++i) {
+        for (unsigned long long bits = mask[i]; bits != 0; bits &= bits - 1) {
+            count += 1;
+        }
     }
+    return count;
+#else
+    return 0;
+#endif
+}
 
-    uint spins = 1;
-    const smtx_ns_t deadline = ns_from_timespec(time_point);
-    while (ns_since_epoch() < deadline) {
-        if (atomic_load_explicit(&smtx->writer_locked, memory_order_acquire)) {
-            spin_with_yield(spins);
-            if (spins < SMTX_MAX_WRITER_WAIT_SPINS) {
-                spins = SMTX_NEXT_SPINS(spins);
-            }
-            continue;
+/* CPUs the tightest cgroup v2 cpu.max on the way from our cgroup up to the root allows (quota over
+   period, rounded up), 0 if no level sets a quota or cgroup v2 is not mounted. */
+SMTX_UTIL uint quota_cpus(void) {
+#ifdef __linux__
+    char cgroup[512] = "";
+    FILE *file = fopen("/proc/self/cgroup", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    char line[sizeof(cgroup) + 4];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) { // the unified hierarchy
+            snprintf(cgroup, sizeof(cgroup), "%.*s", (int)strcspn(line + 3, "\n"), line + 3);
+            break;
         }
+    }
+    fclose(file);
+    if (cgroup[0] != '/') {
+        return 0;
+    }
 
-        atomic_fetch_add_explicit(&smtx->reader_count, 1, memory_order_relaxed);
+    static const char *const mounts[] = {"/sys/fs/cgroup", "/sys/fs/cgroup/unified"}; // unified, hybrid
+    uint cpus = 0;
+    for (size_t i = 0; i < sizeof(mounts) / sizeof(mounts[0]); ++i) {
+        for (size_t len = strlen(cgroup);; --len) {
+            char path[sizeof(cgroup) + 64];
+            snprintf(path, sizeof(path), "%s%.*s/cpu.max", mounts[i], (int)len, cgroup);
+            if ((file = fopen(path, "r")) != NULL) {
+                char quota[32];
+                unsigned long long period;
+                if (fscanf(file, "%31s %llu", quota, &period) == 2 && strcmp(quota, "max") != 0 && period > 0) {
+                    const unsigned long long limit = (strtoull(quota, NULL, 10) + period - 1) / period;
+                    if (limit > 0 && (cpus == 0 || limit < cpus)) {
+                        cpus = (uint)limit;
+                    }
+                }
+                fclose(file);
+            }
 
-        if (!atomic_load_explicit(&smtx->writer_locked, memory_order_acquire)) {
-            return thrd_success;
+            while (len > 1 && cgroup[len - 1] != '/') { // on to the parent, "/" last
+                --len;
+            }
+            if (len <= 1) {
+                break;
+            }
         }
+    }
+    return cpus;
+#else
+    return 0;
+#endif
+}
 
-        atomic_fetch_sub_explicit(&smtx->reader_count, 1, memory_order_release);
+/* Process-wide spin policy. With many waiters, or many locks, every backoff round spinning at once
+   can keep more threads busy than there are CPUs, starving the holders they wait for, so waiters
+   take a slot from the governor when they start spinning, give it back when they sleep or get the
+   lock, and go straight to the blocking step when none is left. The slots scale with the effective
+   parallelism, the affinity mask lowered to the cgroup CPU quota: with a single CPU nobody spins,
+   and a quota below the affinity mask shrinks spin budgets, as spinning then burns quota the
+   holder needs. */
+typedef struct {
+    alignas(SMTX_CACHE_LINE_SIZE) atomic_uint spinning;
+    atomic_uint cpus;  // effective parallelism, 0 until detected, UINT32_MAX if unknown
+    atomic_uint shift; // spin budgets are halved this many times
+} smtx_governor_t;
+
+SMTX_IMPL_DATA smtx_governor_t smtx_governor;
+
+SMTX_UTIL void governor_configure(uint cpus) {
+    const uint affinity = affinity_cpus();
+    uint shift = 0;
+    if (cpus == 0) {
+        const uint quota = quota_cpus();
+        cpus = quota != 0 && (affinity == 0 || quota < affinity) ? quota : affinity;
+    }
+    for (uint ratio = cpus != 0 ? affinity / cpus : 0; ratio > 1; ratio /= 2) {
+        shift += 1;
+    }
+    atomic_store_explicit(&smtx_governor.shift, shift, memory_order_relaxed);
+    atomic_store_explicit(&smtx_governor.cpus, cpus != 0 ? cpus : UINT32_MAX, memory_order_relaxed);
+}
 
-        spin_with_yield(spins);
-        if (spins < SMTX_MAX_WRITER_WAIT_SPINS) {
-            spins = SMTX_NEXT_SPINS(spins);
-        }
+SMTX_UTIL void governor_detect(void) {
+    if (atomic_load_explicit(&smtx_governor.cpus, memory_order_relaxed) == 0) { // not set by smtx_set_parallelism meanwhile
+        governor_configure(0);
     }
+}
 
-    return thrd_timedout;
+/* The effective parallelism, detected by the first caller that needs it: the affinity and cgroup
+   files are read once per process, neither by smtx_init nor again by later waits. */
+SMTX_UTIL uint governor_cpus(void) {
+    uint cpus = atomic_load_explicit(&smtx_governor.cpus, memory_order_relaxed);
+    if (cpus == 0) {
+        static once_flag once = ONCE_FLAG_INIT;
+        call_once(&once, governor_detect);
+        cpus = atomic_load_explicit(&smtx_governor.cpus, memory_order_relaxed);
+    }
+    return cpus;
 }
 
-SMTX_IMPL int smtx_unlock_shared(smtx_t *smtx) {
-    if (smtx == NULL) {
-        return thrd_error;
+/* Spin count `spins` scaled down to the CPU quota. */
+SMTX_UTIL uint governor_budget(uint spins) {
+    return spins >> atomic_load_explicit(&smtx_governor.shift, memory_order_relaxed);
+}
+
+SMTX_UTIL uint governor_limit(void) {
+    const uint cpus = governor_cpus();
+    if (cpus <= 1) {
+        return 0;
     }
+    return cpus == UINT32_MAX || SMTX_SPINNERS_PER_CPU == 0 ? UINT32_MAX : cpus * SMTX_SPINNERS_PER_CPU;
+}
 
-#ifdef SMTX_DEBUG
-    SMTX_ASSERT(atomic_load_explicit(&smtx->reader_count, memory_order_relaxed) > 0);
-#endif
+SMTX_UTIL bool governor_full(void) {
+    return atomic_load_explicit(&smtx_governor.spinning, memory_order_relaxed) >= governor_limit();
+}
+
+SMTX_UTIL bool governor_enter(void) {
+    if (governor_full()) { // read only, so a saturated governor's line stays shared
+        return false;
+    }
+    if (atomic_fetch_add_explicit(&smtx_governor.spinning, 1, memory_order_relaxed) >= governor_limit()) {
+        atomic_fetch_sub_explicit(&smtx_governor.spinning, 1, memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
 
-    atomic_fetch_sub_explicit(&smtx->reader_count, 1, memory_order_release);
+SMTX_UTIL void governor_leave(void) {
+    atomic_fetch_sub_explicit(&smtx_governor.spinning, 1, memory_order_relaxed);
+}
 
-    return thrd_success;
+/* Record the calling thread as the holder in `holder`. */
+SMTX_UTIL void record_holder(smtx_holder_t *holder) {
+    atomic_store_explicit(&holder->rseq, current_rseq(), memory_order_relaxed);
+    atomic_store_explicit(&holder->cpu, current_cpu(), memory_order_relaxed);
 }
 
-SMTX_IMPL int smtx_lock_exclusive(smtx_t *smtx) {
-    if (smtx == NULL) {
-        return thrd_error;
+/* Forget the holder recorded in `holder` if it is us, a holder on its way out is no reason to park. */
+SMTX_UTIL void forget_holder(smtx_holder_t *holder) {
+    const void *rseq = current_rseq();
+    if (rseq != NULL && atomic_load_explicit(&holder->rseq, memory_order_relaxed) == rseq) {
+        atomic_store_explicit(&holder->cpu, SMTX_NO_CPU, memory_order_relaxed);
+        atomic_store_explicit(&holder->rseq, NULL, memory_order_relaxed);
     }
+}
+
+/* Value a writer stores in `writer_locked` while holding the lock. */
+SMTX_UTIL uint writer_value(const smtx_t *smtx) {
+    return (smtx->flags & (SMTX_FLAG_ROBUST | SMTX_FLAG_PI)) ? current_tid() : SMTX_WRITER_LOCKED;
+}
+
+#ifdef SMTX_FUTEX
+SMTX_UTIL int pi_futex_op(const smtx_t *smtx, int op) {
+    return op | ((smtx->flags & SMTX_FLAG_PSHARED) ? 0 : FUTEX_PRIVATE_FLAG);
+}
+#endif
 
-    bool expected = false;
-    while (!atomic_compare_exchange_weak_explicit(&smtx->writer_locked, &expected, true, memory_order_acquire, memory_order_relaxed)) {
-        expected = false;
+/* SMTX_FLAG_PI writer word: the kernel owns SMTX_WAITERS and hands the word directly to the highest
+   priority sleeper on unlock, so the owner is released with FUTEX_UNLOCK_PI whenever it is set. */
+SMTX_UTIL void pi_unlock_writer(smtx_t *smtx) {
+#ifdef SMTX_FUTEX
+    uint word = atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed);
+    if ((word & SMTX_WAITERS)
+        || !atomic_compare_exchange_strong_explicit(&smtx->writer_locked, &word, 0, memory_order_release, memory_order_relaxed)) {
+        syscall(SYS_futex, &smtx->writer_locked, pi_futex_op(smtx, FUTEX_UNLOCK_PI), 0, NULL, NULL, 0);
     }
+#else
+    atomic_store_explicit(&smtx->writer_locked, 0, memory_order_release);
+#endif
+}
 
-    uint spins = 1;
-    while (atomic_load_explicit(&smtx->reader_count, memory_order_acquire) > 0) {
-        spin_with_yield(spins);
-        if (spins < SMTX_MAX_READER_WAIT_SPINS) {
-            spins = SMTX_NEXT_SPINS(spins);
+SMTX_UTIL uint reader_count_of(uint word) {
+    return word & SMTX_STATE_MASK;
+}
+
+/* Mark `word` as having a sleeper unless it already reached `until`, returns the value to sleep on. */
+SMTX_UTIL uint announce_waiter(atomic_uint *word, uint until) {
+    uint curr = atomic_load_explicit(word, memory_order_seq_cst); // may be the check half of the pattern below
+    while (reader_count_of(curr) != until && !(curr & SMTX_WAITERS)) {
+        if (atomic_compare_exchange_weak_explicit(word, &curr, curr | SMTX_WAITERS, memory_order_relaxed, memory_order_relaxed)) {
+            return curr | SMTX_WAITERS;
         }
     }
+    return curr;
+}
 
-    return thrd_success;
+/* The lock's extension, NULL until a feature allocated it. Acquire, as it was set up before it was
+   published. */
+SMTX_UTIL smtx_ext_t *ext_of(const smtx_t *smtx) {
+    return atomic_load_explicit(&smtx->ext, memory_order_acquire);
 }
 
-SMTX_IMPL int smtx_trylock_exclusive(smtx_t *smtx) {
-    if (smtx == NULL) {
-        return thrd_error;
-    }
+/* The compile-time defaults, the tuning of every lock smtx_init_attr did not configure otherwise. */
+SMTX_UTIL void tuning_init(smtx_tuning_t *tuning) {
+    tuning->yield_threshold = SMTX_YIELD_THRESHOLD;
+    tuning->park_after = 0;
+    tuning->spin_ns = 0;
+    tuning->wait = NULL;
+    tuning->admission = NULL;
+    tuning->stats = NULL;
+}
 
-    bool expected = false;
-    if (!atomic_compare_exchange_weak_explicit(&smtx->writer_locked, &expected, true, memory_order_acquire, memory_order_relaxed)) {
-        return thrd_busy;
+/* The lock's extension, allocated by the first caller that needs it, NULL if out of memory. Whoever
+   loses the race to publish one frees theirs. Seq_cst, smtx_cond_broadcast publishes it on the way
+   to a store-buffering check with releasers. */
+SMTX_UTIL smtx_ext_t *ext_alloc(smtx_t *smtx) {
+    smtx_ext_t *ext = ext_of(smtx);
+    if (ext != NULL) {
+        return ext;
     }
 
-    if (atomic_load_explicit(&smtx->reader_count, memory_order_acquire) > 0) {
-        atomic_store_explicit(&smtx->writer_locked, false, memory_order_release);
-        return thrd_busy;
+    smtx_ext_t *fresh = malloc(sizeof(*fresh));
+    if (fresh == NULL) {
+        return NULL;
+    }
+#ifndef SMTX_PREVENT_FALSE_SHARING
+    tuning_init(&fresh->tuning);
+#endif
+    fresh->name = NULL;
+    atomic_init(&fresh->deadline_queue, NULL);
+    atomic_flag_clear_explicit(&fresh->deadline_lock, memory_order_relaxed);
+    atomic_init(&fresh->writer.cpu, SMTX_NO_CPU);
+    atomic_init(&fresh->writer.rseq, NULL);
+    atomic_init(&fresh->reader.cpu, SMTX_NO_CPU);
+    atomic_init(&fresh->reader.rseq, NULL);
+    atomic_init(&fresh->combine_head, NULL);
+    fresh->snzi = NULL;
+    atomic_init(&fresh->drain_fn, NULL);
+    fresh->drain_arg = NULL;
+    atomic_init(&fresh->requeued, 0);
+    if (atomic_compare_exchange_strong_explicit(&smtx->ext, &ext, fresh, memory_order_seq_cst, memory_order_acquire)) {
+        return fresh;
     }
+    free(fresh);
+    return ext;
+}
 
-    return thrd_success;
+/* Internal flag bits, set from smtx_attr_t.fairness, by smtx_init_attr for a compact lock whose
+   tuning is not the default and by smtx_use_snzi. */
+#define SMTX_FLAG_PREFER_READERS 0x100u
+#define SMTX_FLAG_DEADLINE_ORDER 0x200u
+#define SMTX_FLAG_SNZI           0x400u
+#define SMTX_FLAG_TUNED          0x800u
+
+/* The lock's tuning: on the writer line in the padded layout; in the extension of SMTX_FLAG_TUNED
+   locks in the compact one, whose other locks all share the defaults. */
+#ifdef SMTX_PREVENT_FALSE_SHARING
+SMTX_UTIL const smtx_tuning_t *tuning_of(const smtx_t *smtx) {
+    return &smtx->tuning;
 }
+#else
+static const smtx_tuning_t smtx_default_tuning = {SMTX_YIELD_THRESHOLD, 0, 0, NULL, NULL, NULL};
 
-SMTX_IMPL int smtx_timedlock_exclusive(smtx_t *smtx, const struct timespec *time_point) {
-    if (smtx == NULL || time_point == NULL) {
-        return thrd_error;
-    }
+SMTX_UTIL const smtx_tuning_t *tuning_of(const smtx_t *smtx) {
+    return (smtx->flags & SMTX_FLAG_TUNED) ? &ext_of(smtx)->tuning : &smtx_default_tuning;
+}
+#endif
 
-    uint spins = 1;
-    const smtx_ns_t deadline = ns_from_timespec(time_point);
-    bool expected = false;
+SMTX_UTIL const smtx_wait_strategy_t *wait_strategy(const smtx_t *smtx) {
+    return tuning_of(smtx)->wait;
+}
 
-    while (!atomic_compare_exchange_weak_explicit(&smtx->writer_locked, &expected, true, memory_order_acquire, memory_order_relaxed)) {
-        if (ns_since_epoch() >= deadline) {
-            return thrd_timedout;
-        }
-        expected = false;
+SMTX_UTIL uint yield_threshold_of(const smtx_t *smtx) {
+    return tuning_of(smtx)->yield_threshold;
+}
+
+SMTX_UTIL smtx_admission_t *admission_of(const smtx_t *smtx) {
+    return tuning_of(smtx)->admission;
+}
+
+/* A fiber parked on a lock word, lives on the fiber's stack until it is woken. */
+typedef struct smtx_fiber_waiter {
+    struct smtx_fiber_waiter *next;
+    atomic_uint *word;
+    void (*unpark)(void *ctx, void *fiber);
+    void *ctx;
+    void *fiber;
+    atomic_bool woken;
+} smtx_fiber_waiter_t;
+
+typedef struct {
+    alignas(SMTX_CACHE_LINE_SIZE) atomic_flag busy;
+    smtx_fiber_waiter_t *head; // FIFO
+} smtx_lot_bucket_t;
+
+#define SMTX_LOT_BUCKETS 64
+
+/* Parking lot of the waiters that queue outside the lock words, hashed by address so locks stay the
+   same size. `fibers` is set when the first thread installs fiber hooks, releases only look for
+   parked fibers after that. */
+typedef struct {
+    atomic_bool fibers;
+    smtx_lot_bucket_t buckets[SMTX_LOT_BUCKETS];
+} smtx_lot_t;
+
+SMTX_IMPL_DATA smtx_lot_t smtx_lot;
+
+SMTX_UTIL const smtx_fiber_hooks_t **fiber_hooks(void) {
+    static _Thread_local const smtx_fiber_hooks_t *hooks;
+    return &hooks;
+}
+
+SMTX_UTIL smtx_lot_bucket_t *lot_bucket(const atomic_uint *word) {
+    return &smtx_lot.buckets[((uintptr_t)word / sizeof(*word)) % SMTX_LOT_BUCKETS];
+}
+
+/* Spinlock for the few pointer updates of a queue. */
+SMTX_UTIL void flag_lock(atomic_flag *flag) {
+    for (uint spins = 1; atomic_flag_test_and_set_explicit(flag, memory_order_acquire); spins = SMTX_NEXT_SPINS(spins)) {
         spin_with_yield(spins);
-        if (spins < SMTX_MAX_READER_WAIT_SPINS) {
-            spins = SMTX_NEXT_SPINS(spins);
-        }
     }
+}
 
-    while (atomic_load_explicit(&smtx->reader_count, memory_order_acquire) > 0) {
-        if (ns_since_epoch() >= deadline) {
-            atomic_store_explicit(&smtx->writer_locked, false, memory_order_release);
-            return thrd_timedout;
+SMTX_UTIL void flag_unlock(atomic_flag *flag) {
+    atomic_flag_clear_explicit(flag, memory_order_release);
+}
+
+SMTX_UTIL void lot_lock(smtx_lot_bucket_t *bucket) {
+    flag_lock(&bucket->busy);
+}
+
+SMTX_UTIL void lot_unlock(smtx_lot_bucket_t *bucket) {
+    flag_unlock(&bucket->busy);
+}
+
+/* Make every fiber parked on `word` runnable again. */
+SMTX_UTIL void fiber_unpark_all(atomic_uint *word) {
+    smtx_lot_bucket_t *bucket = lot_bucket(word);
+    smtx_fiber_waiter_t *woken = NULL, **tail = &woken;
+    lot_lock(bucket);
+    for (smtx_fiber_waiter_t **link = &bucket->head; *link != NULL;) {
+        smtx_fiber_waiter_t *waiter = *link;
+        if (waiter->word == word) {
+            *link = waiter->next;
+            *tail = waiter;
+            tail = &waiter->next;
+        } else {
+            link = &waiter->next;
         }
-        spin_with_yield(spins);
-        if (spins < SMTX_MAX_READER_WAIT_SPINS) {
-            spins = SMTX_NEXT_SPINS(spins);
+    }
+    *tail = NULL;
+    lot_unlock(bucket);
+
+    while (woken != NULL) {
+        // The waiter may return and free its node as soon as it sees `woken`, copy out first.
+        smtx_fiber_waiter_t *waiter = woken;
+        void (*unpark)(void *, void *) = waiter->unpark;
+        void *ctx = waiter->ctx, *fiber = waiter->fiber;
+        woken = waiter->next;
+        atomic_store_explicit(&waiter->woken, true, memory_order_release);
+        unpark(ctx, fiber);
+    }
+}
+
+/* Wake everyone announced on `word`, through the lock's wait strategy if it has one. */
+SMTX_UTIL void wake_waiters(smtx_t *smtx, atomic_uint *word) {
+    const smtx_wait_strategy_t *strategy = wait_strategy(smtx);
+    if (strategy == NULL) {
+        futex_wake(word, INT32_MAX, smtx->flags);
+        if (atomic_load_explicit(&smtx_lot.fibers, memory_order_relaxed) && !(smtx->flags & SMTX_FLAG_PSHARED)) {
+            fiber_unpark_all(word);
         }
+    } else if (strategy->wake != NULL) {
+        strategy->wake(strategy->ctx, word, INT32_MAX);
     }
+}
 
-    return thrd_success;
+SMTX_UTIL void release_readers(smtx_t *smtx, uint count) {
+    const uint prev = atomic_fetch_sub_explicit(&smtx->reader_count, count, memory_order_release);
+    if (prev == (SMTX_WAITERS | count)) {
+        atomic_fetch_and_explicit(&smtx->reader_count, SMTX_STATE_MASK, memory_order_acquire); // pairs with smtx_notify_drained
+        wake_waiters(smtx, &smtx->reader_count);
+
+        // A writer waiting through smtx_notify_drained announced itself with the same bit.
+        smtx_ext_t *ext = ext_of(smtx);
+        void (*fn)(void *) = ext != NULL ? atomic_exchange_explicit(&ext->drain_fn, NULL, memory_order_relaxed) : NULL;
+        if (fn != NULL) {
+            fn(ext->drain_arg);
+        }
+    }
 }
 
-SMTX_IMPL int smtx_unlock_exclusive(smtx_t *smtx) {
-    if (smtx == NULL) {
-        return thrd_error;
+/* smtx->waiting bits: a waiter of that mode spun on the lock since the last cond_resched. */
+#define SMTX_WAITING_SHARED    0x1u
+#define SMTX_WAITING_EXCLUSIVE 0x2u
+
+/* Leave the mark once per wait, the check keeps repeated rounds off the reader line. */
+SMTX_UTIL void announce_spinning(smtx_t *smtx, uint mark) {
+    if (!(atomic_load_explicit(&smtx->waiting, memory_order_relaxed) & mark)) {
+        atomic_fetch_or_explicit(&smtx->waiting, mark, memory_order_relaxed);
     }
+}
 
-#ifdef SMTX_DEBUG
-    SMTX_ASSERT(atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed));
-#endif
+#define SMTX_STAT_ADD(smtx, counter, n)                                                          \
+    do {                                                                                         \
+        smtx_stats_t *stats_ = tuning_of(smtx)->stats;                                           \
+        if (stats_ != NULL) {                                                                    \
+            atomic_fetch_add_explicit(&stats_->counter, (n), memory_order_relaxed);              \
+        }                                                                                        \
+    } while (0)
 
-    atomic_store_explicit(&smtx->writer_locked, false, memory_order_release);
+#define SMTX_STAT(smtx, counter) SMTX_STAT_ADD(smtx, counter, 1)
 
-    return thrd_success;
+#define SMTX_SNZI_HALF    1ull
+#define SMTX_SNZI_ONE     2ull
+#define SMTX_SNZI_VERSION (1ull << 32)
+
+SMTX_UTIL unsigned long long snzi_surplus(unsigned long long word) {
+    return word & 0xffffffffull;
+}
+
+SMTX_UTIL void snzi_depart(smtx_t *smtx, const smtx_snzi_t *snzi, size_t node);
+
+/* Arrive at `node` of `snzi`, (size_t)-1 stands for the root, which is the lock's reader_count. */
+SMTX_UTIL void snzi_arrive(smtx_t *smtx, const smtx_snzi_t *snzi, size_t node) {
+    if (node == (size_t)-1) {
+        if (smtx->flags & SMTX_FLAG_PREEMPT_AWARE) {
+            record_holder(&ext_of(smtx)->reader);
+        }
+        atomic_fetch_add_explicit(&smtx->reader_count, 1, memory_order_seq_cst);
+        return;
+    }
+
+    atomic_ullong *word = &snzi->nodes[node].word;
+    const size_t parent = node == 0 ? (size_t)-1 : (node - 1) / 2;
+    uint undo = 0;
+    bool done = false;
+    while (!done) {
+        unsigned long long curr = atomic_load_explicit(word, memory_order_seq_cst);
+        if (snzi_surplus(curr) >= SMTX_SNZI_ONE) {
+            done = atomic_compare_exchange_strong_explicit(word, &curr, curr + SMTX_SNZI_ONE, memory_order_seq_cst, memory_order_seq_cst);
+            continue;
+        }
+        if (snzi_surplus(curr) == 0) {
+            const unsigned long long half = (curr & ~0xffffffffull) + SMTX_SNZI_VERSION + SMTX_SNZI_HALF;
+            if (!atomic_compare_exchange_strong_explicit(word, &curr, half, memory_order_seq_cst, memory_order_seq_cst)) {
+                continue;
+            }
+            done = true;
+            curr = half;
+        }
+        // Half way: make sure the parent counts us before the node is published as non-zero.
+        snzi_arrive(smtx, snzi, parent);
+        if (!atomic_compare_exchange_strong_explicit(word, &curr, curr + SMTX_SNZI_HALF, memory_order_seq_cst, memory_order_seq_cst)) {
+            undo += 1;
+        }
+    }
+    while (undo-- > 0) {
+        snzi_depart(smtx, snzi, parent);
+    }
 }
 
+SMTX_UTIL void snzi_depart(smtx_t *smtx, const smtx_snzi_t *snzi, size_t node) {
+    if (node == (size_t)-1) {
+        if (smtx->flags & SMTX_FLAG_PREEMPT_AWARE) {
+            forget_holder(&ext_of(smtx)->reader);
+        }
+        release_readers(smtx, 1);
+        return;
+    }
+
+    atomic_ullong *word = &snzi->nodes[node].word;
+    unsigned long long curr = atomic_load_explicit(word, memory_order_seq_cst);
+    while (!atomic_compare_exchange_weak_explicit(word, &curr, curr - SMTX_SNZI_ONE, memory_order_seq_cst, memory_order_seq_cst)) {
+    }
+    if (snzi_surplus(curr) == SMTX_SNZI_ONE) {
+        snzi_depart(smtx, snzi, node == 0 ? (size_t)-1 : (node - 1) / 2);
+    }
+}
+
+/* Leaf a thread arrives at and departs from, fixed per thread so both ends of a hold agree. */
+SMTX_UTIL size_t snzi_leaf(const smtx_snzi_t *snzi) {
+#ifdef __linux__
+    static _Thread_local size_t slot; // not renewed by fork, a hold taken before must depart where it arrived
+    if (slot == 0) {
+        slot = current_tid();
+    }
+#else
+    static _Thread_local char anchor;
+    const size_t slot = (size_t)((uintptr_t)&anchor * 0x9e3779b97f4a7c15ull >> 40);
+#endif
+    const size_t first = snzi->count / 2;
+    return first + slot % (snzi->count - first);
+}
+
+/* Readers publish themselves in reader_count and then check writer_locked, writers publish in
+   writer_locked and then check reader_count. That is the store-buffering pattern: unless both the
+   update and the following load are seq_cst, C11 allows each side to miss the other's store (the
+   compiler may hoist the load, ARM may satisfy it before the update is visible) and a reader and a
+   writer both get in. The updates are RMWs, so x86 pays nothing extra and ARMv8 only turns the
+   loads into LDAR, which waits for the preceding STLXR. Acquire/relaxed stays on the optimistic
+   first writer_locked check and on everything after the lock is known to be held. */
+SMTX_UTIL bool arrive_readers(smtx_t *smtx, uint count) {
+    if (smtx->flags & SMTX_FLAG_SNZI) {
+        const smtx_snzi_t *snzi = ext_of(smtx)->snzi;
+        snzi_arrive(smtx, snzi, snzi_leaf(snzi)); // count is 1, smtx_lock_shared_n rejects SNZI locks
+        return true;
+    }
+    if (smtx->flags & SMTX_FLAG_PREEMPT_AWARE) {
+        record_holder(&ext_of(smtx)->reader); // sample one holder
+    }
+    if (count == 1) {
+        atomic_fetch_add_explicit(&smtx->reader_count, 1, memory_order_seq_cst);
+        return true;
+    }
+
+    // Several references at once must not carry the count into the waiter bit.
+    uint curr = atomic_load_explicit(&smtx->reader_count, memory_order_relaxed);
+    do {
+        if (reader_count_of(curr) > SMTX_STATE_MASK - count) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&smtx->reader_count, &curr, curr + count, memory_order_seq_cst, memory_order_relaxed));
+    return true;
+}
+
+SMTX_UTIL void depart_readers(smtx_t *smtx, uint count) {
+    if (smtx->flags & SMTX_FLAG_SNZI) {
+        const smtx_snzi_t *snzi = ext_of(smtx)->snzi;
+        snzi_depart(smtx, snzi, snzi_leaf(snzi));
+        return;
+    }
+    if (smtx->flags & SMTX_FLAG_PREEMPT_AWARE) {
+        forget_holder(&ext_of(smtx)->reader);
+    }
+    release_readers(smtx, count);
+}
+
+SMTX_UTIL void arrive_reader(smtx_t *smtx) {
+    arrive_readers(smtx, 1);
+}
+
+SMTX_UTIL void depart_reader(smtx_t *smtx) {
+    depart_readers(smtx, 1);
+}
+
+/* Record the new writer where the lock tracks it (and its TID in debug builds), once `writer_locked`
+   is ours. */
+SMTX_UTIL void claim_writer(smtx_t *smtx) {
+    if (smtx->flags & SMTX_FLAG_PREEMPT_AWARE) {
+        record_holder(&ext_of(smtx)->writer);
+    }
+#ifdef SMTX_DEBUG
+    atomic_store_explicit(&smtx->owner, current_tid(), memory_order_relaxed);
+#endif
+}
+
+/* Let in the next condition waiter smtx_cond_broadcast requeued onto the lock. They sleep on their
+   own word so that releases wake them one at a time, each passing the turn on once it holds the
+   lock again. The word counts broadcasts and is cleared once a wake-up finds nobody, unless a
+   broadcast came in meanwhile. */
+SMTX_UTIL void wake_requeued(smtx_t *smtx) {
+    atomic_thread_fence(memory_order_seq_cst); // the release cleared the waiter bit, pairs with smtx_cond_broadcast
+    smtx_ext_t *ext = ext_of(smtx);
+    if (ext == NULL) {
+        return; // never broadcast to
+    }
+    uint broadcasts = atomic_load_explicit(&ext->requeued, memory_order_relaxed);
+    if (broadcasts != 0 && futex_wake(&ext->requeued, 1, smtx->flags) == 0) {
+        atomic_compare_exchange_strong_explicit(&ext->requeued, &broadcasts, 0, memory_order_relaxed, memory_order_relaxed);
+    }
+}
+
+SMTX_UTIL void release_writer(smtx_t *smtx) {
+    if (smtx->flags & SMTX_FLAG_PREEMPT_AWARE) {
+        atomic_store_explicit(&ext_of(smtx)->writer.cpu, SMTX_NO_CPU, memory_order_relaxed);
+    }
+#ifdef SMTX_DEBUG
+    atomic_store_explicit(&smtx->owner, 0, memory_order_relaxed);
+#endif
+    if (smtx->flags & SMTX_FLAG_PI) {
+        pi_unlock_writer(smtx);
+        return;
+    }
+
+    if (atomic_exchange_explicit(&smtx->writer_locked, 0, memory_order_release) & SMTX_WAITERS) {
+        wake_waiters(smtx, &smtx->writer_locked);
+        wake_requeued(smtx);
+    }
+}
+
+/* State of one wait, carried across backoff() rounds. The last holder_preempted answer is kept with
+   the holder sample and CPU it was for, the system call is repeated only once either changes. A
+   spinning wait keeps its governor slot from round to round until backoff_end. */
+typedef struct {
+    uint spins;
+    uint rounds;
+    smtx_ns_t started;
+    const void *preempt_rseq;
+    int preempt_cpu;
+    bool preempted;
+    bool spinning;
+} smtx_backoff_t;
+
+#define SMTX_BACKOFF_INIT {1, 0, 0, NULL, SMTX_NO_CPU, false, false}
+
+/* Leave the spinning phase: hand the governor slot back before the wait sleeps and once it ends. */
+SMTX_UTIL void backoff_end(smtx_backoff_t *state) {
+    if (state->spinning) {
+        state->spinning = false;
+        governor_leave();
+    }
+}
+
+SMTX_UTIL bool parking_enabled(const smtx_t *smtx) {
+    const smtx_tuning_t *tuning = tuning_of(smtx);
+    return (tuning->park_after != 0 || tuning->spin_ns != 0) && !(smtx->flags & (SMTX_FLAG_ROBUST | SMTX_FLAG_PI));
+}
+
+SMTX_UTIL bool backoff_should_park(const smtx_t *smtx, smtx_backoff_t *state) {
+    if (!parking_enabled(smtx)) {
+        return false;
+    }
+    const smtx_tuning_t *tuning = tuning_of(smtx);
+    if (tuning->park_after != 0 && state->rounds >= tuning->park_after) {
+        return true;
+    }
+    if (tuning->spin_ns != 0) {
+        const smtx_ns_t now = ns_since_epoch();
+        if (state->started == 0) {
+            state->started = now;
+        }
+        return now - state->started >= tuning->spin_ns;
+    }
+    return false;
+}
+
+/* Hand the wait over to the lock's wait strategy, announcing ourselves first if it sleeps. */
+SMTX_UTIL void strategy_wait(smtx_t *smtx, atomic_uint *word, const struct timespec *time_point) {
+    const smtx_wait_strategy_t *strategy = wait_strategy(smtx);
+    const uint expected = strategy->wake != NULL ? announce_waiter(word, 0) : atomic_load_explicit(word, memory_order_relaxed);
+    if (reader_count_of(expected) != 0) {
+        if (strategy->wake != NULL) {
+            SMTX_STAT(smtx, parks);
+        }
+        strategy->wait(strategy->ctx, word, expected, time_point);
+    }
+}
+
+/* Whether the holder of `word` (writer, or the sampled reader) of a SMTX_FLAG_PREEMPT_AWARE lock
+   waits for the CPU we would spin on: it was recorded there and its rseq area still places it
+   there, where we are the ones running. The sample is checked first, the area, which takes a system
+   call to read, only when the sample matches and the wait has not read it for this holder and CPU
+   yet. Only preemption by the waiter itself is detected: a holder recorded on another CPU is assumed
+   to be running, as is one that has moved since, or was preempted after this wait looked: the
+   kernel offers no cheap way to ask. */
+SMTX_UTIL bool holder_preempted(smtx_t *smtx, atomic_uint *word, smtx_backoff_t *state) {
+    if (!(smtx->flags & SMTX_FLAG_PREEMPT_AWARE)) {
+        return false;
+    }
+    smtx_holder_t *holder = word == &smtx->writer_locked ? &ext_of(smtx)->writer : &ext_of(smtx)->reader;
+    const int cpu = current_cpu();
+    if (cpu == SMTX_NO_CPU || atomic_load_explicit(&holder->cpu, memory_order_relaxed) != cpu) {
+        return false;
+    }
+    const void *rseq = atomic_load_explicit(&holder->rseq, memory_order_relaxed);
+    if (rseq != state->preempt_rseq || cpu != state->preempt_cpu) {
+        state->preempt_rseq = rseq;
+        state->preempt_cpu = cpu;
+        state->preempted = rseq != current_rseq() && rseq_cpu(rseq) == cpu;
+    }
+    return state->preempted;
+}
+
+SMTX_UTIL bool deadline_passed(const struct timespec *time_point) {
+    return time_point != NULL && ns_since_epoch() >= ns_from_timespec(time_point);
+}
+
+/* Whether waits on `smtx` by the calling thread park the running fiber rather than the thread. */
+SMTX_UTIL bool fiber_parking(const smtx_t *smtx) {
+    return *fiber_hooks() != NULL && wait_strategy(smtx) == NULL && !(smtx->flags & (SMTX_FLAG_PSHARED | SMTX_FLAG_ROBUST | SMTX_FLAG_PI));
+}
+
+/* Switch to another fiber while `word` holds `expected`, like a futex wait with the lot as the
+   kernel: queue if the word still holds it, park until fiber_unpark_all(word) wakes us. */
+SMTX_UTIL void fiber_wait(smtx_t *smtx, atomic_uint *word, uint expected, const struct timespec *time_point) {
+    const smtx_fiber_hooks_t *hooks = *fiber_hooks();
+    smtx_fiber_waiter_t waiter = {NULL, word, hooks->unpark, hooks->ctx, hooks->current(hooks->ctx), false};
+    smtx_lot_bucket_t *bucket = lot_bucket(word);
+    lot_lock(bucket);
+    const bool queued = atomic_load_explicit(word, memory_order_relaxed) == expected;
+    if (queued) {
+        smtx_fiber_waiter_t **link = &bucket->head;
+        while (*link != NULL) {
+            link = &(*link)->next;
+        }
+        *link = &waiter;
+    }
+    lot_unlock(bucket);
+    if (!queued) {
+        return;
+    }
+
+    SMTX_STAT(smtx, parks);
+    while (!atomic_load_explicit(&waiter.woken, memory_order_acquire)) {
+        if (deadline_passed(time_point)) {
+            lot_lock(bucket);
+            smtx_fiber_waiter_t **link = &bucket->head;
+            while (*link != NULL && *link != &waiter) {
+                link = &(*link)->next;
+            }
+            const bool removed = *link != NULL;
+            if (removed) {
+                *link = waiter.next;
+            }
+            lot_unlock(bucket);
+            if (removed || atomic_load_explicit(&waiter.woken, memory_order_acquire)) {
+                return;
+            }
+            // A release already took us off the queue, its unpark is on the way.
+        }
+        hooks->park(hooks->ctx, time_point);
+    }
+}
+
+/* Park the running fiber until `word` changes: announce, then wait for a release to wake us. */
+SMTX_UTIL void fiber_park(smtx_t *smtx, atomic_uint *word, const struct timespec *time_point) {
+    const uint expected = announce_waiter(word, 0);
+    if (reader_count_of(expected) != 0) {
+        fiber_wait(smtx, word, expected, time_point);
+    }
+}
+
+/* Deadline of one sleep of a robust waiter. A dead writer never wakes it, so it wakes up by itself
+   every SMTX_ROBUST_POLL_NS to look for one. */
+SMTX_UTIL const struct timespec *robust_poll(const struct timespec *time_point, struct timespec *poll) {
+    const smtx_ns_t until = ns_since_epoch() + SMTX_ROBUST_POLL_NS;
+    if (time_point != NULL && ns_from_timespec(time_point) <= until) {
+        return time_point;
+    }
+    poll->tv_sec = (time_t)(until / SMTX_NS_PER_S);
+    poll->tv_nsec = (long)(until % SMTX_NS_PER_S);
+    return poll;
+}
+
+/* Give the CPU up until `word` changes: sleep on it (robust locks for at most SMTX_ROBUST_POLL_NS),
+   or yield where waiters have to keep polling (PI locks leave the writer word's waiter bit to the
+   kernel). */
+SMTX_UTIL void park(smtx_t *smtx, atomic_uint *word, const struct timespec *time_point) {
+    if (fiber_parking(smtx)) {
+        fiber_park(smtx, word, time_point);
+        return;
+    }
+    if (wait_strategy(smtx) != NULL) {
+        strategy_wait(smtx, word, time_point);
+        return;
+    }
+#ifdef SMTX_FUTEX
+    if (!(smtx->flags & SMTX_FLAG_PI)) {
+        const uint expected = announce_waiter(word, 0);
+        if (reader_count_of(expected) != 0) {
+            struct timespec poll;
+            SMTX_STAT(smtx, parks);
+            futex_wait(word, expected, (smtx->flags & SMTX_FLAG_ROBUST) ? robust_poll(time_point, &poll) : time_point, smtx->flags);
+        }
+        return;
+    }
+#endif
+    SMTX_YIELD;
+}
+
+/* Let other threads run for a moment. A fiber parks instead, yielding its OS thread would hold up
+   every other fiber on it, the lock's holder possibly among them. */
+SMTX_UTIL void yield_thread(smtx_t *smtx, atomic_uint *word, const struct timespec *time_point) {
+    if (fiber_parking(smtx)) {
+        fiber_park(smtx, word, time_point);
+    } else {
+        SMTX_YIELD;
+    }
+}
+
+/* One round of waiting for `word` to change: spin with exponential backoff up to `max_spins`,
+   yielding past the lock's yield threshold, or sleep on `word` once the lock's spin budget is spent
+   or its holder is preempted. Spins and the yield threshold shrink under a CPU quota, and a wait
+   that gets no spinner slot from the governor skips the spin and yields, or parks where the lock
+   parks anyway; one that gets a slot keeps it until it sleeps or the caller's backoff_end. A lock
+   with a wait strategy spins the same way and
+   lets the strategy do the yielding or sleeping. Fibers park wherever the thread would yield. Robust
+   waiters that have backed off to `max_spins` sleep between their checks for a dead writer. */
+SMTX_UTIL void backoff(smtx_t *smtx, atomic_uint *word, smtx_backoff_t *state, uint max_spins, const struct timespec *time_point) {
+    state->rounds += 1;
+    const smtx_wait_strategy_t *strategy = wait_strategy(smtx);
+    const uint spins = governor_budget(state->spins), yield_threshold = governor_budget(yield_threshold_of(smtx));
+    if ((smtx->flags & SMTX_FLAG_ROBUST) && state->spins >= max_spins) {
+        backoff_end(state);
+        park(smtx, word, time_point);
+    } else if (holder_preempted(smtx, word, state)) {
+        SMTX_STAT(smtx, holder_preempted);
+        backoff_end(state);
+        park(smtx, word, time_point);
+    } else if (strategy == NULL && backoff_should_park(smtx, state)) {
+        backoff_end(state);
+        park(smtx, word, time_point);
+    } else if (!state->spinning && !governor_enter()) {
+        SMTX_STAT(smtx, throttled);
+        if (strategy != NULL || parking_enabled(smtx)) {
+            park(smtx, word, time_point);
+        } else {
+            yield_thread(smtx, word, time_point);
+        }
+    } else {
+        state->spinning = true;
+        SPIN(spins);
+
+        if (strategy != NULL) {
+            if (spins > yield_threshold || backoff_should_park(smtx, state)) {
+                backoff_end(state); // the strategy may sleep
+                strategy_wait(smtx, word, time_point);
+            }
+        } else if (spins > yield_threshold) {
+            if (fiber_parking(smtx)) {
+                backoff_end(state);
+            }
+            yield_thread(smtx, word, time_point);
+        }
+    }
+
+    // Count up even when the spin was skipped, robust locks look for a dead writer at max_spins.
+    if (state->spins < max_spins) {
+        state->spins = SMTX_NEXT_SPINS(state->spins);
+    }
+}
+
+/* Wait for readers to leave once the writer word is held, returns false once `time_point` passed. */
+SMTX_UTIL bool drain_readers(smtx_t *smtx, const struct timespec *time_point) {
+    smtx_backoff_t state = SMTX_BACKOFF_INIT;
+    while (reader_count_of(atomic_load_explicit(&smtx->reader_count, memory_order_seq_cst)) > 0) {
+        if (deadline_passed(time_point)) {
+            backoff_end(&state);
+            return false;
+        }
+
+        // Under SCHED_FIFO yielding never lets lower priority readers run, so sleep until the last one leaves.
+        if ((smtx->flags & SMTX_FLAG_PI) && state.spins > yield_threshold_of(smtx)) {
+            backoff_end(&state);
+            const uint word = announce_waiter(&smtx->reader_count, 0);
+            if (reader_count_of(word) > 0) {
+                futex_wait(&smtx->reader_count, word, time_point, smtx->flags);
+            }
+            continue;
+        }
+
+        backoff(smtx, &smtx->reader_count, &state, SMTX_MAX_READER_WAIT_SPINS, time_point);
+    }
+    backoff_end(&state);
+    return true;
+}
+
+/* Robust locks only: once a waiter has backed off to `max_spins`, check whether the writer recorded
+   in `word` still exists (kill(tid, 0), no kernel robust list is needed as glibc already owns the
+   thread's one) and take its hold over if not. backoff() then sleeps up to SMTX_ROBUST_POLL_NS
+   between checks. */
+SMTX_UTIL bool take_over_dead_writer(smtx_t *smtx, uint word, uint spins, uint max_spins) {
+#ifdef __linux__
+    if (!(smtx->flags & SMTX_FLAG_ROBUST) || spins < max_spins) {
+        return false;
+    }
+
+    const pid_t tid = (pid_t)(word & SMTX_TID_MASK);
+    if (tid == 0 || kill(tid, 0) == 0 || errno != ESRCH) { // kill(0, 0) would probe our own process group
+        return false;
+    }
+
+    const uint owner = current_tid() | SMTX_OWNER_DIED | (word & SMTX_WAITERS);
+    if (!atomic_compare_exchange_strong_explicit(&smtx->writer_locked, &word, owner, memory_order_seq_cst, memory_order_relaxed)) {
+        return false;
+    }
+    claim_writer(smtx);
+    return true;
+#else
+    (void)smtx;
+    (void)word;
+    (void)spins;
+    (void)max_spins;
+    return false;
+#endif
+}
+
+/* SMTX_FLAG_PI: spin briefly, then sleep in FUTEX_LOCK_PI so the writer inherits our priority.
+   Returns thrd_success, SMTX_OWNERDEAD (previous owner died), thrd_timedout or thrd_error. */
+SMTX_UTIL int pi_lock_writer(smtx_t *smtx, const struct timespec *time_point) {
+#ifdef SMTX_FUTEX
+    const uint tid = current_tid();
+    uint spins = 1;
+    uint expected = 0;
+    while (!atomic_compare_exchange_weak_explicit(&smtx->writer_locked, &expected, tid, memory_order_seq_cst, memory_order_relaxed)) {
+        if (spins <= yield_threshold_of(smtx)) {
+            SPIN(spins);
+            spins = SMTX_NEXT_SPINS(spins);
+            expected = 0;
+            continue;
+        }
+
+        const int clock = SMTX_CLOCK_ID == CLOCK_REALTIME ? FUTEX_CLOCK_REALTIME : 0;
+        if (syscall(SYS_futex, &smtx->writer_locked, pi_futex_op(smtx, FUTEX_LOCK_PI2) | clock, 0, time_point, NULL, 0) == 0
+            || (errno == ENOSYS && time_point == NULL
+                && syscall(SYS_futex, &smtx->writer_locked, pi_futex_op(smtx, FUTEX_LOCK_PI), 0, NULL, NULL, 0) == 0)) {
+            const uint word = atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed);
+            return (word & SMTX_OWNER_DIED) ? SMTX_OWNERDEAD : thrd_success;
+        }
+
+        switch (errno) {
+        case ETIMEDOUT:
+            return thrd_timedout;
+        case ESRCH: // the recorded owner is gone without unlocking
+            if (take_over_dead_writer(smtx, atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed), 1, 1)) {
+                return SMTX_OWNERDEAD;
+            }
+            SMTX_YIELD;
+            break;
+        case EINTR:
+        case EAGAIN:
+            break;
+        default:
+            return thrd_error;
+        }
+        expected = 0;
+    }
+    return thrd_success;
+#else
+    (void)smtx;
+    (void)time_point;
+    return thrd_error;
+#endif
+}
+
+/* SMTX_FLAG_PI reader slow path: borrow the writer word through the kernel, which boosts its current
+   owner, register `count` readers while no writer can be inside and hand the word on. */
+SMTX_UTIL int pi_lock_shared(smtx_t *smtx, uint count, const struct timespec *time_point) {
+    const int result = pi_lock_writer(smtx, time_point);
+    if (result == SMTX_OWNERDEAD) {
+        claim_writer(smtx);
+        drain_readers(smtx, NULL);
+    }
+    if (result != thrd_success) {
+        return result;
+    }
+
+    const bool arrived = arrive_readers(smtx, count);
+    pi_unlock_writer(smtx);
+
+    return arrived ? thrd_success : thrd_error;
+}
+
+SMTX_IMPL int smtx_init(smtx_t *smtx) {
+    if (smtx == NULL) {
+        return thrd_error;
+    }
+
+    atomic_init(&smtx->reader_count, 0);
+    atomic_init(&smtx->writer_locked, 0);
+#ifdef SMTX_DEBUG
+    atomic_init(&smtx->owner, 0);
+#endif
+    smtx->flags = 0;
+    atomic_init(&smtx->waiting, 0);
+    atomic_init(&smtx->ext, NULL);
+#ifdef SMTX_PREVENT_FALSE_SHARING
+    tuning_init(&smtx->tuning);
+#endif
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_destroy(smtx_t *smtx) {
+    if (smtx == NULL) {
+        return thrd_error;
+    }
+
+    free(atomic_exchange_explicit(&smtx->ext, NULL, memory_order_acquire));
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_init_flags(smtx_t *smtx, unsigned flags) {
+    if (smtx == NULL || (flags & ~(SMTX_FLAG_PSHARED | SMTX_FLAG_ROBUST | SMTX_FLAG_PI)) != 0) {
+        return thrd_error;
+    }
+
+#ifndef __linux__
+    if (flags & SMTX_FLAG_ROBUST) {
+        return thrd_error;
+    }
+#endif
+
+#ifndef SMTX_FUTEX
+    if (flags & SMTX_FLAG_PI) {
+        return thrd_error;
+    }
+#endif
+
+    smtx_init(smtx);
+    smtx->flags = (unsigned short)flags;
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_attr_init(smtx_attr_t *attr) {
+    if (attr == NULL) {
+        return thrd_error;
+    }
+
+    attr->flags = 0;
+    attr->spin_ns = 0;
+    attr->yield_threshold = SMTX_YIELD_THRESHOLD;
+    attr->park_after = 0;
+    attr->fairness = SMTX_PREFER_WRITERS;
+    attr->stats = NULL;
+    attr->name = NULL;
+    attr->wait = NULL;
+    attr->admission = NULL;
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_init_attr(smtx_t *smtx, const smtx_attr_t *attr) {
+    if (attr == NULL) {
+        return smtx_init(smtx);
+    }
+
+    if ((attr->fairness != SMTX_PREFER_WRITERS && attr->fairness != SMTX_PREFER_READERS && attr->fairness != SMTX_EARLIEST_DEADLINE)
+        || (attr->fairness == SMTX_PREFER_READERS && (attr->flags & SMTX_FLAG_PI))
+        || (attr->fairness == SMTX_EARLIEST_DEADLINE && (attr->flags & (SMTX_FLAG_PSHARED | SMTX_FLAG_ROBUST | SMTX_FLAG_PI)))
+        || (attr->admission != NULL && (attr->flags & (SMTX_FLAG_PSHARED | SMTX_FLAG_PI)))
+        || (attr->wait != NULL && (attr->wait->wait == NULL || (attr->flags & (SMTX_FLAG_PSHARED | SMTX_FLAG_ROBUST | SMTX_FLAG_PI))))
+        || ((attr->flags & SMTX_FLAG_PSHARED) && (attr->flags & SMTX_FLAG_PREEMPT_AWARE))
+        || ((attr->flags & SMTX_FLAG_PSHARED) && (attr->spin_ns != 0 || attr->yield_threshold != SMTX_YIELD_THRESHOLD
+                                                  || attr->park_after != 0 || attr->stats != NULL || attr->name != NULL))) {
+        return thrd_error;
+    }
+
+    const int result = smtx_init_flags(smtx, attr->flags & ~SMTX_FLAG_PREEMPT_AWARE); // it needs the extension
+    if (result != thrd_success) {
+        return result;
+    }
+    smtx->flags |= attr->flags & SMTX_FLAG_PREEMPT_AWARE;
+
+    if (attr->fairness == SMTX_PREFER_READERS) {
+        smtx->flags |= SMTX_FLAG_PREFER_READERS;
+    } else if (attr->fairness == SMTX_EARLIEST_DEADLINE) {
+        smtx->flags |= SMTX_FLAG_DEADLINE_ORDER;
+    }
+
+    const smtx_tuning_t tuning = {attr->yield_threshold, attr->park_after, attr->spin_ns, attr->wait, attr->admission, attr->stats};
+#ifdef SMTX_PREVENT_FALSE_SHARING
+    smtx->tuning = tuning;
+    const bool tuned = false;
+#else
+    const bool tuned = tuning.yield_threshold != SMTX_YIELD_THRESHOLD || tuning.park_after != 0 || tuning.spin_ns != 0
+                    || tuning.wait != NULL || tuning.admission != NULL || tuning.stats != NULL;
+#endif
+    if (attr->name != NULL || tuned || (smtx->flags & (SMTX_FLAG_DEADLINE_ORDER | SMTX_FLAG_PREEMPT_AWARE))) {
+        smtx_ext_t *ext = ext_alloc(smtx);
+        if (ext == NULL) {
+            return thrd_nomem;
+        }
+        ext->name = attr->name;
+#ifndef SMTX_PREVENT_FALSE_SHARING
+        if (tuned) {
+            ext->tuning = tuning;
+            smtx->flags |= SMTX_FLAG_TUNED;
+        }
+#endif
+    }
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_admission_init(smtx_admission_t *admission, unsigned long long interval_ns, unsigned burst, unsigned long long read_window_ns) {
+    if (admission == NULL || (interval_ns != 0 && burst == 0)) {
+        return thrd_error;
+    }
+
+    admission->interval_ns = interval_ns;
+    admission->read_window_ns = read_window_ns;
+    admission->burst = burst;
+    atomic_init(&admission->due, 0);
+    atomic_init(&admission->released, 0);
+
+    return thrd_success;
+}
+
+SMTX_IMPL unsigned smtx_parallelism(void) {
+    const uint cpus = governor_cpus();
+    return cpus != UINT32_MAX ? cpus : 0;
+}
+
+SMTX_IMPL int smtx_set_parallelism(unsigned cpus) {
+    governor_configure(cpus);
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_snzi_init(smtx_snzi_t *snzi, smtx_snzi_node_t *nodes, size_t count) {
+    if (snzi == NULL || nodes == NULL || count == 0) {
+        return thrd_error;
+    }
+
+    snzi->nodes = nodes;
+    snzi->count = count;
+    for (size_t i = 0; i < count; ++i) {
+        atomic_init(&nodes[i].word, 0);
+    }
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_use_snzi(smtx_t *smtx, smtx_snzi_t *snzi) {
+    if (smtx == NULL || snzi == NULL || (smtx->flags & SMTX_FLAG_PSHARED)) {
+        return thrd_error;
+    }
+
+#ifdef SMTX_DEBUG
+    SMTX_ASSERT(atomic_load_explicit(&smtx->reader_count, memory_order_relaxed) == 0);
+#endif
+
+    smtx_ext_t *ext = ext_alloc(smtx);
+    if (ext == NULL) {
+        return thrd_nomem;
+    }
+    ext->snzi = snzi;
+    smtx->flags |= SMTX_FLAG_SNZI;
+
+    return thrd_success;
+}
+
+/* Sleep as a writer held back by admission control until `until` (on SMTX_CLOCK_ID) or time_point. */
+SMTX_UTIL void admission_sleep(smtx_t *smtx, smtx_ns_t until, const struct timespec *time_point) {
+    if (time_point != NULL && ns_from_timespec(time_point) < until) {
+        until = ns_from_timespec(time_point);
+    }
+    const smtx_ns_t now = ns_since_epoch();
+    if (until <= now) {
+        return;
+    }
+
+    const struct timespec duration = {.tv_sec = (time_t)((until - now) / SMTX_NS_PER_S), .tv_nsec = (long)((until - now) % SMTX_NS_PER_S)};
+    thrd_sleep(&duration, NULL);
+    SMTX_STAT(smtx, admission_delays);
+    SMTX_STAT_ADD(smtx, admission_delay_ns, ns_since_epoch() - now);
+}
+
+/* Token bucket half of writer admission: take the next writer phase the bucket allows and sleep
+   until it is due. thrd_timedout without taking it if that is after time_point, with `try`
+   thrd_busy unless one is due right away. */
+SMTX_UTIL int admit_writer(smtx_t *smtx, const struct timespec *time_point, bool try) {
+    smtx_admission_t *admission = admission_of(smtx);
+    if (admission == NULL || admission->interval_ns == 0) {
+        return thrd_success;
+    }
+
+    const smtx_ns_t now = ns_since_epoch(), tolerance = (smtx_ns_t)(admission->burst - 1) * admission->interval_ns;
+    smtx_ns_t due = atomic_load_explicit(&admission->due, memory_order_relaxed), at;
+    do {
+        at = due > now + tolerance ? due - tolerance : now;
+        if (at > now && (try || (time_point != NULL && at > ns_from_timespec(time_point)))) {
+            return try ? thrd_busy : thrd_timedout;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&admission->due, &due, (due > now ? due : now) + admission->interval_ns,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    admission_sleep(smtx, at, NULL);
+    return thrd_success;
+}
+
+/* Hand back the token of an acquisition that timed out after admission, its writer phase never
+   started. Writers already admitted keep their slots, the next one to arrive gets the freed one. */
+SMTX_UTIL void refund_writer(smtx_t *smtx) {
+    smtx_admission_t *admission = admission_of(smtx);
+    if (admission != NULL && admission->interval_ns != 0) {
+        atomic_fetch_sub_explicit(&admission->due, admission->interval_ns, memory_order_relaxed);
+    }
+}
+
+/* Read window half, checked with the writer word just taken (which orders the release that set
+   `released` before us): whether readers had their window since the last writer phase ended. */
+SMTX_UTIL bool read_window_passed(const smtx_t *smtx) {
+    const smtx_admission_t *admission = admission_of(smtx);
+    return admission == NULL || admission->read_window_ns == 0
+        || ns_since_epoch() >= atomic_load_explicit(&admission->released, memory_order_relaxed) + admission->read_window_ns;
+}
+
+SMTX_UTIL void await_read_window(smtx_t *smtx, const struct timespec *time_point) {
+    const smtx_admission_t *admission = admission_of(smtx);
+    if (admission != NULL && admission->read_window_ns != 0) {
+        admission_sleep(smtx, atomic_load_explicit(&admission->released, memory_order_relaxed) + admission->read_window_ns, time_point);
+    }
+}
+
+/* Writer word just taken by a blocking acquisition: keep it, or hand it back to the readers and
+   sleep out their window. */
+SMTX_UTIL bool keep_writer(smtx_t *smtx, const struct timespec *time_point) {
+    if (read_window_passed(smtx)) {
+        return true;
+    }
+    release_writer(smtx);
+    await_read_window(smtx, time_point);
+    return false;
+}
+
+/* Release a writer phase, starting the readers' window if the lock has one. */
+SMTX_UTIL void end_writer_phase(smtx_t *smtx) {
+    smtx_admission_t *admission = admission_of(smtx);
+    if (admission != NULL && admission->read_window_ns != 0) {
+        atomic_store_explicit(&admission->released, ns_since_epoch(), memory_order_relaxed); // published by the release
+    }
+    release_writer(smtx);
+}
+
+SMTX_UTIL int try_shared(smtx_t *smtx) {
+    if (atomic_load_explicit(&smtx->writer_locked, memory_order_acquire)) {
+        return thrd_busy;
+    }
+
+    arrive_reader(smtx);
+
+    if (atomic_load_explicit(&smtx->writer_locked, memory_order_seq_cst)) {
+        depart_reader(smtx);
+        return thrd_busy;
+    }
+    return thrd_success;
+}
+
+SMTX_UTIL int try_exclusive(smtx_t *smtx) {
+    uint expected = 0;
+    if (!atomic_compare_exchange_weak_explicit(&smtx->writer_locked, &expected, writer_value(smtx), memory_order_seq_cst, memory_order_relaxed)) {
+        return thrd_busy;
+    }
+    claim_writer(smtx);
+
+    if (reader_count_of(atomic_load_explicit(&smtx->reader_count, memory_order_seq_cst)) > 0 || !read_window_passed(smtx)) {
+        release_writer(smtx);
+        return thrd_busy;
+    }
+    return thrd_success;
+}
+
+/* SMTX_EARLIEST_DEADLINE waiter, queued on its stack. The queue is a list sorted by deadline whose
+   head is published in the extension's deadline_queue and which is only changed under its
+   deadline_lock. The queue lock lives with the lock rather than in the parking lot, which every
+   SMTX_STATIC translation unit has a copy of. smtx_init_attr allocates the extension of every
+   deadline-ordered lock. */
+typedef struct smtx_deadline_waiter {
+    struct smtx_deadline_waiter *next;
+    smtx_ns_t deadline; // queue key: time_point, virtual deadline of a priority class, UINT64_MAX for untimed waits
+    atomic_uint turn;   // bumped whenever the waiter becomes the head, futex word of waiters behind it
+} smtx_deadline_waiter_t;
+
+SMTX_UTIL bool deadline_queue_busy(smtx_t *smtx) {
+    return (smtx->flags & SMTX_FLAG_DEADLINE_ORDER) && atomic_load_explicit(&ext_of(smtx)->deadline_queue, memory_order_acquire) != NULL;
+}
+
+/* Publish `head` as the head of the queue, queue lock held. A waiter that did not put itself there
+   is woken, the queue lock keeps it from leaving (and freeing its node) until then. */
+SMTX_UTIL void deadline_queue_promote(smtx_t *smtx, smtx_deadline_waiter_t *head, const smtx_deadline_waiter_t *self) {
+    atomic_store_explicit(&ext_of(smtx)->deadline_queue, head, memory_order_release);
+    if (head != NULL && head != self) {
+        atomic_fetch_add_explicit(&head->turn, 1, memory_order_release);
+        futex_wake(&head->turn, 1, smtx->flags);
+        if (atomic_load_explicit(&smtx_lot.fibers, memory_order_relaxed)) {
+            fiber_unpark_all(&head->turn);
+        }
+    }
+}
+
+SMTX_UTIL void deadline_enqueue(smtx_t *smtx, smtx_deadline_waiter_t *waiter) {
+    flag_lock(&ext_of(smtx)->deadline_lock);
+    smtx_deadline_waiter_t *prev = NULL, *curr = atomic_load_explicit(&ext_of(smtx)->deadline_queue, memory_order_relaxed);
+    while (curr != NULL && curr->deadline <= waiter->deadline) {
+        prev = curr;
+        curr = curr->next;
+    }
+    waiter->next = curr;
+    if (prev != NULL) {
+        prev->next = waiter;
+    } else {
+        deadline_queue_promote(smtx, waiter, waiter); // a displaced head notices on its next round
+    }
+    flag_unlock(&ext_of(smtx)->deadline_lock);
+}
+
+SMTX_UTIL void deadline_dequeue(smtx_t *smtx, smtx_deadline_waiter_t *waiter) {
+    flag_lock(&ext_of(smtx)->deadline_lock);
+    smtx_deadline_waiter_t *prev = NULL, *curr = atomic_load_explicit(&ext_of(smtx)->deadline_queue, memory_order_relaxed);
+    while (curr != waiter) {
+        prev = curr;
+        curr = curr->next;
+    }
+    if (prev != NULL) {
+        prev->next = waiter->next;
+    } else {
+        deadline_queue_promote(smtx, waiter->next, NULL);
+    }
+    flag_unlock(&ext_of(smtx)->deadline_lock);
+}
+
+/* Acquisition of a SMTX_EARLIEST_DEADLINE lock. Arrivals only try the lock directly while nobody
+   is queued. Otherwise they queue by `key` and sleep on their own node until they are the head,
+   which is the only queued waiter that competes for the lock and waits for it like any other.
+   Removing a timed out waiter is one walk of the queue under its lock, no wake-up of the rest. */
+SMTX_UTIL int lock_in_deadline_order(smtx_t *smtx, smtx_mode_t mode, smtx_ns_t key, const struct timespec *time_point) {
+    int (*const try_lock)(smtx_t *) = mode == SMTX_MODE_SHARED ? try_shared : try_exclusive;
+    int result = thrd_busy;
+    bool queued = false;
+    if (!deadline_queue_busy(smtx)) {
+        result = try_lock(smtx);
+    }
+
+    if (result != thrd_success) {
+        smtx_deadline_waiter_t waiter = {NULL, key, 0};
+        smtx_backoff_t state = SMTX_BACKOFF_INIT;
+        deadline_enqueue(smtx, &waiter);
+        queued = true;
+        while (true) {
+            const uint turn = atomic_load_explicit(&waiter.turn, memory_order_acquire);
+            const bool head = atomic_load_explicit(&ext_of(smtx)->deadline_queue, memory_order_acquire) == &waiter;
+            if (head && mode == SMTX_MODE_EXCLUSIVE) {
+                await_read_window(smtx, time_point);
+            }
+            if (head && (result = try_lock(smtx)) == thrd_success) {
+                break;
+            }
+            if (deadline_passed(time_point)) {
+                result = thrd_timedout;
+                break;
+            }
+
+            if (head) {
+                const bool writer = atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed) != 0;
+                backoff(smtx, writer ? &smtx->writer_locked : &smtx->reader_count, &state, SMTX_MAX_WRITER_WAIT_SPINS, time_point);
+            } else {
+                backoff_end(&state); // overtaken while spinning as the head
+                if (fiber_parking(smtx)) {
+                    fiber_wait(smtx, &waiter.turn, turn, time_point);
+                } else {
+                    futex_wait(&waiter.turn, turn, time_point, smtx->flags);
+#ifndef SMTX_FUTEX
+                    SMTX_YIELD;
+#endif
+                }
+            }
+        }
+        backoff_end(&state);
+        deadline_dequeue(smtx, &waiter);
+    }
+
+    if (result == thrd_success) {
+        if (mode == SMTX_MODE_SHARED) {
+            SMTX_STAT(smtx, shared);
+        } else {
+            SMTX_STAT(smtx, exclusive);
+        }
+        if (queued) {
+            if (mode == SMTX_MODE_SHARED) {
+                SMTX_STAT(smtx, contended_shared);
+            } else {
+                SMTX_STAT(smtx, contended_exclusive);
+            }
+        }
+    } else {
+        SMTX_STAT(smtx, timeouts);
+    }
+    return result;
+}
+
+/* Shared acquisition of `count` references, shared by smtx_lock_shared (time_point NULL),
+   smtx_timedlock_shared and smtx_lock_shared_n. */
+SMTX_UTIL smtx_ns_t deadline_key(const struct timespec *time_point) {
+    return time_point != NULL ? ns_from_timespec(time_point) : UINT64_MAX;
+}
+
+SMTX_UTIL int lock_shared(smtx_t *smtx, uint count, const struct timespec *time_point) {
+    smtx_backoff_t state = SMTX_BACKOFF_INIT;
+    while (true) {
+        const uint word = atomic_load_explicit(&smtx->writer_locked, memory_order_acquire);
+        if (word) {
+            if (take_over_dead_writer(smtx, word, state.spins, SMTX_MAX_WRITER_WAIT_SPINS)) {
+                backoff_end(&state);
+                drain_readers(smtx, NULL);
+                return SMTX_OWNERDEAD;
+            }
+            if ((smtx->flags & SMTX_FLAG_PI) && state.spins > yield_threshold_of(smtx)) {
+                backoff_end(&state);
+                const int result = pi_lock_shared(smtx, count, time_point);
+                if (result == thrd_success) {
+                    SMTX_STAT(smtx, shared);
+                    SMTX_STAT(smtx, contended_shared);
+                }
+                return result;
+            }
+        } else {
+            if (!arrive_readers(smtx, count)) {
+                backoff_end(&state);
+                return thrd_error;
+            }
+
+            if (!atomic_load_explicit(&smtx->writer_locked, memory_order_seq_cst)) {
+                backoff_end(&state);
+                SMTX_STAT(smtx, shared);
+                if (state.rounds > 0) {
+                    SMTX_STAT(smtx, contended_shared);
+                }
+                return thrd_success;
+            }
+
+            depart_readers(smtx, count);
+        }
+
+        if (deadline_passed(time_point)) {
+            backoff_end(&state);
+            SMTX_STAT(smtx, timeouts);
+            return thrd_timedout;
+        }
+        announce_spinning(smtx, SMTX_WAITING_SHARED);
+        backoff(smtx, &smtx->writer_locked, &state, SMTX_MAX_WRITER_WAIT_SPINS, time_point);
+    }
+}
+
+SMTX_IMPL int smtx_lock_shared(smtx_t *smtx) {
+    if (smtx == NULL) {
+        return thrd_error;
+    }
+
+    if (smtx->flags & SMTX_FLAG_DEADLINE_ORDER) {
+        return lock_in_deadline_order(smtx, SMTX_MODE_SHARED, UINT64_MAX, NULL);
+    }
+    return lock_shared(smtx, 1, NULL);
+}
+
+SMTX_IMPL int smtx_trylock_shared(smtx_t *smtx) {
+    if (smtx == NULL) {
+        return thrd_error;
+    }
+
+    if (deadline_queue_busy(smtx) || try_shared(smtx) != thrd_success) {
+        return thrd_busy;
+    }
+
+    SMTX_STAT(smtx, shared);
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_timedlock_shared(smtx_t *smtx, const struct timespec *time_point) {
+    if (smtx == NULL || time_point == NULL) {
+        return thrd_error;
+    }
+
+    if (smtx->flags & SMTX_FLAG_DEADLINE_ORDER) {
+        return lock_in_deadline_order(smtx, SMTX_MODE_SHARED, deadline_key(time_point), time_point);
+    }
+    return lock_shared(smtx, 1, time_point);
+}
+
+SMTX_IMPL int smtx_lock_shared_n(smtx_t *smtx, unsigned n) {
+    if (smtx == NULL || n == 0 || n > SMTX_STATE_MASK || (smtx->flags & (SMTX_FLAG_SNZI | SMTX_FLAG_DEADLINE_ORDER))) {
+        return thrd_error;
+    }
+
+    return lock_shared(smtx, n, NULL);
+}
+
+SMTX_IMPL int smtx_unlock_shared(smtx_t *smtx) {
+    if (smtx == NULL) {
+        return thrd_error;
+    }
+
+#ifdef SMTX_DEBUG
+    SMTX_ASSERT(reader_count_of(atomic_load_explicit(&smtx->reader_count, memory_order_relaxed)) > 0);
+#endif
+
+    depart_reader(smtx);
+
+    return thrd_success;
+}
+
+/* SMTX_PREFER_READERS: only take the writer word while no reader is inside, and hand it straight
+   back if one slipped in anyway, so a steady stream of readers is never held back by a writer. */
+SMTX_UTIL int lock_exclusive_prefer_readers(smtx_t *smtx, const struct timespec *time_point, smtx_backoff_t *state) {
+    const uint value = writer_value(smtx);
+    while (true) {
+        uint expected = 0;
+        if (reader_count_of(atomic_load_explicit(&smtx->reader_count, memory_order_relaxed)) == 0) {
+            if (atomic_compare_exchange_strong_explicit(&smtx->writer_locked, &expected, value, memory_order_seq_cst, memory_order_relaxed)) {
+                if (reader_count_of(atomic_load_explicit(&smtx->reader_count, memory_order_seq_cst)) != 0) {
+                    release_writer(smtx);
+                } else if (keep_writer(smtx, time_point)) {
+                    claim_writer(smtx);
+                    return thrd_success;
+                }
+            } else if (take_over_dead_writer(smtx, expected, state->spins, SMTX_MAX_READER_WAIT_SPINS)) {
+                backoff_end(state);
+                drain_readers(smtx, NULL);
+                return SMTX_OWNERDEAD;
+            }
+        }
+
+        if (deadline_passed(time_point)) {
+            return thrd_timedout;
+        }
+        announce_spinning(smtx, SMTX_WAITING_EXCLUSIVE);
+        atomic_uint *word = atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed) ? &smtx->writer_locked : &smtx->reader_count;
+        backoff(smtx, word, state, SMTX_MAX_READER_WAIT_SPINS, time_point);
+    }
+}
+
+/* First half of an exclusive acquisition: own the writer word, which holds back new readers. Returns
+   thrd_success, SMTX_OWNERDEAD (taken over from a dead writer) or thrd_timedout; readers that were
+   already inside may still be. */
+SMTX_UTIL int acquire_writer(smtx_t *smtx, const struct timespec *time_point, smtx_backoff_t *state) {
+    if (smtx->flags & SMTX_FLAG_PI) {
+        const int result = pi_lock_writer(smtx, time_point);
+        if (result == thrd_success || result == SMTX_OWNERDEAD) {
+            claim_writer(smtx);
+        }
+        return result;
+    }
+
+    const uint value = writer_value(smtx);
+    uint expected = 0;
+    while (true) {
+        if (atomic_compare_exchange_weak_explicit(&smtx->writer_locked, &expected, value, memory_order_seq_cst, memory_order_relaxed)) {
+            if (keep_writer(smtx, time_point)) {
+                break;
+            }
+        } else if ((expected & SMTX_TID_MASK) != 0 && take_over_dead_writer(smtx, expected, state->spins, SMTX_MAX_READER_WAIT_SPINS)) {
+            return SMTX_OWNERDEAD;
+        }
+        if (deadline_passed(time_point)) {
+            return thrd_timedout;
+        }
+        announce_spinning(smtx, SMTX_WAITING_EXCLUSIVE);
+
+        // Untimed waits retry the writer word back to back unless the lock is configured to park,
+        // the writer is preempted (retrying only keeps it from finishing), the process already
+        // has enough spinners or a fiber waits (the writer may be a fiber on the same thread).
+        if (time_point != NULL || parking_enabled(smtx) || holder_preempted(smtx, &smtx->writer_locked, state) || governor_full()
+            || fiber_parking(smtx)) {
+            backoff(smtx, &smtx->writer_locked, state, SMTX_MAX_READER_WAIT_SPINS, time_point);
+        } else {
+            state->rounds += 1;
+            if (state->spins < SMTX_MAX_READER_WAIT_SPINS) {
+                state->spins += 1;
+            }
+        }
+        expected = 0;
+    }
+    claim_writer(smtx);
+
+    return thrd_success;
+}
+
+/* Exclusive acquisition shared by smtx_lock_exclusive (time_point NULL) and smtx_timedlock_exclusive. */
+SMTX_UTIL int lock_exclusive(smtx_t *smtx, const struct timespec *time_point, smtx_backoff_t *state) {
+    if (smtx->flags & SMTX_FLAG_PREFER_READERS) {
+        return lock_exclusive_prefer_readers(smtx, time_point, state);
+    }
+
+    const int result = acquire_writer(smtx, time_point, state);
+    backoff_end(state); // drain_readers waits with a state of its own
+    if (result == SMTX_OWNERDEAD) {
+        drain_readers(smtx, NULL);
+    } else if (result == thrd_success && !drain_readers(smtx, time_point)) {
+        release_writer(smtx);
+        return thrd_timedout;
+    }
+    return result;
+}
+
+SMTX_UTIL int count_exclusive(smtx_t *smtx, int result, smtx_backoff_t *state) {
+    backoff_end(state);
+    if (result == thrd_success) {
+        SMTX_STAT(smtx, exclusive);
+        if (state->rounds > 0) {
+            SMTX_STAT(smtx, contended_exclusive);
+        }
+    } else if (result == thrd_timedout) {
+        SMTX_STAT(smtx, timeouts);
+    }
+    return result;
+}
+
+SMTX_IMPL int smtx_lock_exclusive(smtx_t *smtx) {
+    if (smtx == NULL) {
+        return thrd_error;
+    }
+
+    admit_writer(smtx, NULL, false);
+    if (smtx->flags & SMTX_FLAG_DEADLINE_ORDER) {
+        return lock_in_deadline_order(smtx, SMTX_MODE_EXCLUSIVE, UINT64_MAX, NULL);
+    }
+    smtx_backoff_t state = SMTX_BACKOFF_INIT;
+    return count_exclusive(smtx, lock_exclusive(smtx, NULL, &state), &state);
+}
+
+SMTX_IMPL int smtx_trylock_exclusive(smtx_t *smtx) {
+    if (smtx == NULL) {
+        return thrd_error;
+    }
+
+    if (deadline_queue_busy(smtx) || try_exclusive(smtx) != thrd_success) {
+        return thrd_busy;
+    }
+    if (admit_writer(smtx, NULL, true) != thrd_success) { // only take a token for a phase that starts
+        release_writer(smtx);
+        return thrd_busy;
+    }
+
+    SMTX_STAT(smtx, exclusive);
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_timedlock_exclusive(smtx_t *smtx, const struct timespec *time_point) {
+    if (smtx == NULL || time_point == NULL) {
+        return thrd_error;
+    }
+
+    if (admit_writer(smtx, time_point, false) != thrd_success) {
+        SMTX_STAT(smtx, timeouts);
+        return thrd_timedout;
+    }
+    int result;
+    if (smtx->flags & SMTX_FLAG_DEADLINE_ORDER) {
+        result = lock_in_deadline_order(smtx, SMTX_MODE_EXCLUSIVE, deadline_key(time_point), time_point);
+    } else {
+        smtx_backoff_t state = SMTX_BACKOFF_INIT;
+        result = count_exclusive(smtx, lock_exclusive(smtx, time_point, &state), &state);
+    }
+    if (result == thrd_timedout) {
+        refund_writer(smtx);
+    }
+    return result;
+}
+
+SMTX_IMPL int smtx_lock_prio(smtx_t *smtx, smtx_mode_t mode, smtx_prio_t prio, const struct timespec *time_point) {
+    static const smtx_ns_t age[] = {0, SMTX_PRIO_NORMAL_AGE_NS, SMTX_PRIO_BATCH_AGE_NS};
+    if (smtx == NULL || !(smtx->flags & SMTX_FLAG_DEADLINE_ORDER) || (mode != SMTX_MODE_SHARED && mode != SMTX_MODE_EXCLUSIVE)
+        || (prio != SMTX_PRIO_HIGH && prio != SMTX_PRIO_NORMAL && prio != SMTX_PRIO_BATCH)) {
+        return thrd_error;
+    }
+
+    if (mode == SMTX_MODE_EXCLUSIVE && admit_writer(smtx, time_point, false) != thrd_success) {
+        SMTX_STAT(smtx, timeouts);
+        return thrd_timedout;
+    }
+    const smtx_ns_t due = ns_since_epoch() + age[prio], deadline = deadline_key(time_point);
+    const int result = lock_in_deadline_order(smtx, mode, due < deadline ? due : deadline, time_point);
+    if (mode == SMTX_MODE_EXCLUSIVE && result == thrd_timedout) {
+        refund_writer(smtx);
+    }
+    return result;
+}
+
+SMTX_IMPL int smtx_begin_exclusive(smtx_t *smtx) {
+    if (smtx == NULL || (smtx->flags & SMTX_FLAG_DEADLINE_ORDER)) {
+        return thrd_error;
+    }
+
+    admit_writer(smtx, NULL, false);
+    smtx_backoff_t state = SMTX_BACKOFF_INIT;
+    if (smtx->flags & SMTX_FLAG_PREFER_READERS) {
+        return count_exclusive(smtx, lock_exclusive_prefer_readers(smtx, NULL, &state), &state);
+    }
+    return count_exclusive(smtx, acquire_writer(smtx, NULL, &state), &state);
+}
+
+SMTX_IMPL int smtx_finish_exclusive(smtx_t *smtx) {
+    if (smtx == NULL) {
+        return thrd_error;
+    }
+
+#ifdef SMTX_DEBUG
+    SMTX_ASSERT(atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed) & SMTX_STATE_MASK);
+#endif
+
+    drain_readers(smtx, NULL);
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_detach_exclusive(smtx_t *smtx) {
+    if (smtx == NULL || (smtx->flags & SMTX_FLAG_PI)) {
+        return thrd_error;
+    }
+
+#ifdef SMTX_DEBUG
+    SMTX_ASSERT(atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed) & SMTX_STATE_MASK);
+    SMTX_ASSERT(atomic_load_explicit(&smtx->owner, memory_order_relaxed) == current_tid());
+    atomic_store_explicit(&smtx->owner, 0, memory_order_relaxed);
+#endif
+    if (smtx->flags & SMTX_FLAG_PREEMPT_AWARE) {
+        atomic_store_explicit(&ext_of(smtx)->writer.cpu, SMTX_NO_CPU, memory_order_relaxed);
+    }
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_adopt_exclusive(smtx_t *smtx) {
+    if (smtx == NULL || (smtx->flags & SMTX_FLAG_PI)) {
+        return thrd_error;
+    }
+
+#ifdef SMTX_DEBUG
+    SMTX_ASSERT(atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed) & SMTX_STATE_MASK);
+    SMTX_ASSERT(atomic_load_explicit(&smtx->owner, memory_order_relaxed) == 0); // detached
+#endif
+
+    // Robust locks name the holder in the writer word, keep the waiter and owner-died bits.
+    if (smtx->flags & SMTX_FLAG_ROBUST) {
+        uint word = atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&smtx->writer_locked, &word, (word & ~SMTX_TID_MASK) | current_tid(),
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+        }
+    }
+    claim_writer(smtx);
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_notify_drained(smtx_t *smtx, void (*fn)(void *arg), void *arg) {
+    if (smtx == NULL || fn == NULL || (smtx->flags & SMTX_FLAG_PSHARED)) {
+        return thrd_error;
+    }
+
+    smtx_ext_t *ext = ext_alloc(smtx);
+    if (ext == NULL) {
+        return thrd_nomem;
+    }
+
+#ifdef SMTX_DEBUG
+    SMTX_ASSERT(atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed) & SMTX_STATE_MASK);
+    SMTX_ASSERT(atomic_load_explicit(&ext->drain_fn, memory_order_relaxed) == NULL);
+#endif
+
+    // Publish the callback with the waiter bit, the last reader reads it after clearing the bit.
+    ext->drain_arg = arg;
+    atomic_store_explicit(&ext->drain_fn, fn, memory_order_relaxed);
+    if (reader_count_of(atomic_fetch_or_explicit(&smtx->reader_count, SMTX_WAITERS, memory_order_release)) > 0) {
+        return thrd_busy;
+    }
+
+    // Already drained: take bit and callback back, unless a reader that saw the bit took the callback.
+    atomic_fetch_and_explicit(&smtx->reader_count, SMTX_STATE_MASK, memory_order_relaxed);
+    return atomic_exchange_explicit(&ext->drain_fn, NULL, memory_order_relaxed) != NULL ? thrd_success : thrd_busy;
+}
+
+SMTX_IMPL int smtx_unlock_exclusive(smtx_t *smtx) {
+    if (smtx == NULL) {
+        return thrd_error;
+    }
+
+#ifdef SMTX_DEBUG
+    const uint word = atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed);
+    SMTX_ASSERT(word & SMTX_STATE_MASK);
+    SMTX_ASSERT(!(smtx->flags & (SMTX_FLAG_ROBUST | SMTX_FLAG_PI)) || (word & SMTX_TID_MASK) == current_tid());
+    SMTX_ASSERT(atomic_load_explicit(&smtx->owner, memory_order_relaxed) == current_tid());
+#endif
+
+    end_writer_phase(smtx);
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_shared_should_yield(smtx_t *smtx) {
+    // Under a shared hold a taken writer word is a writer waiting for the readers to drain.
+    return smtx != NULL
+        && (atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed) != 0
+            || (atomic_load_explicit(&smtx->reader_count, memory_order_relaxed) & SMTX_WAITERS)
+            || (atomic_load_explicit(&smtx->waiting, memory_order_relaxed) & SMTX_WAITING_EXCLUSIVE)
+            || deadline_queue_busy(smtx));
+}
+
+SMTX_IMPL int smtx_exclusive_should_yield(smtx_t *smtx) {
+    return smtx != NULL
+        && ((atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed) & SMTX_WAITERS)
+            || (atomic_load_explicit(&smtx->waiting, memory_order_relaxed) & SMTX_WAITING_SHARED)
+            || deadline_queue_busy(smtx));
+}
+
+/* Just released in `released` mode by a cond_resched: wait (up to the window) until the other side
+   got in, a writer owning the writer word or readers arriving, or we would usually win the lock
+   straight back. Deadline-ordered locks queue us behind the waiters anyway. */
+SMTX_UTIL void let_waiters_in(smtx_t *smtx, smtx_mode_t released) {
+    if (smtx->flags & SMTX_FLAG_DEADLINE_ORDER) {
+        return;
+    }
+
+    const smtx_ns_t until = ns_since_epoch() + SMTX_RESCHED_WINDOW_NS;
+    const struct timespec window = {.tv_sec = (time_t)(until / SMTX_NS_PER_S), .tv_nsec = (long)(until % SMTX_NS_PER_S)};
+    atomic_uint *word = released == SMTX_MODE_SHARED ? &smtx->writer_locked : &smtx->reader_count;
+    smtx_backoff_t state = SMTX_BACKOFF_INIT;
+    while (atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed) == 0
+           && (released == SMTX_MODE_SHARED || reader_count_of(atomic_load_explicit(&smtx->reader_count, memory_order_relaxed)) == 0)
+           && !deadline_passed(&window)) {
+        backoff(smtx, word, &state, SMTX_MAX_WRITER_WAIT_SPINS, &window);
+    }
+    backoff_end(&state);
+}
+
+SMTX_IMPL int smtx_shared_cond_resched(smtx_t *smtx) {
+    if (smtx == NULL) {
+        return thrd_error;
+    }
+    if (!smtx_shared_should_yield(smtx)) {
+        return thrd_success;
+    }
+
+    // Writers that are still spinning mark themselves again, stale marks cost one yield at most.
+    atomic_fetch_and_explicit(&smtx->waiting, ~SMTX_WAITING_EXCLUSIVE, memory_order_relaxed);
+    smtx_unlock_shared(smtx);
+    let_waiters_in(smtx, SMTX_MODE_SHARED);
+    const int result = smtx_lock_shared(smtx);
+    return result == thrd_success ? SMTX_RESCHEDULED : result;
+}
+
+SMTX_IMPL int smtx_exclusive_cond_resched(smtx_t *smtx) {
+    if (smtx == NULL) {
+        return thrd_error;
+    }
+    if (!smtx_exclusive_should_yield(smtx)) {
+        return thrd_success;
+    }
+
+    atomic_fetch_and_explicit(&smtx->waiting, ~SMTX_WAITING_SHARED, memory_order_relaxed);
+    smtx_unlock_exclusive(smtx);
+    let_waiters_in(smtx, SMTX_MODE_EXCLUSIVE);
+    const int result = smtx_lock_exclusive(smtx);
+    return result == thrd_success ? SMTX_RESCHEDULED : result;
+}
+
+/* Execute published requests while holding the exclusive lock, oldest first. Every request pushed
+   before the call is done when it returns, later ones are picked up for a bounded number of passes. */
+SMTX_UTIL void combine_requests(smtx_ext_t *ext) {
+    for (int pass = 0; pass < SMTX_MAX_COMBINE_PASSES; ++pass) {
+        struct smtx_combine_req *req = atomic_exchange_explicit(&ext->combine_head, NULL, memory_order_acquire);
+        if (req == NULL) {
+            return;
+        }
+
+        struct smtx_combine_req *batch = NULL;
+        while (req != NULL) {
+            struct smtx_combine_req *next = req->next;
+            req->next = batch;
+            batch = req;
+            req = next;
+        }
+
+        while (batch != NULL) {
+            struct smtx_combine_req *next = batch->next; // batch is gone once done is set
+            batch->fn(batch->arg);
+            atomic_store_explicit(&batch->done, 1, memory_order_release);
+            batch = next;
+        }
+    }
+}
+
+SMTX_IMPL int smtx_combine_exclusive(smtx_t *smtx, void (*fn)(void *arg), void *arg) {
+    if (smtx == NULL || fn == NULL || (smtx->flags & SMTX_FLAG_PSHARED)) {
+        return thrd_error;
+    }
+
+    smtx_ext_t *ext = ext_alloc(smtx);
+    if (ext == NULL) {
+        return thrd_nomem;
+    }
+
+    struct smtx_combine_req req = {.fn = fn, .arg = arg};
+    atomic_init(&req.done, 0);
+
+    req.next = atomic_load_explicit(&ext->combine_head, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&ext->combine_head, &req.next, &req, memory_order_release, memory_order_relaxed)) {
+    }
+
+    // Wait for the current holder to run our request: a combiner finishes every published request
+    // before it releases, so waiting on the writer word waits for `done` as well. Only compete for
+    // the lock while the word reads free, and go back to waiting if another writer wins it.
+    smtx_backoff_t state = SMTX_BACKOFF_INIT;
+    int result = thrd_busy;
+    while (true) {
+        if (atomic_load_explicit(&req.done, memory_order_acquire)) {
+            backoff_end(&state);
+            return thrd_success;
+        }
+        const uint word = atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed);
+        if (word == 0) {
+            if ((result = smtx_trylock_exclusive(smtx)) == thrd_success) {
+                break;
+            }
+            if (atomic_load_explicit(&smtx->writer_locked, memory_order_relaxed) == 0) {
+                // Held back by readers, queued waiters or admission rather than a writer: wait as one.
+                backoff_end(&state);
+                result = smtx_lock_exclusive(smtx);
+                if (result != thrd_success && result != SMTX_OWNERDEAD) {
+                    return result;
+                }
+                break;
+            }
+        } else if (take_over_dead_writer(smtx, word, state.spins, SMTX_MAX_WRITER_WAIT_SPINS)) {
+            result = SMTX_OWNERDEAD;
+            break;
+        }
+        backoff(smtx, &smtx->writer_locked, &state, SMTX_MAX_WRITER_WAIT_SPINS, NULL);
+    }
+    backoff_end(&state);
+
+    // Ours is still published, unless a combiner that got in first ran it meanwhile.
+    combine_requests(ext);
+    SMTX_ASSERT(atomic_load_explicit(&req.done, memory_order_relaxed));
+
+    if (result == SMTX_OWNERDEAD) {
+        return SMTX_OWNERDEAD; // still held, the batch ran on the state the dead writer left behind
+    }
+    end_writer_phase(smtx);
+
+    return thrd_success;
+}
+
+#define SMTX_MAILBOX_POSTED 1u
+
+SMTX_IMPL int smtx_server_init(smtx_server_t *server, smtx_mailbox_t *mailboxes, size_t count) {
+    if (server == NULL || (mailboxes == NULL && count > 0)) {
+        return thrd_error;
+    }
+
+    smtx_init(&server->smtx);
+    server->mailboxes = mailboxes;
+    server->count = count;
+    atomic_init(&server->doorbell, 0);
+    atomic_init(&server->stop, false);
+    for (size_t i = 0; i < count; ++i) {
+        atomic_init(&mailboxes[i].state, 0);
+        mailboxes[i].fn = NULL;
+        mailboxes[i].arg = NULL;
+    }
+
+    return thrd_success;
+}
+
+/* Run every posted request once, taking the lock on first use. Returns the number of requests run. */
+SMTX_UTIL size_t serve_mailboxes(smtx_server_t *server, bool *locked) {
+    size_t served = 0;
+    for (size_t i = 0; i < server->count; ++i) {
+        smtx_mailbox_t *mailbox = &server->mailboxes[i];
+        if (!(atomic_load_explicit(&mailbox->state, memory_order_acquire) & SMTX_MAILBOX_POSTED)) {
+            continue;
+        }
+
+        if (!*locked) {
+            smtx_lock_exclusive(&server->smtx);
+            *locked = true;
+        }
+        mailbox->fn(mailbox->arg);
+        served += 1;
+
+        if (atomic_exchange_explicit(&mailbox->state, 0, memory_order_release) & SMTX_WAITERS) {
+            futex_wake(&mailbox->state, 1, 0);
+        }
+    }
+    return served;
+}
+
+SMTX_IMPL int smtx_server_run(smtx_server_t *server) {
+    if (server == NULL) {
+        return thrd_error;
+    }
+
+    bool locked = false;
+    uint spins = 1;
+    while (!atomic_load_explicit(&server->stop, memory_order_acquire)) {
+        if (serve_mailboxes(server, &locked) > 0) {
+            spins = 1;
+            continue;
+        }
+
+        if (locked) {
+            release_writer(&server->smtx);
+            locked = false;
+        }
+
+        if (spins <= SMTX_MAX_WRITER_WAIT_SPINS) {
+            spin_with_yield(spins);
+            spins = SMTX_NEXT_SPINS(spins);
+            continue;
+        }
+
+        // Ring the doorbell before the last scan, a client posting after it sees the bell and wakes us.
+        // Store-buffering against smtx_delegate (post, then read the bell): the fence keeps the
+        // scan's acquire loads from being satisfied before the bell is visible.
+        atomic_store_explicit(&server->doorbell, 1, memory_order_seq_cst);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (serve_mailboxes(server, &locked) == 0 && !atomic_load_explicit(&server->stop, memory_order_acquire)) {
+            futex_wait(&server->doorbell, 1, NULL, 0);
+        }
+        atomic_store_explicit(&server->doorbell, 0, memory_order_relaxed);
+        spins = 1;
+    }
+
+    serve_mailboxes(server, &locked);
+    if (locked) {
+        release_writer(&server->smtx);
+    }
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_server_stop(smtx_server_t *server) {
+    if (server == NULL) {
+        return thrd_error;
+    }
+
+    atomic_store_explicit(&server->stop, true, memory_order_seq_cst);
+    if (atomic_exchange_explicit(&server->doorbell, 0, memory_order_seq_cst)) {
+        futex_wake(&server->doorbell, 1, 0);
+    }
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_delegate(smtx_server_t *server, size_t client, void (*fn)(void *arg), void *arg) {
+    if (server == NULL || client >= server->count || fn == NULL) {
+        return thrd_error;
+    }
+
+    smtx_mailbox_t *mailbox = &server->mailboxes[client];
+    SMTX_ASSERT(atomic_load_explicit(&mailbox->state, memory_order_relaxed) == 0);
+    mailbox->fn = fn;
+    mailbox->arg = arg;
+    atomic_store_explicit(&mailbox->state, SMTX_MAILBOX_POSTED, memory_order_seq_cst);
+
+    if (atomic_load_explicit(&server->doorbell, memory_order_seq_cst)
+        && atomic_exchange_explicit(&server->doorbell, 0, memory_order_relaxed)) {
+        futex_wake(&server->doorbell, 1, 0);
+    }
+
+    uint spins = 1;
+    uint word;
+    while ((word = atomic_load_explicit(&mailbox->state, memory_order_acquire)) != 0) {
+        if (spins <= SMTX_YIELD_THRESHOLD) {
+            spin_with_yield(spins);
+            spins = SMTX_NEXT_SPINS(spins);
+            continue;
+        }
+
+        word = announce_waiter(&mailbox->state, 0);
+        if (word != 0) {
+            futex_wait(&mailbox->state, word, NULL, 0);
+        }
+    }
+
+    return thrd_success;
+}
+
+/* Lock word an unsuccessful trylock in `mode` has to wait on, announced so its releaser wakes us. */
+SMTX_UTIL atomic_uint *blocking_word(smtx_t *smtx, smtx_mode_t mode, uint *expected) {
+    *expected = announce_waiter(&smtx->writer_locked, 0);
+    if (*expected != 0) {
+        return &smtx->writer_locked;
+    }
+
+    if (mode == SMTX_MODE_EXCLUSIVE) {
+        *expected = announce_waiter(&smtx->reader_count, 0);
+        if (reader_count_of(*expected) != 0) {
+            return &smtx->reader_count;
+        }
+    }
+
+    return NULL;
+}
+
+SMTX_IMPL int smtx_lock_any(smtx_t **locks, size_t n, smtx_mode_t mode) {
+    if (locks == NULL || n == 0 || n > SMTX_LOCK_ANY_MAX) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        if (locks[i] == NULL || (locks[i]->flags & (SMTX_FLAG_ROBUST | SMTX_FLAG_PI | SMTX_FLAG_DEADLINE_ORDER)) || wait_strategy(locks[i]) != NULL) {
+            return -1;
+        }
+    }
+
+    int (*trylock)(smtx_t *) = mode == SMTX_MODE_EXCLUSIVE ? smtx_trylock_exclusive : smtx_trylock_shared;
+
+#ifdef SMTX_FUTEX
+    smtx_futex_waitv_t waiters[SMTX_LOCK_ANY_MAX];
+    bool waitv_supported = true;
+#endif
+
+    uint spins = 1;
+    bool poll = false; // a lock is busy without a word to sleep on (admission control), so sleep between polls
+    while (true) {
+        for (size_t i = 0; i < n; ++i) {
+            if (trylock(locks[i]) == thrd_success) {
+                return (int)i;
+            }
+        }
+
+#ifdef SMTX_FUTEX
+        if (waitv_supported) {
+            bool all_blocked = true;
+            for (size_t i = 0; i < n && all_blocked; ++i) {
+                uint expected;
+                atomic_uint *word = blocking_word(locks[i], mode, &expected);
+                all_blocked = word != NULL;
+                waiters[i] = (smtx_futex_waitv_t){
+                    .val = expected,
+                    .uaddr = (uint64_t)(uintptr_t)word,
+                    .flags = SMTX_FUTEX2_SIZE_U32 | ((locks[i]->flags & SMTX_FLAG_PSHARED) ? 0 : SMTX_FUTEX2_PRIVATE),
+                };
+            }
+
+            // Only a wait that happened replaces the backoff, a lock in a state without a word to
+            // sleep on (or a failed wait) must not turn this into a busy loop.
+            if (all_blocked) {
+                if (syscall(SMTX_SYS_FUTEX_WAITV, waiters, (unsigned)n, 0, NULL, CLOCK_MONOTONIC) >= 0 || errno == EAGAIN) {
+                    spins = 1;
+                    continue;
+                }
+                waitv_supported = errno != ENOSYS;
+            }
+            poll = !all_blocked;
+        }
+#endif
+
+        if (poll && spins >= SMTX_MAX_WRITER_WAIT_SPINS) {
+            wait_nanosleep(NULL, NULL, 0, NULL);
+            continue;
+        }
+        spin_with_yield(spins);
+        if (spins < SMTX_MAX_WRITER_WAIT_SPINS) {
+            spins = SMTX_NEXT_SPINS(spins);
+        }
+    }
+}
+
+/* Locks the smtx_lock_or_run frames on this thread's stack are waiting for, innermost last. */
+typedef struct {
+    const smtx_t *waiting[SMTX_MAX_HELP_DEPTH];
+    uint depth;
+} smtx_helping_t;
+
+SMTX_UTIL smtx_helping_t *helping(void) {
+    static _Thread_local smtx_helping_t state;
+    return &state;
+}
+
+SMTX_UTIL bool may_help(const smtx_t *smtx) {
+    const smtx_helping_t *state = helping();
+    if (state->depth >= SMTX_MAX_HELP_DEPTH) {
+        return false;
+    }
+    for (uint i = 0; i < state->depth; ++i) {
+        if (state->waiting[i] == smtx) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* One attempt of smtx_lock_or_run, thrd_busy while the caller still holds nothing of the lock. */
+SMTX_UTIL int try_lock_or_run(smtx_t *smtx, smtx_mode_t mode) {
+    if (mode == SMTX_MODE_SHARED) {
+        return smtx_trylock_shared(smtx);
+    }
+    if (deadline_queue_busy(smtx)) { // queued waiters go first, as for trylock
+        return thrd_busy;
+    }
+    if (smtx->flags & SMTX_FLAG_PREFER_READERS) {
+        const int result = try_exclusive(smtx); // smtx_lock_or_run took the admission token already
+        if (result == thrd_success) {
+            SMTX_STAT(smtx, exclusive);
+        }
+        return result;
+    }
+
+    uint expected = 0;
+    if (!atomic_compare_exchange_strong_explicit(&smtx->writer_locked, &expected, writer_value(smtx), memory_order_seq_cst, memory_order_relaxed)) {
+        return thrd_busy;
+    }
+    if (!read_window_passed(smtx)) {
+        release_writer(smtx);
+        return thrd_busy;
+    }
+    claim_writer(smtx);
+    drain_readers(smtx, NULL); // no helping from here on, new readers are held back by us
+    SMTX_STAT(smtx, exclusive);
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_lock_or_run(smtx_t *smtx, smtx_mode_t mode, int (*help)(void *ctx), void *ctx) {
+    if (smtx == NULL || help == NULL || (mode != SMTX_MODE_SHARED && mode != SMTX_MODE_EXCLUSIVE)) {
+        return thrd_error;
+    }
+
+    if ((smtx->flags & (SMTX_FLAG_ROBUST | SMTX_FLAG_PI)) || !may_help(smtx)) {
+        return mode == SMTX_MODE_SHARED ? smtx_lock_shared(smtx) : smtx_lock_exclusive(smtx);
+    }
+
+    if (mode == SMTX_MODE_EXCLUSIVE) {
+        admit_writer(smtx, NULL, false);
+    }
+    smtx_helping_t *state = helping();
+    smtx_backoff_t backoff_state = SMTX_BACKOFF_INIT;
+    int result;
+    while ((result = try_lock_or_run(smtx, mode)) == thrd_busy) {
+        state->waiting[state->depth++] = smtx;
+        const int helped = help(ctx);
+        state->depth -= 1;
+
+        if (!helped) {
+            announce_spinning(smtx, mode == SMTX_MODE_SHARED ? SMTX_WAITING_SHARED : SMTX_WAITING_EXCLUSIVE);
+            backoff(smtx, &smtx->writer_locked, &backoff_state, SMTX_MAX_WRITER_WAIT_SPINS, NULL);
+        }
+    }
+    backoff_end(&backoff_state);
+    return result;
+}
+
+SMTX_IMPL int smtx_set_fiber_hooks(const smtx_fiber_hooks_t *hooks) {
+    if (hooks != NULL && (hooks->current == NULL || hooks->park == NULL || hooks->unpark == NULL)) {
+        return thrd_error;
+    }
+    if (hooks != NULL && !atomic_load_explicit(&smtx_lot.fibers, memory_order_relaxed)) {
+        atomic_store_explicit(&smtx_lot.fibers, true, memory_order_seq_cst);
+    }
+    *fiber_hooks() = hooks;
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_cond_init(smtx_cond_t *cond) {
+    if (cond == NULL) {
+        return thrd_error;
+    }
+
+    atomic_init(&cond->seq, 0);
+    atomic_init(&cond->waiters, 0);
+    atomic_init(&cond->smtx, NULL);
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_cond_timedwait(smtx_cond_t *cond, smtx_t *smtx, smtx_mode_t mode, const struct timespec *time_point) {
+    if (cond == NULL || smtx == NULL || (mode != SMTX_MODE_SHARED && mode != SMTX_MODE_EXCLUSIVE)) {
+        return thrd_error;
+    }
+
+    // Counted under the lock: a signal after a change made under it sees us through the lock.
+    atomic_fetch_add_explicit(&cond->waiters, 1, memory_order_relaxed);
+    const uint seq = atomic_load_explicit(&cond->seq, memory_order_relaxed);
+    atomic_store_explicit(&cond->smtx, smtx, memory_order_relaxed);
+
+    if (mode == SMTX_MODE_EXCLUSIVE) {
+        smtx_unlock_exclusive(smtx);
+    } else {
+        smtx_unlock_shared(smtx);
+    }
+
+#ifdef SMTX_FUTEX
+    const bool signaled = futex_wait(&cond->seq, seq, time_point, 0)
+                       || atomic_load_explicit(&cond->seq, memory_order_relaxed) != seq;
+#else
+    bool signaled = true;
+    uint spins = 1;
+    while (atomic_load_explicit(&cond->seq, memory_order_acquire) == seq) {
+        if (time_point != NULL && ns_since_epoch() >= ns_from_timespec(time_point)) {
+            signaled = false;
+            break;
+        }
+        spin_with_yield(spins);
+        if (spins < SMTX_MAX_WRITER_WAIT_SPINS) {
+            spins = SMTX_NEXT_SPINS(spins);
+        }
+    }
+#endif
+    atomic_fetch_sub_explicit(&cond->waiters, 1, memory_order_relaxed);
+
+    const int locked = mode == SMTX_MODE_EXCLUSIVE ? smtx_lock_exclusive(smtx) : smtx_lock_shared(smtx);
+    if (locked == SMTX_OWNERDEAD) {
+        return locked; // held exclusively now, whatever the mode
+    }
+
+    // Pass the turn on in case we were requeued: readers let the next one in right away, a writer
+    // flags its hold so that its release does.
+    smtx_ext_t *ext = signaled ? ext_of(smtx) : NULL;
+    if (ext != NULL && atomic_load_explicit(&ext->requeued, memory_order_relaxed) != 0) {
+        if (mode == SMTX_MODE_EXCLUSIVE) {
+            atomic_fetch_or_explicit(&smtx->writer_locked, SMTX_WAITERS, memory_order_relaxed);
+        } else {
+            wake_requeued(smtx);
+        }
+    }
+
+    return signaled ? thrd_success : thrd_timedout;
+}
+
+SMTX_IMPL int smtx_cond_wait(smtx_cond_t *cond, smtx_t *smtx, smtx_mode_t mode) {
+    return smtx_cond_timedwait(cond, smtx, mode, NULL);
+}
+
+SMTX_IMPL int smtx_cond_signal(smtx_cond_t *cond) {
+    if (cond == NULL) {
+        return thrd_error;
+    }
+
+    atomic_fetch_add_explicit(&cond->seq, 1, memory_order_release);
+    if (atomic_load_explicit(&cond->waiters, memory_order_relaxed) != 0) {
+        futex_wake(&cond->seq, 1, 0);
+    }
+
+    return thrd_success;
+}
+
+SMTX_IMPL int smtx_cond_broadcast(smtx_cond_t *cond) {
+    if (cond == NULL) {
+        return thrd_error;
+    }
+
+    const uint seq = atomic_fetch_add_explicit(&cond->seq, 1, memory_order_release) + 1;
+    if (atomic_load_explicit(&cond->waiters, memory_order_relaxed) == 0) {
+        return thrd_success;
+    }
+
+#ifdef SMTX_FUTEX
+    smtx_t *smtx = atomic_load_explicit(&cond->smtx, memory_order_relaxed);
+    smtx_ext_t *ext = smtx != NULL && !(smtx->flags & (SMTX_FLAG_PSHARED | SMTX_FLAG_ROBUST | SMTX_FLAG_PI)) && wait_strategy(smtx) == NULL
+                        ? ext_alloc(smtx)
+                        : NULL;
+    if (ext != NULL && (announce_waiter(&smtx->writer_locked, 0) & SMTX_WAITERS)) {
+        if (syscall(SYS_futex, &cond->seq, FUTEX_CMP_REQUEUE_PRIVATE, 1, INT32_MAX, &ext->requeued, seq) >= 0) {
+            // Count the broadcast (never back to 0, which means nobody is requeued), then make sure
+            // a release will see it: one that cleared the waiter bit before may have missed the
+            // count, so let the first requeued waiter in for it.
+            if (atomic_fetch_add_explicit(&ext->requeued, 1, memory_order_seq_cst) == UINT32_MAX) {
+                atomic_fetch_add_explicit(&ext->requeued, 1, memory_order_relaxed);
+            }
+            if (!(atomic_load_explicit(&smtx->writer_locked, memory_order_seq_cst) & SMTX_WAITERS)) {
+                wake_requeued(smtx);
+            }
+            return thrd_success;
+        }
+    }
+#endif
+
+    (void)seq;
+    futex_wake(&cond->seq, INT32_MAX, 0);
+
+    return thrd_success;
+}
+
+#ifdef SMTX_IO_URING
+#ifndef SMTX_FUTEX
+#error "SMTX_IO_URING requires Linux futex support (do not combine it with SMTX_NO_FUTEX)"
+#endif
+
+#include <linux/io_uring.h>
+#include <string.h>
+
+#undef SMTX_IORING_OP_FUTEX_WAIT
+#define SMTX_IORING_OP_FUTEX_WAIT 51
+
+SMTX_UTIL void uring_prep_futex_wait(struct io_uring_sqe *sqe, atomic_uint *addr, uint expected, uint flags) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = SMTX_IORING_OP_FUTEX_WAIT;
+    sqe->fd = SMTX_FUTEX2_SIZE_U32 | ((flags & SMTX_FLAG_PSHARED) ? 0 : SMTX_FUTEX2_PRIVATE);
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->addr2 = expected;
+    sqe->addr3 = FUTEX_BITSET_MATCH_ANY;
+}
+
+SMTX_IMPL int smtx_uring_prep_lock_shared(smtx_t *smtx, struct io_uring_sqe *sqe) {
+    if (smtx == NULL || sqe == NULL || (smtx->flags & (SMTX_FLAG_ROBUST | SMTX_FLAG_PI | SMTX_FLAG_DEADLINE_ORDER))
+        || wait_strategy(smtx) != NULL) {
+        return thrd_error;
+    }
+
+    while (true) {
+        if (smtx_trylock_shared(smtx) == thrd_success) {
+            return thrd_success;
+        }
+
+        const uint word = announce_waiter(&smtx->writer_locked, 0);
+        if (word != 0) {
+            uring_prep_futex_wait(sqe, &smtx->writer_locked, word, smtx->flags);
+            return thrd_busy;
+        }
+    }
+}
+
+/* SMTX_PREFER_READERS order, as lock_exclusive_prefer_readers: wait on reader_count while readers
+   are inside, and only keep the writer word if none slipped in after taking it. */
+SMTX_UTIL int uring_prep_lock_prefer_readers(smtx_t *smtx, struct io_uring_sqe *sqe) {
+    while (true) {
+        uint word = announce_waiter(&smtx->reader_count, 0);
+        if (reader_count_of(word) != 0) {
+            uring_prep_futex_wait(sqe, &smtx->reader_count, word, smtx->flags);
+            return thrd_busy;
+        }
+
+        uint expected = 0;
+        if (atomic_compare_exchange_strong_explicit(&smtx->writer_locked, &expected, writer_value(smtx), memory_order_seq_cst, memory_order_relaxed)) {
+            if (reader_count_of(atomic_load_explicit(&smtx->reader_count, memory_order_seq_cst)) == 0) {
+                claim_writer(smtx);
+                return thrd_success;
+            }
+            release_writer(smtx);
+            continue;
+        }
+
+        word = announce_waiter(&smtx->writer_locked, 0);
+        if (word != 0) {
+            uring_prep_futex_wait(sqe, &smtx->writer_locked, word, smtx->flags);
+            return thrd_busy;
+        }
+    }
+}
+
+SMTX_IMPL int smtx_uring_prep_lock_exclusive(smtx_t *smtx, struct io_uring_sqe *sqe, int *draining) {
+    if (smtx == NULL || sqe == NULL || draining == NULL || (smtx->flags & (SMTX_FLAG_ROBUST | SMTX_FLAG_PI | SMTX_FLAG_DEADLINE_ORDER))
+        || wait_strategy(smtx) != NULL) {
+        return thrd_error;
+    }
+
+    if (smtx->flags & SMTX_FLAG_PREFER_READERS) {
+        return uring_prep_lock_prefer_readers(smtx, sqe);
+    }
+
+    while (!*draining) {
+        uint expected = 0;
+        if (atomic_compare_exchange_strong_explicit(&smtx->writer_locked, &expected, writer_value(smtx), memory_order_seq_cst, memory_order_relaxed)) {
+            claim_writer(smtx);
+            *draining = 1;
+            break;
+        }
+
+        const uint word = announce_waiter(&smtx->writer_locked, 0);
+        if (word != 0) {
+            uring_prep_futex_wait(sqe, &smtx->writer_locked, word, smtx->flags);
+            return thrd_busy;
+        }
+    }
+
+    const uint word = announce_waiter(&smtx->reader_count, 0);
+    if (reader_count_of(word) == 0) {
+        atomic_thread_fence(memory_order_acquire);
+        *draining = 0;
+        return thrd_success;
+    }
+
+    uring_prep_futex_wait(sqe, &smtx->reader_count, word, smtx->flags);
+    return thrd_busy;
+}
+#endif
+
 #endif // SMTX_IMPLEMENTATION
 
 /*
@@ -0,0 +1,554 @@
+/* smtx.hpp - v1.0 - Shared Mutex (Reader-Writer Lock) C++ Layer
+                            no warranty implied; use at your own risk
+
+   Header-only C++17 counterpart of smtx.h. smtx::basic_shared_mutex meets the SharedTimedMutex
+   requirements, so std::shared_lock, std::unique_lock and std::scoped_lock work with it directly.
+   It uses the same lock words and algorithm as smtx.h, but every tunable that smtx.h exposes as a
+   global SMTX_* macro is a compile-time policy here, so differently tuned locks can live in one
+   binary without any runtime dispatch.
+
+   Usage:
+     #include "smtx.hpp"
+
+     smtx::shared_mutex mutex;                                          // smtx.h defaults
+     smtx::basic_shared_mutex<smtx::spin_policy<64, 64, 32>,            // short spinning,
+                              smtx::futex_wait,                         // then park in the kernel,
+                              smtx::prefer_readers,                     // readers never held back,
+                              smtx::padded_layout<64>> tuned;           // one cache line per word
+
+   Policies:
+     Spin     - smtx::spin_policy<MaxWriterWaitSpins, MaxReaderWaitSpins, YieldThreshold, NextSpins>
+                (default: spin_policy<1024, 1024, 512>, exponential backoff)
+     Wait     - what a waiter does once its spin count exceeds YieldThreshold:
+                smtx::spin_wait (keep spinning), smtx::yield_wait (std::this_thread::yield, default),
+                smtx::futex_wait (sleep on the lock word, Linux; yields elsewhere)
+     Fairness - smtx::prefer_writers (pending writer blocks new readers, default) or smtx::prefer_readers
+     Layout   - smtx::compact_layout (default) or smtx::padded_layout<CacheLineSize>
+
+   Options (define before including, the model checker routes them to its hooks):
+     #define SMTX_HPP_ATOMIC             - atomic class template of the lock words and flags (default: std::atomic)
+     #define SMTX_HPP_FENCE(order)       - override the fence of async_shared_mutex (default: std::atomic_thread_fence)
+     #define SMTX_HPP_YIELD()            - override thread yielding of smtx::yield_wait (default: std::this_thread::yield)
+
+   C++20 coroutines (when <coroutine> is available):
+     smtx::async_shared_mutex mutex;
+     co_await mutex.lock_shared(); ... mutex.unlock_shared();
+     co_await mutex.lock();        ... mutex.unlock();
+
+     A coroutine that cannot take the lock is queued without blocking its thread and resumed by
+     the unlocking thread, or handed to the executor given to smtx::basic_async_shared_mutex. The
+     queue node is the awaiter itself, which lives in the coroutine frame, so waiting never allocates.
+
+   License: MIT (see end of file for license information)
+*/
+
+#ifndef SMTX_HPP
+#define SMTX_HPP
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define SMTX_HPP_COROUTINES
+#endif
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+#ifndef SMTX_HPP_ATOMIC
+#define SMTX_HPP_ATOMIC std::atomic
+#endif
+
+#ifndef SMTX_HPP_FENCE
+#define SMTX_HPP_FENCE(order) std::atomic_thread_fence(order)
+#endif
+
+#ifndef SMTX_HPP_YIELD
+#define SMTX_HPP_YIELD() std::this_thread::yield()
+#endif
+
+namespace smtx {
+
+using word_t = SMTX_HPP_ATOMIC<std::uint32_t>;
+
+static_assert(sizeof(word_t) == 4 && word_t::is_always_lock_free, "smtx lock words must be lock-free 32-bit futex words");
+
+inline constexpr std::uint32_t waiters_bit   = 0x80000000u;
+inline constexpr std::uint32_t state_mask    = ~waiters_bit;
+inline constexpr std::uint32_t writer_locked = 1u;
+
+namespace detail {
+
+inline void spin(unsigned delay) noexcept {
+    for (unsigned i = 0; i < delay; ++i) {
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+        _mm_pause();
+#else
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+    }
+}
+
+/* Mark `word` as having a sleeper unless its state already reached `until`, returns the value to sleep on. */
+inline std::uint32_t announce_waiter(word_t &word, std::uint32_t until) noexcept {
+    std::uint32_t curr = word.load(std::memory_order_seq_cst);
+    while ((curr & state_mask) != until && !(curr & waiters_bit)) {
+        if (word.compare_exchange_weak(curr, curr | waiters_bit, std::memory_order_relaxed)) {
+            return curr | waiters_bit;
+        }
+    }
+    return curr;
+}
+
+} // namespace detail
+
+template <unsigned MaxWriterWaitSpins = 1024, unsigned MaxReaderWaitSpins = 1024, unsigned YieldThreshold = 512, unsigned NextSpinsFactor = 2>
+struct spin_policy {
+    static constexpr unsigned max_writer_wait_spins = MaxWriterWaitSpins;
+    static constexpr unsigned max_reader_wait_spins = MaxReaderWaitSpins;
+    static constexpr unsigned yield_threshold       = YieldThreshold;
+
+    static constexpr unsigned next_spins(unsigned curr_spins) noexcept {
+        return curr_spins * NextSpinsFactor;
+    }
+};
+
+struct spin_wait {
+    static constexpr bool parks = false;
+
+    static void block(word_t &, std::uint32_t, std::chrono::nanoseconds) noexcept {}
+
+    static void wake(word_t &) noexcept {}
+};
+
+struct yield_wait {
+    static constexpr bool parks = false;
+
+    static void block(word_t &, std::uint32_t, std::chrono::nanoseconds) noexcept {
+        SMTX_HPP_YIELD();
+    }
+
+    static void wake(word_t &) noexcept {}
+};
+
+struct futex_wait {
+#if defined(__linux__)
+    static constexpr bool parks = true;
+
+    /* Sleeps while the word's state differs from `until`, for at most `timeout` (zero or less: unbounded). */
+    static void block(word_t &word, std::uint32_t until, std::chrono::nanoseconds timeout) noexcept {
+        const std::uint32_t expected = detail::announce_waiter(word, until);
+        if ((expected & state_mask) == until) {
+            return;
+        }
+
+        struct timespec ts{};
+        if (timeout.count() > 0) {
+            ts.tv_sec  = static_cast<time_t>(timeout.count() / 1000000000);
+            ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+        }
+        syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, expected, timeout.count() > 0 ? &ts : nullptr, nullptr, 0);
+    }
+
+    static void wake(word_t &word) noexcept {
+        syscall(SYS_futex, &word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+#else
+    static constexpr bool parks = false;
+
+    static void block(word_t &word, std::uint32_t until, std::chrono::nanoseconds timeout) noexcept {
+        yield_wait::block(word, until, timeout);
+    }
+
+    static void wake(word_t &) noexcept {}
+#endif
+};
+
+struct prefer_writers {
+    static constexpr bool writer_preferring = true;
+};
+
+struct prefer_readers {
+    static constexpr bool writer_preferring = false;
+};
+
+struct compact_layout {
+    static constexpr std::size_t alignment = alignof(word_t);
+};
+
+template <std::size_t CacheLineSize = 64>
+struct padded_layout {
+    static constexpr std::size_t alignment = CacheLineSize;
+};
+
+template <class Spin = spin_policy<>, class Wait = yield_wait, class Fairness = prefer_writers, class Layout = compact_layout>
+class basic_shared_mutex {
+public:
+    using spin_type     = Spin;
+    using wait_type     = Wait;
+    using fairness_type = Fairness;
+    using layout_type   = Layout;
+
+    constexpr basic_shared_mutex() noexcept = default;
+
+    basic_shared_mutex(const basic_shared_mutex &) = delete;
+    basic_shared_mutex &operator=(const basic_shared_mutex &) = delete;
+
+    void lock_shared() noexcept {
+        unsigned spins = 1;
+        while (!try_lock_shared()) {
+            backoff(writer_, 0, spins, Spin::max_writer_wait_spins, std::chrono::nanoseconds::zero());
+        }
+    }
+
+    bool try_lock_shared() noexcept {
+        if (writer_.load(std::memory_order_acquire) != 0) {
+            return false;
+        }
+
+        // Store-buffering pattern against acquire_writer + readers_ check, both halves must be seq_cst (see smtx.h).
+        readers_.fetch_add(1, std::memory_order_seq_cst);
+
+        if (writer_.load(std::memory_order_seq_cst) != 0) {
+            release_readers(1);
+            return false;
+        }
+
+        return true;
+    }
+
+    template <class Rep, class Period>
+    bool try_lock_shared_for(const std::chrono::duration<Rep, Period> &timeout) {
+        return try_lock_shared_until(std::chrono::steady_clock::now() + timeout);
+    }
+
+    template <class Clock, class Duration>
+    bool try_lock_shared_until(const std::chrono::time_point<Clock, Duration> &time_point) {
+        unsigned spins = 1;
+        while (!try_lock_shared()) {
+            const auto remaining = time_point - Clock::now();
+            if (remaining <= Duration::zero()) {
+                return false;
+            }
+            backoff(writer_, 0, spins, Spin::max_writer_wait_spins, std::chrono::duration_cast<std::chrono::nanoseconds>(remaining));
+        }
+        return true;
+    }
+
+    void unlock_shared() noexcept {
+        release_readers(1);
+    }
+
+    void lock() noexcept {
+        if constexpr (Fairness::writer_preferring) {
+            unsigned spins = 1;
+            while (!acquire_writer()) {
+                backoff(writer_, 0, spins, Spin::max_reader_wait_spins, std::chrono::nanoseconds::zero());
+            }
+
+            spins = 1;
+            while ((readers_.load(std::memory_order_seq_cst) & state_mask) != 0) {
+                backoff(readers_, 0, spins, Spin::max_reader_wait_spins, std::chrono::nanoseconds::zero());
+            }
+        } else {
+            unsigned spins = 1;
+            while (!try_lock()) {
+                word_t &blocking = writer_.load(std::memory_order_relaxed) != 0 ? writer_ : readers_;
+                backoff(blocking, 0, spins, Spin::max_reader_wait_spins, std::chrono::nanoseconds::zero());
+            }
+        }
+    }
+
+    bool try_lock() noexcept {
+        // Reader preference: only touch the writer word while no reader is inside, every attempt on
+        // it holds back arriving readers (lock_exclusive_prefer_readers in smtx.h).
+        if constexpr (!Fairness::writer_preferring) {
+            if ((readers_.load(std::memory_order_relaxed) & state_mask) != 0) {
+                return false;
+            }
+        }
+        if (!acquire_writer()) {
+            return false;
+        }
+
+        if ((readers_.load(std::memory_order_seq_cst) & state_mask) != 0) {
+            release_writer();
+            return false;
+        }
+
+        return true;
+    }
+
+    template <class Rep, class Period>
+    bool try_lock_for(const std::chrono::duration<Rep, Period> &timeout) {
+        return try_lock_until(std::chrono::steady_clock::now() + timeout);
+    }
+
+    template <class Clock, class Duration>
+    bool try_lock_until(const std::chrono::time_point<Clock, Duration> &time_point) {
+        unsigned spins = 1;
+        if constexpr (Fairness::writer_preferring) {
+            while (!acquire_writer()) {
+                const auto remaining = time_point - Clock::now();
+                if (remaining <= Duration::zero()) {
+                    return false;
+                }
+                backoff(writer_, 0, spins, Spin::max_reader_wait_spins, std::chrono::duration_cast<std::chrono::nanoseconds>(remaining));
+            }
+
+            spins = 1;
+            while ((readers_.load(std::memory_order_seq_cst) & state_mask) != 0) {
+                const auto remaining = time_point - Clock::now();
+                if (remaining <= Duration::zero()) {
+                    release_writer();
+                    return false;
+                }
+                backoff(readers_, 0, spins, Spin::max_reader_wait_spins, std::chrono::duration_cast<std::chrono::nanoseconds>(remaining));
+            }
+        } else {
+            while (!try_lock()) {
+                const auto remaining = time_point - Clock::now();
+                if (remaining <= Duration::zero()) {
+                    return false;
+                }
+                word_t &blocking = writer_.load(std::memory_order_relaxed) != 0 ? writer_ : readers_;
+                backoff(blocking, 0, spins, Spin::max_reader_wait_spins, std::chrono::duration_cast<std::chrono::nanoseconds>(remaining));
+            }
+        }
+        return true;
+    }
+
+    void unlock() noexcept {
+        release_writer();
+    }
+
+private:
+    bool acquire_writer() noexcept {
+        std::uint32_t expected = 0;
+        return writer_.compare_exchange_strong(expected, writer_locked, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    void release_writer() noexcept {
+        if (writer_.exchange(0, std::memory_order_release) & waiters_bit) {
+            Wait::wake(writer_);
+        }
+    }
+
+    void release_readers(std::uint32_t count) noexcept {
+        const std::uint32_t prev = readers_.fetch_sub(count, std::memory_order_release);
+        if (prev == (waiters_bit | count)) {
+            readers_.fetch_and(state_mask, std::memory_order_relaxed);
+            Wait::wake(readers_);
+        }
+    }
+
+    static void backoff(word_t &word, std::uint32_t until, unsigned &spins, unsigned max_spins, std::chrono::nanoseconds timeout) noexcept {
+        detail::spin(spins);
+        if (spins > Spin::yield_threshold) {
+            Wait::block(word, until, timeout);
+        }
+        if (spins < max_spins) {
+            spins = Spin::next_spins(spins);
+        }
+    }
+
+    alignas(Layout::alignment) word_t readers_{0};
+    alignas(Layout::alignment) word_t writer_{0};
+};
+
+using shared_mutex = basic_shared_mutex<>;
+
+#ifdef SMTX_HPP_COROUTINES
+struct inline_executor {
+    void operator()(std::coroutine_handle<> handle) const {
+        handle.resume();
+    }
+};
+
+/* Executor is any callable taking std::coroutine_handle<> that eventually resumes it. */
+template <class Executor = inline_executor>
+class basic_async_shared_mutex {
+public:
+    class lock_awaiter {
+    public:
+        bool await_ready() noexcept {
+            return !mutex_.has_waiters_.load(std::memory_order_relaxed) && mutex_.try_acquire(exclusive_);
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) noexcept {
+            handle_ = handle;
+            return mutex_.enqueue(this);
+        }
+
+        void await_resume() const noexcept {}
+
+    private:
+        friend class basic_async_shared_mutex;
+
+        lock_awaiter(basic_async_shared_mutex &mutex, bool exclusive) noexcept : mutex_(mutex), exclusive_(exclusive) {}
+
+        basic_async_shared_mutex &mutex_;
+        bool exclusive_;
+        lock_awaiter *next_ = nullptr;
+        std::coroutine_handle<> handle_;
+    };
+
+    explicit basic_async_shared_mutex(Executor executor = Executor()) : executor_(std::move(executor)) {}
+
+    basic_async_shared_mutex(const basic_async_shared_mutex &) = delete;
+    basic_async_shared_mutex &operator=(const basic_async_shared_mutex &) = delete;
+
+    [[nodiscard]] lock_awaiter lock_shared() noexcept {
+        return lock_awaiter(*this, false);
+    }
+
+    [[nodiscard]] lock_awaiter lock() noexcept {
+        return lock_awaiter(*this, true);
+    }
+
+    bool try_lock_shared() {
+        return try_or_dispatch(false);
+    }
+
+    bool try_lock() {
+        return try_or_dispatch(true);
+    }
+
+    void unlock_shared() {
+        lock_.unlock_shared();
+        dispatch();
+    }
+
+    void unlock() {
+        lock_.unlock();
+        dispatch();
+    }
+
+private:
+    bool try_acquire(bool exclusive) noexcept {
+        return exclusive ? lock_.try_lock() : lock_.try_lock_shared();
+    }
+
+    /* A failed try backs out of the lock words, which may be all that failed a queued coroutine's
+       attempt: nobody would unlock and dispatch it then. */
+    bool try_or_dispatch(bool exclusive) {
+        if (try_acquire(exclusive)) {
+            return true;
+        }
+        dispatch();
+        return false;
+    }
+
+    /* Returns false if the lock was acquired after all and the coroutine must not suspend. */
+    bool enqueue(lock_awaiter *node) {
+        guard_.lock();
+
+        // Pairs with the fence in dispatch: either the releaser sees has_waiters_, or we see its release.
+        has_waiters_.store(true, std::memory_order_relaxed);
+        SMTX_HPP_FENCE(std::memory_order_seq_cst);
+
+        // Admit from the head rather than try for ourselves alone: the head's attempt may have failed
+        // on our try in await_ready, which has backed out since.
+        *tail_ = node;
+        tail_ = &node->next_;
+        lock_awaiter *ready = admit();
+        guard_.unlock();
+
+        return !resume(ready, node);
+    }
+
+    void dispatch() {
+        SMTX_HPP_FENCE(std::memory_order_seq_cst);
+        if (!has_waiters_.load(std::memory_order_relaxed)) {
+            return;
+        }
+
+        guard_.lock();
+        lock_awaiter *ready = admit();
+        guard_.unlock();
+
+        resume(ready, nullptr);
+    }
+
+    /* Takes the lock for the queued coroutines it admits now, in order, and returns them. Under guard_. */
+    lock_awaiter *admit() noexcept {
+        lock_awaiter *ready = nullptr;
+        lock_awaiter **ready_tail = &ready;
+        while (head_ != nullptr && try_acquire(head_->exclusive_)) {
+            lock_awaiter *node = head_;
+            head_ = node->next_;
+            node->next_ = nullptr;
+            *ready_tail = node;
+            ready_tail = &node->next_;
+        }
+        if (head_ == nullptr) {
+            tail_ = &head_;
+            has_waiters_.store(false, std::memory_order_relaxed);
+        }
+        return ready;
+    }
+
+    /* Hands the admitted coroutines to the executor, all but `self`, which is still running. Returns
+       whether `self` was among them. */
+    bool resume(lock_awaiter *ready, const lock_awaiter *self) {
+        bool admitted = false;
+        while (ready != nullptr) {
+            lock_awaiter *node = ready;
+            ready = node->next_; // the node dies with its coroutine frame once resumed
+            if (node == self) {
+                admitted = true;
+            } else {
+                executor_(node->handle_);
+            }
+        }
+        return admitted;
+    }
+
+    basic_shared_mutex<spin_policy<>, spin_wait> lock_;
+    basic_shared_mutex<spin_policy<>, yield_wait> guard_;
+    SMTX_HPP_ATOMIC<bool> has_waiters_{false};
+    lock_awaiter *head_ = nullptr;
+    lock_awaiter **tail_ = &head_;
+    [[no_unique_address]] Executor executor_;
+};
+
+using async_shared_mutex = basic_async_shared_mutex<>;
+#endif
+
+} // namespace smtx
+
+#endif // SMTX_HPP
+
+/*
+   Copyright 2025 Karlo Bratko <kbratko@tuta.io>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files (the “Software”), to deal in the Software without
+   restriction, including without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+   OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
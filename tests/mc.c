@@ -0,0 +1,1209 @@
+/* Engine of the model checker, see mc.h. Each thread has its own rseq area and CPU: tests on one
+   CPU never spin, those on more spin like waiters on a multicore. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "mc.h"
+
+/* Where glibc registers an rseq area for every thread (2.35+), as smtx.h detects it. */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 35) && defined(__has_builtin)
+#if __has_builtin(__builtin_thread_pointer)
+#define MC_RSEQ
+#include <sys/rseq.h>
+#endif
+#endif
+
+#define MC_MAIN MC_THREADS     // pseudo thread running setup and the final checks
+#define MC_LOCATIONS 128
+#define MC_CHOICES 65536       // per execution
+#define MC_STEPS 20000         // an execution still running after this many operations livelocked
+#define MC_SPIN_OPS 8          // operations without a store after which a thread counts as spinning
+#define MC_STALE_CHOICES 4     // older stores a stale read picks from
+#define MC_ARENA (1u << 22)    // view entries per execution
+#define MC_STACK_SIZE (256 * 1024)
+#define MC_WAITV 4             // words one futex_waitv sleeps on
+#define MC_TRACE 48
+#define MC_TLS_BLOCKS 4        // mc_thread_local registrations
+#define MC_TLS_SIZE 256        // bytes of them per thread
+#define MC_QUIET 4             // mc_quiet registrations
+#define MC_NS_PER_S 1000000000ll
+#define MC_HORIZON_NS (60 * MC_NS_PER_S) // sleeps ending sooner time out once everyone sleeps
+#define MC_NO_DEADLINE INT64_MAX
+#define MC_SYS_FUTEX_WAITV 449 // not in every distribution's headers yet
+
+_Static_assert(memory_order_seq_cst == __ATOMIC_SEQ_CST && memory_order_relaxed == __ATOMIC_RELAXED, "orders are the __ATOMIC_* values");
+
+/* struct futex_waitv of the futex2 ABI. */
+typedef struct {
+    uint64_t val;
+    uint64_t uaddr;
+    uint32_t flags;
+    uint32_t __reserved;
+} mc_futex_waitv_t;
+
+typedef struct {
+    uint64_t value;
+    const uint32_t *view; // what acquiring this store teaches, the store itself included
+    uint32_t view_size;
+    int thread;
+} mc_write_t;
+
+typedef struct {
+    const volatile void *addr;
+    size_t size;
+    mc_write_t *history; // modification order, [0] holds the value found at first use
+    uint32_t count;
+    uint32_t capacity;
+} mc_location_t;
+
+typedef enum { MC_RUNNABLE, MC_BLOCKED, MC_DONE } mc_state_t;
+
+/* Views map each location to the oldest store in its modification order a thread may still read. */
+typedef struct {
+    ucontext_t context;
+    mc_state_t state;
+    const volatile void *futex[MC_WAITV]; // words slept on while blocked
+    uint futexes;
+    uint woken_by;              // index of the word whose wake ended the sleep
+    bool pi;                    // in FUTEX_LOCK_PI, woken by being handed the word
+    int64_t deadline;           // of that sleep on CLOCK_MONOTONIC, MC_NO_DEADLINE for none
+    bool timed_out;             // woken by its deadline rather than a futex wake
+    bool stalled;               // spun or yielded since anyone last stored
+    uint idle;                  // operations since it last stored
+    uint32_t view[MC_LOCATIONS];
+    uint32_t acquired[MC_LOCATIONS]; // views of relaxed loads, for the next acquire fence
+    uint32_t released[MC_LOCATIONS]; // view at the last release fence, carried by relaxed stores
+    uint32_t fenced[MC_LOCATIONS];   // lower bound on every load, from seq_cst fences
+#ifdef MC_RSEQ
+    struct rseq rseq;                // what the code under test finds at its thread pointer, names its CPU
+#endif
+    unsigned char tls[MC_TLS_SIZE];  // its thread-local state, swapped in while the thread runs
+} mc_thread_t;
+
+typedef struct {
+    uint16_t taken;
+    uint16_t count;
+} mc_choice_t;
+
+typedef struct {
+    int thread;
+    const char *what;
+    const volatile void *addr;
+    uint64_t value;
+    uint32_t ts; // position of the store read or written in the modification order
+} mc_event_t;
+
+static struct {
+    const mc_test_t *test;
+    void (*start)(const mc_test_t *test);
+    mc_thread_t threads[MC_THREADS + 1];
+    int current;
+    ucontext_t main_context;
+    char *stacks[MC_THREADS];
+
+    mc_location_t locations[MC_LOCATIONS];
+    uint32_t location_count;
+    uint32_t sc[MC_LOCATIONS]; // seq_cst stores and what seq_cst fences saw, bounds seq_cst loads and fences
+    uint32_t *arena;
+    size_t arena_used;
+
+    mc_choice_t choices[MC_CHOICES];
+    size_t depth;
+    size_t replay;
+    uint preemptions, max_preemptions;
+    uint stale_reads, max_stale_reads;
+    uint steps;
+    unsigned long long executions;
+
+    mc_event_t trace[MC_TRACE];
+    size_t events;
+
+    struct {
+        const volatile void *addr;
+        const char *name;
+    } labels[64];
+    size_t label_count;
+
+    struct {
+        void *addr;
+        size_t size;
+    } tls[MC_TLS_BLOCKS];
+    size_t tls_count, tls_size;
+    const volatile void *quiet[MC_QUIET];
+    size_t quiet_count;
+} mc;
+
+void mc_label(const volatile void *addr, const char *name) {
+    for (size_t i = 0; i < mc.label_count; ++i) {
+        if (mc.labels[i].addr == addr) {
+            return;
+        }
+    }
+    if (mc.label_count < sizeof(mc.labels) / sizeof(mc.labels[0])) {
+        mc.labels[mc.label_count].addr = addr;
+        mc.labels[mc.label_count++].name = name;
+    }
+}
+
+void mc_thread_local(void *addr, size_t size) {
+    if (mc.tls_count == MC_TLS_BLOCKS || mc.tls_size + size > MC_TLS_SIZE) {
+        fprintf(stderr, "mc_thread_local: more than %d blocks or %d bytes\n", MC_TLS_BLOCKS, MC_TLS_SIZE);
+        exit(2);
+    }
+    mc.tls[mc.tls_count].addr = addr;
+    mc.tls[mc.tls_count++].size = size;
+    mc.tls_size += size;
+}
+
+void mc_quiet(const volatile void *addr) {
+    if (mc.quiet_count == MC_QUIET) {
+        fprintf(stderr, "mc_quiet: more than %d words\n", MC_QUIET);
+        exit(2);
+    }
+    mc.quiet[mc.quiet_count++] = addr;
+}
+
+static void mc_print_addr(const volatile void *addr) {
+    for (size_t i = 0; i < mc.label_count; ++i) {
+        if (mc.labels[i].addr == addr) {
+            printf("%s", mc.labels[i].name);
+            return;
+        }
+    }
+    for (int i = 0; i < MC_THREADS; ++i) {
+        if ((const volatile char *)addr >= mc.stacks[i] && (const volatile char *)addr < mc.stacks[i] + MC_STACK_SIZE) {
+            printf("stack of thread %d", i);
+            return;
+        }
+    }
+    printf("%p", (const void *)addr);
+}
+
+static void mc_print_thread(int thread) {
+    if (thread == MC_MAIN) {
+        printf("main");
+    } else {
+        printf("thread %d", thread);
+    }
+}
+
+static void mc_trace(const char *what, const volatile void *addr, uint64_t value, uint32_t ts) {
+    mc.trace[mc.events++ % MC_TRACE] = (mc_event_t){mc.current, what, addr, value, ts};
+}
+
+static void __attribute__((noreturn, format(printf, 1, 2))) mc_fail(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    printf("%s: ", mc.test->name);
+    vprintf(format, args);
+    va_end(args);
+    printf(" (");
+    mc_print_thread(mc.current);
+    printf(", execution %llu, %u preemptions, %u stale reads)\n", mc.executions + 1, mc.preemptions, mc.stale_reads);
+
+    printf("last operations:\n");
+    for (size_t i = mc.events > MC_TRACE ? mc.events - MC_TRACE : 0; i < mc.events; ++i) {
+        const mc_event_t *event = &mc.trace[i % MC_TRACE];
+        printf("  ");
+        mc_print_thread(event->thread);
+        printf(": %s ", event->what);
+        if (event->addr != NULL) {
+            mc_print_addr(event->addr);
+        }
+        printf(" = %#llx (store %u)\n", (unsigned long long)event->value, event->ts);
+    }
+    fflush(stdout);
+    exit(1);
+}
+
+void mc_assert(bool ok, const char *expr) {
+    if (!ok) {
+        mc_fail("assertion failed: %s", expr);
+    }
+}
+
+/* Next choice of this execution, replaying the prefix the previous one backtracked to. */
+static uint mc_choose(uint count) {
+    if (count <= 1) {
+        return 0;
+    }
+    if (mc.depth == MC_CHOICES) {
+        mc_fail("more than %d choices in one execution", MC_CHOICES);
+    }
+    mc_choice_t *choice = &mc.choices[mc.depth++];
+    if (mc.depth <= mc.replay) {
+        if (choice->count != count) {
+            mc_fail("replay diverged, the test does not behave deterministically");
+        }
+        return choice->taken;
+    }
+    *choice = (mc_choice_t){0, (uint16_t)count};
+    return 0;
+}
+
+static bool mc_backtrack(void) {
+    while (mc.depth > 0 && mc.choices[mc.depth - 1].taken + 1 >= mc.choices[mc.depth - 1].count) {
+        mc.depth -= 1;
+    }
+    if (mc.depth == 0) {
+        return false;
+    }
+    mc.choices[mc.depth - 1].taken += 1;
+    mc.replay = mc.depth;
+    return true;
+}
+
+static mc_thread_t *mc_self(void) {
+    return &mc.threads[mc.current];
+}
+
+static void mc_join(uint32_t *into, const uint32_t *from, uint32_t size) {
+    for (uint32_t i = 0; i < size; ++i) {
+        if (from[i] > into[i]) {
+            into[i] = from[i];
+        }
+    }
+}
+
+static bool mc_acquires(memory_order order) {
+    return order == memory_order_consume || order == memory_order_acquire || order == memory_order_acq_rel
+        || order == memory_order_seq_cst;
+}
+
+static bool mc_releases(memory_order order) {
+    return order == memory_order_release || order == memory_order_acq_rel || order == memory_order_seq_cst;
+}
+
+static uint64_t mc_mask(size_t size) {
+    return size >= sizeof(uint64_t) ? UINT64_MAX : (1ull << (size * 8)) - 1;
+}
+
+static uint64_t mc_peek(const volatile void *addr, size_t size) {
+    uint64_t value = 0;
+    memcpy(&value, (const void *)addr, size);
+    return value;
+}
+
+static uint32_t mc_index(const mc_location_t *loc) {
+    return (uint32_t)(loc - mc.locations);
+}
+
+/* Add a store to the end of the modification order (and to memory). Its view is `view` (NULL for
+   none) joined with that of `after`, the store an RMW read, which continues its release sequence. */
+static uint32_t mc_append(mc_location_t *loc, uint64_t value, const uint32_t *view, const mc_write_t *after) {
+    if (loc->count == loc->capacity) {
+        loc->capacity = loc->capacity != 0 ? loc->capacity * 2 : 64;
+        loc->history = realloc(loc->history, loc->capacity * sizeof(*loc->history));
+        mc_assert(loc->history != NULL, "out of memory");
+    }
+    if (mc.arena_used + mc.location_count > MC_ARENA) {
+        mc_fail("execution too long");
+    }
+
+    uint32_t *copy = mc.arena + mc.arena_used;
+    mc.arena_used += mc.location_count;
+    if (view != NULL) {
+        memcpy(copy, view, mc.location_count * sizeof(*copy));
+    } else {
+        memset(copy, 0, mc.location_count * sizeof(*copy));
+    }
+    if (after != NULL) {
+        mc_join(copy, after->view, after->view_size);
+    }
+
+    const uint32_t ts = loc->count++;
+    copy[mc_index(loc)] = ts;
+    loc->history[ts] = (mc_write_t){value, copy, mc.location_count, mc.current};
+    memcpy((void *)loc->addr, &value, loc->size);
+    return ts;
+}
+
+/* A store outside the model (a plain initialiser of a reused stack slot) is visible to everyone,
+   whoever hands the memory over synchronises with its new owner anyway. */
+static void mc_adopt(mc_location_t *loc, uint64_t value) {
+    const uint32_t ts = mc_append(loc, value, NULL, NULL);
+    for (int i = 0; i <= MC_MAIN; ++i) {
+        mc.threads[i].view[mc_index(loc)] = ts;
+    }
+}
+
+static mc_location_t *mc_location(const volatile void *addr, size_t size) {
+    mc_location_t *loc = NULL;
+    for (uint32_t i = 0; i < mc.location_count; ++i) {
+        if (mc.locations[i].addr == addr) {
+            loc = &mc.locations[i];
+            break;
+        }
+    }
+    if (loc == NULL) {
+        if (mc.location_count == MC_LOCATIONS) {
+            mc_fail("more than %d atomic locations", MC_LOCATIONS);
+        }
+        loc = &mc.locations[mc.location_count++];
+        loc->addr = addr;
+        loc->size = size;
+        loc->count = 0;
+        mc_append(loc, mc_peek(addr, size), NULL, NULL);
+    }
+
+    const uint64_t value = mc_peek(addr, loc->size);
+    if (value != loc->history[loc->count - 1].value) {
+        mc_adopt(loc, value);
+    }
+    return loc;
+}
+
+/* A store somebody made: spinning threads get to look again. */
+static void mc_progress(void) {
+    for (int i = 0; i < MC_THREADS; ++i) {
+        mc.threads[i].stalled = false;
+        mc.threads[i].idle = 0;
+    }
+}
+
+/* Whether storing `value` to `loc` is progress: it changes the word, and the word is not quiet. */
+static bool mc_changes(const mc_location_t *loc, uint64_t value) {
+    if (value == loc->history[loc->count - 1].value) {
+        return false;
+    }
+    for (size_t i = 0; i < mc.quiet_count; ++i) {
+        if (mc.quiet[i] == loc->addr) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void mc_step(bool stored) {
+    if (mc.current == MC_MAIN) {
+        return;
+    }
+    if (stored) {
+        mc_progress();
+    } else {
+        mc_self()->idle += 1;
+    }
+}
+
+/* Copy the registered thread-local blocks out to `thread`'s copy (or back in from it). */
+static void mc_swap_tls(int thread, bool out) {
+    unsigned char *copy = mc.threads[thread].tls;
+    for (size_t i = 0; i < mc.tls_count; ++i) {
+        if (out) {
+            memcpy(copy, mc.tls[i].addr, mc.tls[i].size);
+        } else {
+            memcpy(mc.tls[i].addr, copy, mc.tls[i].size);
+        }
+        copy += mc.tls[i].size;
+    }
+}
+
+/* Make `next` the running thread, thread-local state included. */
+static void mc_become(int next) {
+    mc_swap_tls(mc.current, true);
+    mc.current = next;
+    mc_swap_tls(next, false);
+}
+
+/* Base of the running thread's TLS as the code under test sees it, so that its rseq area is the
+   thread's own. */
+void *mc_thread_pointer(void) {
+#ifdef MC_RSEQ
+    return (char *)&mc.threads[mc.current].rseq - __rseq_offset;
+#else
+    return NULL;
+#endif
+}
+
+static void mc_switch(int next) {
+    if (next == mc.current) {
+        return;
+    }
+    const int prev = mc.current;
+    mc_become(next);
+    swapcontext(&mc.threads[prev].context, &mc.threads[next].context);
+}
+
+/* Runnable threads other than the current one that are not spinning, into `options`. */
+static int mc_fresh_others(int *options) {
+    int count = 0;
+    for (int i = 0; i < mc.test->threads; ++i) {
+        if (i != mc.current && mc.threads[i].state == MC_RUNNABLE && !mc.threads[i].stalled) {
+            options[count++] = i;
+        }
+    }
+    return count;
+}
+
+/* First runnable thread after `from`, round robin, -1 if none. */
+static int mc_next_runnable(int from) {
+    for (int i = 1; i <= mc.test->threads; ++i) {
+        const int next = (from + i) % mc.test->threads;
+        if (mc.threads[next].state == MC_RUNNABLE) {
+            return next;
+        }
+    }
+    return -1;
+}
+
+/* Called before every operation of a test thread: pick the thread whose operation comes next. A
+   running thread keeps the CPU unless a preemption is left in the budget, one that spins or yields
+   hands it over for free, to a thread that has not been spinning since the last store if possible. */
+static void mc_schedule(bool yielding) {
+    if (mc.current == MC_MAIN) {
+        return;
+    }
+    mc_thread_t *self = mc_self();
+    if (++mc.steps > MC_STEPS) {
+        mc_fail("livelock, still running after %d operations", MC_STEPS);
+    }
+    if (yielding || self->idle >= MC_SPIN_OPS) {
+        self->stalled = true;
+    }
+
+    int options[MC_THREADS];
+    if (!self->stalled) {
+        options[0] = mc.current;
+        const int count = 1 + (mc.preemptions < mc.max_preemptions ? mc_fresh_others(options + 1) : 0);
+        const uint pick = mc_choose((uint)count);
+        if (pick > 0) {
+            mc.preemptions += 1;
+        }
+        mc_switch(options[pick]);
+        return;
+    }
+
+    const int count = mc_fresh_others(options);
+    mc_switch(count > 0 ? options[mc_choose((uint)count)] : mc_next_runnable(mc.current));
+}
+
+static int64_t mc_now(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * MC_NS_PER_S + ts.tv_nsec;
+}
+
+/* A futex timeout as a CLOCK_MONOTONIC deadline: relative, or absolute on the clock `op` names. */
+static int64_t mc_deadline(const struct timespec *timeout, int op, bool relative) {
+    if (timeout == NULL) {
+        return MC_NO_DEADLINE;
+    }
+    const int64_t ns = (int64_t)timeout->tv_sec * MC_NS_PER_S + timeout->tv_nsec;
+    if (relative) {
+        return mc_now(CLOCK_MONOTONIC) + ns;
+    }
+    return (op & FUTEX_CLOCK_REALTIME) ? ns - mc_now(CLOCK_REALTIME) + mc_now(CLOCK_MONOTONIC) : ns;
+}
+
+/* Sleepers whose deadline comes soon (bounded polls, not the far `future` of the tests), into
+   `options`. Time only passes while nobody can run, so one of them times out then. */
+static int mc_timing_out(int *options) {
+    int count = 0;
+    for (int i = 0; i < mc.test->threads; ++i) {
+        const int64_t deadline = mc.threads[i].deadline;
+        if (mc.threads[i].state == MC_BLOCKED && deadline != MC_NO_DEADLINE && deadline - mc_now(CLOCK_MONOTONIC) < MC_HORIZON_NS) {
+            options[count++] = i;
+        }
+    }
+    return count;
+}
+
+/* The current thread sleeps or exited: run another one, or return to main once all exited. */
+static void mc_run_others(void) {
+    int options[MC_THREADS];
+    int count = mc_fresh_others(options);
+    int next = count > 0 ? options[mc_choose((uint)count)] : mc_next_runnable(mc.current);
+    if (next < 0 && (count = mc_timing_out(options)) > 0) {
+        next = options[mc_choose((uint)count)];
+        mc.threads[next].state = MC_RUNNABLE;
+        mc.threads[next].timed_out = true;
+        mc.threads[next].stalled = false;
+        mc.threads[next].idle = 0;
+        mc_trace("timeout", mc.threads[next].futex[0], (uint64_t)next, 0);
+    }
+    if (next >= 0) {
+        mc_switch(next);
+        return;
+    }
+
+    for (int i = 0; i < mc.test->threads; ++i) {
+        if (mc.threads[i].state == MC_BLOCKED) {
+            printf("%s: thread %d sleeps on ", mc.test->name, i);
+            mc_print_addr(mc.threads[i].futex[0]);
+            printf(" and nobody is left to wake it\n");
+            mc_fail("deadlock");
+        }
+    }
+    const int prev = mc.current;
+    mc_become(MC_MAIN);
+    swapcontext(&mc.threads[prev].context, &mc.main_context);
+}
+
+static void mc_read(mc_thread_t *self, mc_location_t *loc, uint32_t ts, memory_order order) {
+    const uint32_t index = mc_index(loc);
+    const mc_write_t *write = &loc->history[ts];
+    if (ts > self->view[index]) {
+        self->view[index] = ts;
+    }
+    mc_join(mc_acquires(order) ? self->view : self->acquired, write->view, write->view_size);
+    if (order == memory_order_seq_cst && ts > mc.sc[index]) {
+        mc.sc[index] = ts;
+    }
+}
+
+static void mc_fence_sc(mc_thread_t *self) {
+    mc_join(self->view, self->acquired, mc.location_count);
+    mc_join(mc.sc, self->view, mc.location_count);
+    mc_join(self->fenced, mc.sc, mc.location_count);
+    memcpy(self->released, self->view, sizeof(self->released));
+}
+
+uint64_t mc_load(const volatile void *obj, size_t size, int order) {
+    mc_schedule(false);
+    mc_thread_t *self = mc_self();
+    mc_location_t *loc = mc_location(obj, size);
+    const uint32_t index = mc_index(loc);
+
+    uint32_t oldest = self->view[index] > self->fenced[index] ? self->view[index] : self->fenced[index];
+    if (order == memory_order_seq_cst && mc.sc[index] > oldest) {
+        oldest = mc.sc[index];
+    }
+    uint32_t ts = loc->count - 1;
+    if (mc.current != MC_MAIN && ts > oldest && mc.stale_reads < mc.max_stale_reads) {
+        const uint32_t back = mc_choose((ts - oldest < MC_STALE_CHOICES ? ts - oldest : MC_STALE_CHOICES) + 1);
+        if (back > 0) {
+            mc.stale_reads += 1;
+            ts -= back;
+        }
+    }
+    mc_read(self, loc, ts, order);
+    mc_step(false);
+    mc_trace("load", obj, loc->history[ts].value, ts);
+    return loc->history[ts].value;
+}
+
+void mc_store(volatile void *obj, size_t size, uint64_t value, int order) {
+    mc_schedule(false);
+    mc_thread_t *self = mc_self();
+    mc_location_t *loc = mc_location(obj, size);
+    const uint32_t index = mc_index(loc);
+
+    value &= mc_mask(size);
+    const bool changed = mc_changes(loc, value);
+    const uint32_t ts = mc_append(loc, value, mc_releases(order) ? self->view : self->released, NULL);
+    self->view[index] = ts;
+    if (order == memory_order_seq_cst) {
+        mc.sc[index] = ts;
+    }
+    mc_step(changed);
+    mc_trace("store", obj, value, ts);
+}
+
+/* RMWs read the newest store and continue its release sequence. */
+static uint64_t mc_modify(mc_location_t *loc, uint64_t value, memory_order order) {
+    mc_thread_t *self = mc_self();
+    const uint32_t index = mc_index(loc);
+    const mc_write_t prev = loc->history[loc->count - 1];
+
+    value &= mc_mask(loc->size);
+    const bool changed = mc_changes(loc, value);
+    mc_read(self, loc, loc->count - 1, order);
+    const uint32_t ts = mc_append(loc, value, mc_releases(order) ? self->view : self->released, &prev);
+    self->view[index] = ts;
+    if (order == memory_order_seq_cst) {
+        mc.sc[index] = ts;
+    }
+    mc_step(changed);
+    mc_trace("rmw", loc->addr, value, ts);
+    return prev.value;
+}
+
+uint64_t mc_rmw(volatile void *obj, size_t size, int op, uint64_t operand, int order) {
+    mc_schedule(false);
+    mc_location_t *loc = mc_location(obj, size);
+    const uint64_t old = loc->history[loc->count - 1].value;
+    uint64_t value = operand;
+    switch (op) {
+    case MC_ADD:
+        value = old + operand;
+        break;
+    case MC_SUB:
+        value = old - operand;
+        break;
+    case MC_AND:
+        value = old & operand;
+        break;
+    case MC_OR:
+        value = old | operand;
+        break;
+    }
+    return mc_modify(loc, value, order);
+}
+
+bool mc_cas(volatile void *obj, size_t size, void *expected, uint64_t desired, int success, int failure) {
+    mc_schedule(false);
+    mc_location_t *loc = mc_location(obj, size);
+    const uint64_t curr = loc->history[loc->count - 1].value;
+    if (curr == mc_peek(expected, size)) {
+        mc_modify(loc, desired, success);
+        return true;
+    }
+
+    mc_read(mc_self(), loc, loc->count - 1, failure);
+    memcpy(expected, &curr, size);
+    mc_step(false);
+    mc_trace("failed cas", obj, curr, loc->count - 1);
+    return false;
+}
+
+void mc_init(volatile void *obj, size_t size, uint64_t value) {
+    mc_adopt(mc_location(obj, size), value & mc_mask(size));
+}
+
+void mc_fence(int order) {
+    mc_schedule(false);
+    mc_thread_t *self = mc_self();
+    if (order == memory_order_seq_cst) {
+        mc_fence_sc(self);
+    } else {
+        if (mc_acquires(order)) {
+            mc_join(self->view, self->acquired, mc.location_count);
+        }
+        if (mc_releases(order)) {
+            memcpy(self->released, self->view, sizeof(self->released));
+        }
+    }
+    mc_step(false);
+    mc_trace("fence", NULL, order, 0);
+}
+
+void mc_yield(void) {
+    mc_step(false);
+    mc_schedule(true);
+}
+
+/* Index of `addr` among the words `thread` sleeps on, -1 if it is not asleep on it. */
+static int mc_sleeps_on(const mc_thread_t *thread, const volatile void *addr) {
+    if (thread->state != MC_BLOCKED) {
+        return -1;
+    }
+    for (uint i = 0; i < thread->futexes; ++i) {
+        if (thread->futex[i] == addr) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/* Threads asleep on `addr`, in FUTEX_LOCK_PI or not, into `sleepers`. */
+static int mc_sleepers(const volatile void *addr, bool pi, int *sleepers) {
+    int n = 0;
+    for (int i = 0; i < mc.test->threads; ++i) {
+        if (mc_sleeps_on(&mc.threads[i], addr) >= 0 && mc.threads[i].pi == pi) {
+            sleepers[n++] = i;
+        }
+    }
+    return n;
+}
+
+/* Block the current thread on the words it noted until a wake or its deadline. */
+static long mc_sleep(int64_t deadline) {
+    mc_thread_t *self = mc_self();
+    if (deadline != MC_NO_DEADLINE && mc_now(CLOCK_MONOTONIC) >= deadline) {
+        self->pi = false;
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    self->state = MC_BLOCKED;
+    self->deadline = deadline;
+    self->timed_out = false;
+    mc_run_others();
+    self->pi = false;
+    if (self->timed_out) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+/* Make a sleeper runnable, it sees everything its waker did. */
+static void mc_wake_thread(int thread, const volatile void *addr) {
+    mc_thread_t *sleeper = &mc.threads[thread];
+    sleeper->woken_by = (uint)mc_sleeps_on(sleeper, addr);
+    sleeper->state = MC_RUNNABLE;
+    sleeper->stalled = false;
+    sleeper->idle = 0;
+    mc_join(sleeper->view, mc_self()->view, mc.location_count);
+}
+
+/* FUTEX_WAIT: the kernel compares against the newest store, as a full barrier would. */
+static long mc_futex_wait(const atomic_uint *addr, uint expected, int64_t deadline) {
+    mc_schedule(false);
+    mc_thread_t *self = mc_self();
+    mc_location_t *loc = mc_location(addr, sizeof(*addr));
+    mc_fence_sc(self);
+    mc_read(self, loc, loc->count - 1, memory_order_relaxed);
+    mc_step(false);
+    mc_trace("futex wait", addr, expected, loc->count - 1);
+
+    if (loc->history[loc->count - 1].value != expected) {
+        errno = EAGAIN;
+        return -1;
+    }
+    self->futex[0] = addr;
+    self->futexes = 1;
+    return mc_sleep(deadline);
+}
+
+/* futex_waitv: sleep on every word unless one no longer holds its value, returns the index of the
+   word whose wake ended the sleep. */
+static long mc_futex_waitv(const mc_futex_waitv_t *waiters, uint n) {
+    mc_schedule(false);
+    mc_thread_t *self = mc_self();
+    if (n > MC_WAITV) {
+        mc_fail("futex_waitv on more than %d words", MC_WAITV);
+    }
+    mc_fence_sc(self);
+    for (uint i = 0; i < n; ++i) {
+        const atomic_uint *addr = (const atomic_uint *)(uintptr_t)waiters[i].uaddr;
+        mc_location_t *loc = mc_location(addr, sizeof(*addr));
+        mc_read(self, loc, loc->count - 1, memory_order_relaxed);
+        if (loc->history[loc->count - 1].value != waiters[i].val) {
+            mc_step(false);
+            mc_trace("futex waitv changed", addr, waiters[i].val, loc->count - 1);
+            errno = EAGAIN;
+            return -1;
+        }
+        self->futex[i] = addr;
+    }
+    mc_step(false);
+    mc_trace("futex waitv", self->futex[0], n, 0);
+    self->futexes = n;
+    return mc_sleep(MC_NO_DEADLINE) == 0 ? (long)self->woken_by : -1;
+}
+
+/* Wake up to `count` of the plain sleepers on `addr`, the choice of which is explored. */
+static long mc_wake(const volatile void *addr, int count) {
+    int sleepers[MC_THREADS];
+    int n = mc_sleepers(addr, false, sleepers);
+    long woken = 0;
+    while (n > 0 && woken < count) {
+        const int pick = count - woken >= n ? 0 : (int)mc_choose((uint)n);
+        mc_wake_thread(sleepers[pick], addr);
+        sleepers[pick] = sleepers[--n];
+        woken += 1;
+    }
+    return woken;
+}
+
+static long mc_futex_wake(const atomic_uint *addr, int count) {
+    mc_schedule(false);
+    mc_fence_sc(mc_self());
+    const long woken = mc_wake(addr, count);
+    mc_step(false);
+    mc_trace("futex wake", addr, (uint64_t)woken, 0);
+    return woken;
+}
+
+/* FUTEX_CMP_REQUEUE: unless `from` no longer holds `expected`, wake up to `wake` of its sleepers
+   and move up to `requeue` of the others over to `to`. */
+static long mc_futex_requeue(const atomic_uint *from, int wake, int requeue, const atomic_uint *to, uint expected) {
+    mc_schedule(false);
+    mc_thread_t *self = mc_self();
+    mc_location_t *loc = mc_location(from, sizeof(*from));
+    mc_fence_sc(self);
+    mc_read(self, loc, loc->count - 1, memory_order_relaxed);
+    mc_step(false);
+    mc_trace("futex requeue", from, expected, loc->count - 1);
+    if (loc->history[loc->count - 1].value != expected) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    const long woken = mc_wake(from, wake);
+    int sleepers[MC_THREADS];
+    const int n = mc_sleepers(from, false, sleepers);
+    long moved = 0;
+    for (int i = 0; i < n && moved < requeue; ++i, ++moved) {
+        mc_thread_t *sleeper = &mc.threads[sleepers[i]];
+        sleeper->futex[mc_sleeps_on(sleeper, from)] = to;
+    }
+    return woken + moved;
+}
+
+/* FUTEX_LOCK_PI: take the word if it names no owner, otherwise flag it and sleep until the owner's
+   FUTEX_UNLOCK_PI hands it over. An owner that exited without unlocking is ESRCH. */
+static long mc_futex_lock_pi(const atomic_uint *addr, int64_t deadline) {
+    mc_schedule(false);
+    mc_thread_t *self = mc_self();
+    mc_location_t *loc = mc_location(addr, sizeof(*addr));
+    mc_fence_sc(self);
+    const uint word = (uint)loc->history[loc->count - 1].value, tid = MC_TID + (uint)mc.current;
+    const int owner = (int)(word & FUTEX_TID_MASK) - MC_TID;
+    int sleepers[MC_THREADS];
+    if ((word & FUTEX_TID_MASK) == 0) {
+        const bool waiters = mc_sleepers(addr, true, sleepers) > 0;
+        mc_modify(loc, tid | (word & FUTEX_OWNER_DIED) | (waiters ? FUTEX_WAITERS : 0), memory_order_acq_rel);
+        return 0;
+    }
+    if ((word & FUTEX_TID_MASK) == tid || (owner != MC_MAIN && (owner < 0 || owner >= mc.test->threads || mc.threads[owner].state == MC_DONE))) {
+        mc_read(self, loc, loc->count - 1, memory_order_relaxed);
+        mc_step(false);
+        mc_trace("futex lock pi failed", addr, word, loc->count - 1);
+        errno = (word & FUTEX_TID_MASK) == tid ? EDEADLK : ESRCH;
+        return -1;
+    }
+
+    if (!(word & FUTEX_WAITERS)) {
+        mc_modify(loc, word | FUTEX_WAITERS, memory_order_relaxed);
+    } else {
+        mc_read(self, loc, loc->count - 1, memory_order_relaxed);
+        mc_step(false);
+        mc_trace("futex lock pi", addr, word, loc->count - 1);
+    }
+    self->futex[0] = addr;
+    self->futexes = 1;
+    self->pi = true;
+    return mc_sleep(deadline);
+}
+
+/* FUTEX_UNLOCK_PI: hand the word to one of its sleepers, or clear it if there are none. */
+static long mc_futex_unlock_pi(const atomic_uint *addr) {
+    mc_schedule(false);
+    mc_thread_t *self = mc_self();
+    mc_location_t *loc = mc_location(addr, sizeof(*addr));
+    mc_fence_sc(self);
+    const uint word = (uint)loc->history[loc->count - 1].value;
+    if ((word & FUTEX_TID_MASK) != MC_TID + (uint)mc.current) {
+        mc_read(self, loc, loc->count - 1, memory_order_relaxed);
+        mc_step(false);
+        errno = EPERM;
+        return -1;
+    }
+
+    int sleepers[MC_THREADS];
+    const int n = mc_sleepers(addr, true, sleepers);
+    if (n == 0) {
+        mc_modify(loc, 0, memory_order_release);
+        return 0;
+    }
+    const int next = sleepers[mc_choose((uint)n)];
+    mc_modify(loc, (MC_TID + (uint)next) | (n > 1 ? FUTEX_WAITERS : 0), memory_order_release);
+    mc_wake_thread(next, addr);
+    return 0;
+}
+
+/* process_vm_readv of our own memory, which the code under test only uses to read another thread's rseq CPU. */
+static long mc_read_memory(const struct iovec *local, const struct iovec *remote) {
+    mc_schedule(false);
+    memcpy(local->iov_base, remote->iov_base, local->iov_len);
+    mc_step(false);
+    mc_trace("read memory", remote->iov_base, local->iov_len, 0);
+    return (long)local->iov_len;
+}
+
+long mc_syscall(long nr, ...) {
+    va_list args;
+    va_start(args, nr);
+    long result = -1;
+    if (nr == SYS_futex) {
+        const atomic_uint *addr = va_arg(args, const atomic_uint *);
+        const int op = va_arg(args, int);
+        const uint value = va_arg(args, uint);
+        switch (op & FUTEX_CMD_MASK) {
+        case FUTEX_WAIT:
+            result = mc_futex_wait(addr, value, mc_deadline(va_arg(args, const struct timespec *), op, true));
+            break;
+        case FUTEX_WAIT_BITSET:
+            result = mc_futex_wait(addr, value, mc_deadline(va_arg(args, const struct timespec *), op, false));
+            break;
+        case FUTEX_WAKE:
+            result = mc_futex_wake(addr, (int)value);
+            break;
+        case FUTEX_CMP_REQUEUE: {
+            const int requeue = va_arg(args, int);
+            const atomic_uint *to = va_arg(args, const atomic_uint *);
+            result = mc_futex_requeue(addr, (int)value, requeue, to, va_arg(args, uint));
+            break;
+        }
+        case FUTEX_LOCK_PI:
+        case FUTEX_LOCK_PI2:
+            // LOCK_PI times out on CLOCK_REALTIME, LOCK_PI2 on the clock the op names
+            result = mc_futex_lock_pi(addr, mc_deadline(va_arg(args, const struct timespec *), (op & FUTEX_CMD_MASK) == FUTEX_LOCK_PI ? FUTEX_CLOCK_REALTIME : op, false));
+            break;
+        case FUTEX_UNLOCK_PI:
+            result = mc_futex_unlock_pi(addr);
+            break;
+        default:
+            errno = ENOSYS;
+        }
+    } else if (nr == MC_SYS_FUTEX_WAITV) {
+        const mc_futex_waitv_t *waiters = va_arg(args, const mc_futex_waitv_t *);
+        result = mc_futex_waitv(waiters, va_arg(args, uint));
+    } else if (nr == SYS_process_vm_readv) {
+        (void)va_arg(args, pid_t);
+        const struct iovec *local = va_arg(args, const struct iovec *);
+        (void)va_arg(args, int);
+        result = mc_read_memory(local, va_arg(args, const struct iovec *));
+    } else if (nr == SYS_gettid) {
+        result = MC_TID + mc.current;
+    } else if (nr == SYS_sched_getaffinity) {
+        const pid_t pid = va_arg(args, pid_t);
+        const size_t size = va_arg(args, size_t);
+        void *mask = va_arg(args, void *);
+        result = syscall(nr, pid, size, mask);
+    } else {
+        errno = ENOSYS;
+    }
+    va_end(args);
+    return result;
+}
+
+/* Test threads exist until they return. Seeing one gone orders everything it did before. */
+int mc_kill(pid_t pid, int sig) {
+    (void)sig;
+    mc_assert(pid > 0, "kill() probes a TID, not a process group");
+    mc_schedule(false);
+    mc_step(false);
+    const int thread = (int)pid - MC_TID;
+    if (thread == MC_MAIN || (thread >= 0 && thread < mc.test->threads && mc.threads[thread].state != MC_DONE)) {
+        return 0;
+    }
+    if (thread >= 0 && thread < mc.test->threads) {
+        mc_join(mc_self()->view, mc.threads[thread].view, mc.location_count);
+    }
+    errno = ESRCH;
+    return -1;
+}
+
+/* Plain data the lock under test protects: a read must happen after the last write, a write after
+   the last write and every read since. Reads count as stores to a shadow word of their thread, so
+   releases and acquires carry them like any other store. */
+static atomic_uint mc_cell;
+static atomic_uint mc_shadow[MC_THREADS];
+static int mc_readers, mc_writers;
+
+int mc_thread(void) {
+    return mc.current;
+}
+
+unsigned mc_data(void) {
+    return (unsigned)mc_peek(&mc_cell, sizeof(mc_cell));
+}
+
+void mc_read_data(void) {
+    mc_schedule(false);
+    mc_thread_t *self = mc_self();
+    mc_location_t *cell = mc_location(&mc_cell, sizeof(mc_cell));
+    if (self->view[mc_index(cell)] != cell->count - 1) {
+        mc_fail("data race, read does not happen after the write of thread %d", cell->history[cell->count - 1].thread);
+    }
+    mc_location_t *shadow = mc_location(&mc_shadow[mc.current], sizeof(mc_shadow[0]));
+    self->view[mc_index(shadow)] = mc_append(shadow, shadow->history[shadow->count - 1].value + 1, self->released, NULL);
+    mc_trace("read data", &mc_cell, cell->history[cell->count - 1].value, cell->count - 1);
+}
+
+void mc_write_data(void) {
+    mc_schedule(false);
+    mc_thread_t *self = mc_self();
+    mc_location_t *cell = mc_location(&mc_cell, sizeof(mc_cell));
+    if (self->view[mc_index(cell)] != cell->count - 1) {
+        mc_fail("data race, write does not happen after the write of thread %d", cell->history[cell->count - 1].thread);
+    }
+    for (int i = 0; i < mc.test->threads; ++i) {
+        mc_location_t *shadow = mc_location(&mc_shadow[i], sizeof(mc_shadow[0]));
+        if (i != mc.current && self->view[mc_index(shadow)] != shadow->count - 1) {
+            mc_fail("data race, write does not happen after the read of thread %d", i);
+        }
+    }
+    const uint64_t value = cell->history[cell->count - 1].value + 1;
+    self->view[mc_index(cell)] = mc_append(cell, value, self->released, NULL);
+    mc_trace("write data", &mc_cell, value, cell->count - 1);
+}
+
+void mc_enter(mc_mode_t mode) {
+    if (mc_writers > 0 || (mode == MC_EXCLUSIVE && mc_readers > 0)) {
+        mc_fail("mutual exclusion violated, %s entry with %d writers and %d readers inside",
+                mode == MC_EXCLUSIVE ? "exclusive" : "shared", mc_writers, mc_readers);
+    }
+    *(mode == MC_EXCLUSIVE ? &mc_writers : &mc_readers) += 1;
+}
+
+void mc_leave(mc_mode_t mode) {
+    *(mode == MC_EXCLUSIVE ? &mc_writers : &mc_readers) -= 1;
+}
+
+static void mc_thread_entry(void) {
+    const int id = mc.current;
+    mc.test->thread(id);
+    mc.threads[id].state = MC_DONE;
+    mc_trace("exit", NULL, 0, 0);
+    mc_progress(); // waiters of a dead robust owner can take over now
+    mc_run_others();
+}
+
+static void mc_execute(void) {
+    mc.depth = 0;
+    mc.preemptions = 0;
+    mc.stale_reads = 0;
+    mc.steps = 0;
+    mc.events = 0;
+    mc.location_count = 0;
+    mc.arena_used = 0;
+    memset(mc.sc, 0, sizeof(mc.sc));
+    mc_readers = 0;
+    mc_writers = 0;
+
+    mc_thread_t *main = &mc.threads[MC_MAIN];
+    memset(main->view, 0, sizeof(main->view));
+    memset(main->acquired, 0, sizeof(main->acquired));
+    memset(main->released, 0, sizeof(main->released));
+    memset(main->fenced, 0, sizeof(main->fenced));
+#ifdef MC_RSEQ
+    main->rseq.cpu_id_start = main->rseq.cpu_id = 0;
+#endif
+    memset(main->tls, 0, sizeof(main->tls));
+    mc.current = MC_MAIN;
+    mc_swap_tls(MC_MAIN, false);
+    mc_init(&mc_cell, sizeof(mc_cell), 0);
+    for (int i = 0; i < MC_THREADS; ++i) {
+        mc_init(&mc_shadow[i], sizeof(mc_shadow[i]), 0);
+    }
+    mc.test->setup();
+
+    // Threads start after everything setup did.
+    for (int i = 0; i < mc.test->threads; ++i) {
+        mc_thread_t *thread = &mc.threads[i];
+        thread->state = MC_RUNNABLE;
+        thread->futexes = 0;
+        thread->pi = false;
+        thread->deadline = MC_NO_DEADLINE;
+        thread->timed_out = false;
+        thread->stalled = false;
+        thread->idle = 0;
+        memcpy(thread->view, main->view, sizeof(thread->view));
+        memset(thread->acquired, 0, sizeof(thread->acquired));
+        memcpy(thread->released, main->view, sizeof(thread->released));
+        memcpy(thread->fenced, main->fenced, sizeof(thread->fenced));
+#ifdef MC_RSEQ
+        thread->rseq.cpu_id_start = thread->rseq.cpu_id = (uint32_t)i % mc.test->cpus;
+#endif
+        memset(thread->tls, 0, sizeof(thread->tls));
+        getcontext(&thread->context);
+        thread->context.uc_stack.ss_sp = mc.stacks[i];
+        thread->context.uc_stack.ss_size = MC_STACK_SIZE;
+        thread->context.uc_link = NULL;
+        makecontext(&thread->context, mc_thread_entry, 0);
+    }
+
+    const int first = (int)mc_choose((uint)mc.test->threads);
+    mc_become(first);
+    swapcontext(&mc.main_context, &mc.threads[first].context);
+
+    // Back once every thread exited, which happens before the checks.
+    for (int i = 0; i < mc.test->threads; ++i) {
+        mc_join(main->view, mc.threads[i].view, mc.location_count);
+    }
+    mc.test->check();
+}
+
+static int mc_explore(const mc_test_t *test) {
+    mc.test = test;
+    if (mc.start != NULL) {
+        mc.start(test);
+    }
+    mc_label(&mc_cell, "data");
+    for (int i = 0; i < MC_THREADS; ++i) {
+        mc.stacks[i] = malloc(MC_STACK_SIZE);
+        mc_assert(mc.stacks[i] != NULL, "out of memory");
+    }
+
+    size_t choices = 0;
+    do {
+        mc_execute();
+        mc.executions += 1;
+        choices = mc.depth > choices ? mc.depth : choices;
+    } while (mc_backtrack());
+
+    printf("%s: %llu executions (up to %zu choices, %u preemptions, %u stale reads), ok\n", test->name, mc.executions, choices,
+           mc.max_preemptions, mc.max_stale_reads);
+    return 0;
+}
+
+static uint env_uint(const char *name, uint fallback) {
+    const char *value = getenv(name);
+    return value != NULL ? (uint)strtoul(value, NULL, 10) : fallback;
+}
+
+int mc_main(const mc_test_t *tests, size_t count, int argc, char **argv, void (*start)(const mc_test_t *test)) {
+    mc.max_preemptions = env_uint("MC_PREEMPTIONS", 2);
+    mc.max_stale_reads = env_uint("MC_STALE_READS", 1);
+    mc.start = start;
+
+    // The process runs on one CPU, tests choose how many its threads see.
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(sched_getcpu(), &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+        perror("sched_setaffinity");
+        return 1;
+    }
+    mc.current = MC_MAIN;
+    mc.arena = malloc(MC_ARENA * sizeof(*mc.arena));
+    if (mc.arena == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    int failed = 0, ran = 0;
+    for (size_t i = 0; i < count; ++i) {
+        bool selected = argc < 2;
+        for (int arg = 1; arg < argc; ++arg) {
+            selected |= strcmp(argv[arg], tests[i].name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+
+        ran += 1;
+        fflush(stdout);
+        const pid_t child = fork();
+        if (child == 0) {
+            exit(mc_explore(&tests[i]));
+        }
+        int status = 0;
+        waitpid(child, &status, 0);
+        const bool violation = WIFEXITED(status) && WEXITSTATUS(status) == 1;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) > 1) {
+            printf("%s: crashed\n", tests[i].name);
+            failed += 1;
+        } else if (violation != tests[i].violation_expected) {
+            printf("%s: %s\n", tests[i].name, violation ? "FAILED" : "FAILED, the canary was not caught");
+            failed += 1;
+        } else if (violation) {
+            printf("%s: caught, as expected\n", tests[i].name);
+        }
+    }
+    if (ran == 0) {
+        fprintf(stderr, "usage: %s [test...], no such test\n", argv[0]);
+        return 1;
+    }
+    return failed != 0;
+}
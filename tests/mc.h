@@ -0,0 +1,83 @@
+/* Stateless model checker, the engine behind tests/smtx-mc.c and tests/smtx-mc.cpp. Every atomic
+   operation of the code under test goes through the hooks below, which run the test threads as
+   coroutines on one OS thread and explore their interleavings depth first, up to a bound on
+   preemptions. Memory follows a view-based approximation of the C11 model: a load may return a
+   store older than the newest one unless its thread synchronised past it (release/acquire, release
+   sequences, fences, seq_cst order), up to a bound on such stale reads per execution. Futex calls
+   (wait, wake, requeue, waitv and the PI operations) sleep and wake the coroutines, so a lost
+   wake-up shows up as a deadlock, and kill() knows which test threads have exited, so robust locks
+   recover from them.
+
+   Orders are the __ATOMIC_* values, which C's memory_order and C++'s std::memory_order both take
+   on GCC and Clang. Front ends route their language's atomics here and hand mc_main their tests. */
+#ifndef MC_H
+#define MC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MC_THREADS 3
+#define MC_TID 1000     // TID of test thread 0, the others follow
+#define MC_DEAD_TID 999 // never a test thread, kill() reports it gone
+
+enum { MC_ADD, MC_SUB, MC_AND, MC_OR, MC_XCHG };
+
+typedef enum { MC_SHARED, MC_EXCLUSIVE } mc_mode_t;
+
+typedef struct {
+    const char *name;
+    int threads;
+    void (*setup)(void);
+    void (*thread)(int id);
+    void (*check)(void);
+    unsigned cpus;           // thread i runs on CPU i % cpus, waiters spin with more than one
+    bool violation_expected; // a canary of the checker itself
+} mc_test_t;
+
+uint64_t mc_load(const volatile void *obj, size_t size, int order);
+void mc_store(volatile void *obj, size_t size, uint64_t value, int order);
+uint64_t mc_rmw(volatile void *obj, size_t size, int op, uint64_t operand, int order);
+bool mc_cas(volatile void *obj, size_t size, void *expected, uint64_t desired, int success, int failure);
+void mc_init(volatile void *obj, size_t size, uint64_t value);
+void mc_fence(int order);
+void mc_yield(void);
+void mc_assert(bool ok, const char *expr);
+long mc_syscall(long nr, ...);
+int mc_kill(pid_t pid, int sig);
+void *mc_thread_pointer(void);
+
+/* Thread-local state of the code under test, swapped in while each test thread runs and zeroed
+   when it starts. Stores to a quiet word are not progress, spinners keep spinning past them. */
+void mc_thread_local(void *addr, size_t size);
+void mc_quiet(const volatile void *addr);
+void mc_label(const volatile void *addr, const char *name);
+
+/* The running test thread, and the plain data the lock under test protects: a read must happen
+   after the last write, a write after the last write and every read since. mc_enter and mc_leave
+   bracket each hold for the check of mutual exclusion. */
+int mc_thread(void);
+unsigned mc_data(void);
+void mc_read_data(void);
+void mc_write_data(void);
+void mc_enter(mc_mode_t mode);
+void mc_leave(mc_mode_t mode);
+
+/* Runs the tests named on the command line (all by default), each in a process of its own, calling
+   `start` (if any) in that process first. MC_PREEMPTIONS and MC_STALE_READS in the environment raise
+   the bounds (default 2 and 1). Returns the exit status. */
+int mc_main(const mc_test_t *tests, size_t count, int argc, char **argv, void (*start)(const mc_test_t *test));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MC_H
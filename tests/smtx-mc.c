@@ -0,0 +1,792 @@
+/* Model checker front end for smtx.h, the engine is tests/mc.c. Every atomic operation of the
+   implementation goes through the engine's hooks, futex calls and kill() included, so a lost
+   wake-up shows up as a deadlock and robust locks recover from test threads that exited. Each
+   thread has its own rseq area and CPU: tests on one CPU never spin, those on more spin like
+   waiters on a multicore.
+
+   smtx-mc [test...] runs the named tests (all by default), each in a process of its own.
+   MC_PREEMPTIONS and MC_STALE_READS in the environment raise the bounds (default 2 and 1). */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mc.h"
+
+/* A hook's result as the value type of the atomic object, _Atomic dropped by the lvalue
+   conversion. A statement expression, as the results of RMWs are often ignored. */
+#define MC_AS(obj, result) __extension__({ (__typeof__(((void)0, *(obj))))(result); })
+
+#undef atomic_init
+#undef atomic_load_explicit
+#undef atomic_store_explicit
+#undef atomic_exchange_explicit
+#undef atomic_compare_exchange_strong_explicit
+#undef atomic_compare_exchange_weak_explicit
+#undef atomic_fetch_add_explicit
+#undef atomic_fetch_sub_explicit
+#undef atomic_fetch_and_explicit
+#undef atomic_fetch_or_explicit
+#undef atomic_flag_test_and_set_explicit
+#undef atomic_flag_clear_explicit
+#undef atomic_thread_fence
+#define atomic_init(obj, value) mc_init((obj), sizeof(*(obj)), (uint64_t)(uintptr_t)(value))
+#define atomic_load_explicit(obj, order) MC_AS(obj, mc_load((obj), sizeof(*(obj)), (order)))
+#define atomic_store_explicit(obj, value, order) mc_store((obj), sizeof(*(obj)), (uint64_t)(uintptr_t)(value), (order))
+#define atomic_exchange_explicit(obj, value, order) MC_AS(obj, mc_rmw((obj), sizeof(*(obj)), MC_XCHG, (uint64_t)(uintptr_t)(value), (order)))
+#define atomic_compare_exchange_strong_explicit(obj, expected, desired, success, failure) \
+    mc_cas((obj), sizeof(*(obj)), (expected), (uint64_t)(uintptr_t)(desired), (success), (failure))
+#define atomic_compare_exchange_weak_explicit atomic_compare_exchange_strong_explicit
+#define atomic_fetch_add_explicit(obj, operand, order) MC_AS(obj, mc_rmw((obj), sizeof(*(obj)), MC_ADD, (uint64_t)(operand), (order)))
+#define atomic_fetch_sub_explicit(obj, operand, order) MC_AS(obj, mc_rmw((obj), sizeof(*(obj)), MC_SUB, (uint64_t)(operand), (order)))
+#define atomic_fetch_and_explicit(obj, operand, order) MC_AS(obj, mc_rmw((obj), sizeof(*(obj)), MC_AND, (uint64_t)(operand), (order)))
+#define atomic_fetch_or_explicit(obj, operand, order) MC_AS(obj, mc_rmw((obj), sizeof(*(obj)), MC_OR, (uint64_t)(operand), (order)))
+#define atomic_flag_test_and_set_explicit(obj, order) MC_AS(&(bool){0}, mc_rmw((obj), sizeof(*(obj)), MC_XCHG, 1, (order)))
+#define atomic_flag_clear_explicit(obj, order) mc_store((obj), sizeof(*(obj)), 0, (order))
+#define atomic_thread_fence(order) mc_fence(order)
+
+// Same layout as examples/smtx.c. Robust waiters look for a dead writer after a few rounds.
+#define SMTX_CACHE_LINE_SIZE CACHE_LINE_SIZE
+#define SMTX_PREVENT_FALSE_SHARING
+#define SMTX_IMPLEMENTATION
+#define SMTX_ASSERT(expr) mc_assert((expr), #expr)
+#define SMTX_YIELD mc_yield()
+#define SMTX_MAX_WRITER_WAIT_SPINS 4
+#define SMTX_MAX_READER_WAIT_SPINS 4
+#define syscall mc_syscall
+#define kill mc_kill
+#define __builtin_thread_pointer() mc_thread_pointer()
+#include "../smtx.h"
+#undef syscall
+#undef kill
+#undef __builtin_thread_pointer
+
+
+static smtx_t lock;
+static smtx_attr_t attr; // filled in by the setup
+static smtx_cond_t cond;
+static int results[MC_THREADS];
+static const struct timespec past = {0, 0};
+static const struct timespec future = {1l << 30, 0}; // decades of uptime away
+
+/* Initialise the lock from `attr` as the test's setup filled it in. */
+static void start_lock(void) {
+    smtx_destroy(&lock); // the extension the previous execution allocated
+    mc_assert(smtx_init_attr(&lock, &attr) == thrd_success, "smtx_init_attr");
+    mc_label(&lock.writer_locked, "writer_locked");
+    mc_label(&lock.reader_count, "reader_count");
+    mc_label(&lock.owner, "owner");
+    mc_label(&lock.waiting, "waiting");
+    mc_label(&lock.ext, "ext");
+    smtx_ext_t *ext = atomic_load_explicit(&lock.ext, memory_order_relaxed);
+    if (ext != NULL) {
+        mc_label(&ext->deadline_queue, "deadline_queue");
+        mc_label(&ext->deadline_lock, "deadline_lock");
+        mc_label(&ext->writer.cpu, "writer cpu");
+        mc_label(&ext->writer.rseq, "writer rseq");
+        mc_label(&ext->reader.cpu, "reader cpu");
+        mc_label(&ext->reader.rseq, "reader rseq");
+    }
+    atomic_init(&smtx_governor.spinning, 0); // waits hold their slot across rounds
+    mc_label(&smtx_governor.spinning, "governor spinning");
+    mc_label(&smtx_governor.cpus, "governor cpus");
+    mc_label(&smtx_governor.shift, "governor shift");
+    for (int i = 0; i < MC_THREADS; ++i) {
+        results[i] = -1;
+    }
+}
+
+static void init_lock(unsigned flags, smtx_fairness_t fairness) {
+    smtx_attr_init(&attr);
+    attr.flags = flags;
+    attr.fairness = fairness;
+    start_lock();
+}
+
+static void read_locked(void) {
+    mc_enter(MC_SHARED);
+    mc_read_data();
+    mc_leave(MC_SHARED);
+}
+
+static void write_locked(void) {
+    mc_enter(MC_EXCLUSIVE);
+    mc_write_data();
+    mc_leave(MC_EXCLUSIVE);
+}
+
+static void check_released(void) {
+    mc_assert(atomic_load_explicit(&lock.writer_locked, memory_order_relaxed) == 0, "writer word released");
+    mc_assert(reader_count_of(atomic_load_explicit(&lock.reader_count, memory_order_relaxed)) == 0, "readers departed");
+    smtx_ext_t *ext = atomic_load_explicit(&lock.ext, memory_order_relaxed);
+    mc_assert(ext == NULL || atomic_load_explicit(&ext->deadline_queue, memory_order_relaxed) == NULL, "deadline queue empty");
+    mc_assert(atomic_load_explicit(&smtx_governor.spinning, memory_order_relaxed) == 0, "governor slots returned");
+}
+
+static void setup_writers(void) {
+    init_lock(0, SMTX_PREFER_WRITERS);
+}
+
+static void setup_readers(void) {
+    init_lock(0, SMTX_PREFER_READERS);
+}
+
+static void setup_deadline(void) {
+    init_lock(0, SMTX_EARLIEST_DEADLINE);
+    // Neither may bypass the queue.
+    mc_assert(smtx_lock_shared_n(&lock, 2) == thrd_error, "smtx_lock_shared_n rejected");
+    mc_assert(smtx_begin_exclusive(&lock) == thrd_error, "smtx_begin_exclusive rejected");
+}
+
+static void setup_robust(void) {
+    init_lock(SMTX_FLAG_ROBUST, SMTX_PREFER_WRITERS);
+}
+
+static void setup_dead_owner(void) {
+    setup_robust();
+    atomic_store_explicit(&lock.writer_locked, MC_DEAD_TID, memory_order_relaxed);
+}
+
+/* Thread 1 writes, the others read. */
+static void shared_exclusive(int id) {
+    if (id == 1) {
+        mc_assert(smtx_lock_exclusive(&lock) == thrd_success, "smtx_lock_exclusive");
+        write_locked();
+        smtx_unlock_exclusive(&lock);
+    } else {
+        mc_assert(smtx_lock_shared(&lock) == thrd_success, "smtx_lock_shared");
+        read_locked();
+        smtx_unlock_shared(&lock);
+    }
+}
+
+static void exclusive(int id) {
+    (void)id;
+    mc_assert(smtx_lock_exclusive(&lock) == thrd_success, "smtx_lock_exclusive");
+    write_locked();
+    smtx_unlock_exclusive(&lock);
+}
+
+/* Thread 0 takes the writer word first and waits for the readers separately. */
+static void two_phase(int id) {
+    if (id == 0) {
+        mc_assert(smtx_begin_exclusive(&lock) == thrd_success, "smtx_begin_exclusive");
+        mc_assert(smtx_finish_exclusive(&lock) == thrd_success, "smtx_finish_exclusive");
+        write_locked();
+        smtx_unlock_exclusive(&lock);
+    } else {
+        shared_exclusive(0);
+    }
+}
+
+static void try_locks(int id) {
+    if (id == 0) {
+        exclusive(id);
+    } else if (id == 1) {
+        if (smtx_trylock_shared(&lock) == thrd_success) {
+            read_locked();
+            smtx_unlock_shared(&lock);
+        }
+    } else if (smtx_trylock_exclusive(&lock) == thrd_success) {
+        write_locked();
+        smtx_unlock_exclusive(&lock);
+    }
+}
+
+/* Deadlines are either far ahead or already passed, so that time never decides a run. */
+static void timed(int id) {
+    if (id == 0) {
+        mc_assert(smtx_timedlock_exclusive(&lock, &future) == thrd_success, "smtx_timedlock_exclusive");
+        write_locked();
+        smtx_unlock_exclusive(&lock);
+    } else if (id == 1) {
+        const int result = smtx_timedlock_exclusive(&lock, &past);
+        mc_assert(result == thrd_success || result == thrd_timedout, "smtx_timedlock_exclusive");
+        if (result == thrd_success) {
+            write_locked();
+            smtx_unlock_exclusive(&lock);
+        }
+    } else {
+        const int result = smtx_timedlock_shared(&lock, &past);
+        mc_assert(result == thrd_success || result == thrd_timedout, "smtx_timedlock_shared");
+        if (result == thrd_success) {
+            read_locked();
+            smtx_unlock_shared(&lock);
+        }
+    }
+}
+
+/* The writer word names a thread that is gone: one of the two takes its hold over. */
+static void dead_owner(int id) {
+    const smtx_mode_t mode = id == 0 ? SMTX_MODE_EXCLUSIVE : SMTX_MODE_SHARED;
+    results[id] = mode == SMTX_MODE_EXCLUSIVE ? smtx_lock_exclusive(&lock) : smtx_lock_shared(&lock);
+    if (results[id] == SMTX_OWNERDEAD) {
+        write_locked();
+        smtx_unlock_exclusive(&lock);
+    } else {
+        mc_assert(results[id] == thrd_success, "locked");
+        if (mode == SMTX_MODE_EXCLUSIVE) {
+            write_locked();
+            smtx_unlock_exclusive(&lock);
+        } else {
+            read_locked();
+            smtx_unlock_shared(&lock);
+        }
+    }
+}
+
+static void check_dead_owner(void) {
+    mc_assert((results[0] == SMTX_OWNERDEAD) + (results[1] == SMTX_OWNERDEAD) == 1, "exactly one takes the dead owner's hold over");
+    check_released();
+}
+
+/* Thread 0 exits holding the lock. */
+static void owner_exits(int id) {
+    if (id == 0) {
+        mc_assert(smtx_lock_exclusive(&lock) == thrd_success, "smtx_lock_exclusive");
+        mc_enter(MC_EXCLUSIVE);
+        mc_write_data();
+        return;
+    }
+
+    results[id] = smtx_lock_exclusive(&lock);
+    if (results[id] == SMTX_OWNERDEAD) {
+        mc_leave(MC_EXCLUSIVE); // abandoned by thread 0
+    } else {
+        mc_assert(results[id] == thrd_success, "smtx_lock_exclusive");
+    }
+    write_locked();
+    smtx_unlock_exclusive(&lock);
+}
+
+static void check_owner_exits(void) {
+    if (results[1] == SMTX_OWNERDEAD) {
+        check_released();
+    } else {
+        mc_assert(atomic_load_explicit(&lock.writer_locked, memory_order_relaxed) == MC_TID, "held by the thread that exited");
+    }
+}
+
+/* Thread 0 exits holding the lock while thread 1 waits on a condition, whose wait has to report
+   the hold it takes over rather than its timeout. */
+static void setup_robust_cond(void) {
+    setup_robust();
+    smtx_cond_init(&cond);
+    mc_label(&cond.seq, "cond seq");
+    mc_label(&cond.waiters, "cond waiters");
+}
+
+static void cond_owner_exits(int id) {
+    if (id == 0) {
+        owner_exits(id);
+        return;
+    }
+
+    results[id] = smtx_lock_shared(&lock);
+    if (results[id] == thrd_success) {
+        read_locked();
+        results[id] = smtx_cond_timedwait(&cond, &lock, SMTX_MODE_SHARED, &past);
+    }
+    if (results[id] == SMTX_OWNERDEAD) {
+        mc_leave(MC_EXCLUSIVE); // abandoned by thread 0
+        write_locked();
+        smtx_unlock_exclusive(&lock);
+    } else {
+        mc_assert(results[id] == thrd_timedout, "smtx_cond_timedwait");
+        read_locked();
+        smtx_unlock_shared(&lock);
+    }
+}
+
+static void deadline(int id) {
+    if (id == 0) {
+        exclusive(id);
+    } else if (id == 1) {
+        mc_assert(smtx_timedlock_exclusive(&lock, &future) == thrd_success, "smtx_timedlock_exclusive");
+        write_locked();
+        smtx_unlock_exclusive(&lock);
+    } else {
+        shared_exclusive(0);
+    }
+}
+
+/* A queued waiter whose deadline passed leaves the queue, the others still get their turn. */
+static void deadline_timeout(int id) {
+    if (id == 1) {
+        const int result = smtx_timedlock_shared(&lock, &past);
+        mc_assert(result == thrd_success || result == thrd_timedout, "smtx_timedlock_shared");
+        if (result == thrd_success) {
+            read_locked();
+            smtx_unlock_shared(&lock);
+        }
+    } else {
+        deadline(id);
+    }
+}
+
+/* Writer 1 spins on a CPU of its own while reader 0 and writer 2 share one. On that CPU a holder
+   seen there is preempted by the waiter, which parks instead of spinning. */
+static void setup_preempt_aware(void) {
+    init_lock(SMTX_FLAG_PREEMPT_AWARE, SMTX_PREFER_WRITERS);
+}
+
+static void reader_writers(int id) {
+    if (id == 0) {
+        shared_exclusive(id);
+    } else {
+        exclusive(id);
+    }
+}
+
+/* Readers arrive through an SNZI tree. Its leaf is picked once per OS thread, so the test threads
+   all arrive at the same one and race on its half-way state and on the walk up to reader_count. */
+static smtx_snzi_t snzi;
+static smtx_snzi_node_t snzi_nodes[3];
+
+static void setup_snzi(void) {
+    setup_writers();
+    smtx_snzi_init(&snzi, snzi_nodes, sizeof(snzi_nodes) / sizeof(snzi_nodes[0]));
+    mc_assert(smtx_use_snzi(&lock, &snzi) == thrd_success, "smtx_use_snzi");
+    mc_label(&snzi_nodes[0].word, "snzi node 0");
+    mc_label(&snzi_nodes[1].word, "snzi node 1");
+    mc_label(&snzi_nodes[2].word, "snzi node 2");
+}
+
+static void check_snzi(void) {
+    check_released();
+    for (size_t i = 0; i < sizeof(snzi_nodes) / sizeof(snzi_nodes[0]); ++i) {
+        mc_assert(snzi_surplus(atomic_load_explicit(&snzi_nodes[i].word, memory_order_relaxed)) == 0, "snzi nodes empty");
+    }
+}
+
+/* Waiters go to the kernel after one spin: writers sleep in FUTEX_LOCK_PI, a writer draining the
+   readers on reader_count. */
+static void setup_pi(void) {
+    smtx_attr_init(&attr);
+    attr.flags = SMTX_FLAG_PI;
+    attr.yield_threshold = 1;
+    start_lock();
+}
+
+/* A waiter that parks goes through the lock's wait strategy, here the futex one. */
+static void setup_wait_strategy(void) {
+    smtx_attr_init(&attr);
+    attr.wait = &smtx_wait_spin_futex;
+    start_lock();
+}
+
+/* Two writer phases an hour, two back to back: both writers of `timed` are admitted at once, the
+   one that times out on the lock hands its token back. */
+static smtx_admission_t admission;
+
+static void setup_admission(void) {
+    smtx_attr_init(&attr);
+    smtx_admission_init(&admission, 3600ull * SMTX_NS_PER_S, 2, 0);
+    attr.admission = &admission;
+    start_lock();
+    mc_label(&admission.due, "admission due");
+    mc_label(&admission.released, "admission released");
+}
+
+/* A read window longer than any uptime: a writer hands every writer word it takes back to the
+   readers and times out waiting for the window. */
+static void setup_read_window(void) {
+    smtx_attr_init(&attr);
+    smtx_admission_init(&admission, 0, 1, 1ull << 62);
+    attr.admission = &admission;
+    start_lock();
+    mc_label(&admission.released, "admission released");
+}
+
+static void read_window(int id) {
+    if (id == 0) {
+        mc_assert(smtx_timedlock_exclusive(&lock, &past) == thrd_timedout, "smtx_timedlock_exclusive");
+    } else {
+        shared_exclusive(0);
+    }
+}
+
+/* Threads 0 and 1 publish their writes on the lock, whoever holds it next runs both. */
+static void combined_write(void *arg) {
+    (void)arg;
+    write_locked();
+}
+
+static void combine(int id) {
+    if (id == 2) {
+        shared_exclusive(0);
+    } else {
+        mc_assert(smtx_combine_exclusive(&lock, combined_write, NULL) == thrd_success, "smtx_combine_exclusive");
+    }
+}
+
+/* Thread 0 takes two references at once and hands one to thread 1, which releases it. */
+static atomic_uint handed_over;
+
+static void setup_shared_n(void) {
+    setup_writers();
+    atomic_init(&handed_over, 0);
+    mc_label(&handed_over, "handed over");
+}
+
+static void shared_n(int id) {
+    if (id == 0) {
+        mc_assert(smtx_lock_shared_n(&lock, 2) == thrd_success, "smtx_lock_shared_n");
+        mc_enter(MC_SHARED); // thread 1's reference
+        read_locked();
+        smtx_unlock_shared(&lock);
+        atomic_store_explicit(&handed_over, 1, memory_order_release);
+        futex_wake(&handed_over, 1, 0);
+    } else if (id == 1) {
+        while (atomic_load_explicit(&handed_over, memory_order_acquire) == 0) {
+            futex_wait(&handed_over, 0, NULL, 0);
+        }
+        mc_read_data();
+        mc_leave(MC_SHARED);
+        smtx_unlock_shared(&lock);
+    } else {
+        exclusive(id);
+    }
+}
+
+/* Thread 0 takes the writer word and has the last reader to leave call it back rather than wait
+   for the drain itself. */
+static atomic_uint drained;
+
+static void setup_drained(void) {
+    setup_writers();
+    atomic_init(&drained, 0);
+    mc_label(&drained, "drained");
+}
+
+static void signal_drained(void *arg) {
+    atomic_store_explicit((atomic_uint *)arg, 1, memory_order_release);
+    futex_wake(arg, 1, 0);
+}
+
+static void notify_drained(int id) {
+    if (id != 0) {
+        shared_exclusive(0);
+        return;
+    }
+
+    mc_assert(smtx_begin_exclusive(&lock) == thrd_success, "smtx_begin_exclusive");
+    const int result = smtx_notify_drained(&lock, signal_drained, &drained);
+    mc_assert(result == thrd_success || result == thrd_busy, "smtx_notify_drained");
+    while (result == thrd_busy && atomic_load_explicit(&drained, memory_order_acquire) == 0) {
+        futex_wait(&drained, 0, NULL, 0);
+    }
+    mc_assert(smtx_finish_exclusive(&lock) == thrd_success, "smtx_finish_exclusive");
+    write_locked();
+    smtx_unlock_exclusive(&lock);
+}
+
+/* Threads 0 (shared) and 1 (exclusive) help while they wait: their first task reads under the same
+   lock, which blocks rather than helps again, the next one finds nothing to do. */
+static int helps[MC_THREADS];
+
+static void setup_lock_or_run(void) {
+    setup_writers();
+    memset(helps, 0, sizeof(helps));
+}
+
+static int help(void *ctx) {
+    (void)ctx;
+    if (helps[mc_thread()]++ > 0) {
+        return 0;
+    }
+    mc_assert(smtx_lock_or_run(&lock, SMTX_MODE_SHARED, help, NULL) == thrd_success, "nested smtx_lock_or_run");
+    read_locked();
+    smtx_unlock_shared(&lock);
+    return 1;
+}
+
+static void lock_or_run(int id) {
+    if (id == 2) {
+        exclusive(id);
+        return;
+    }
+
+    const smtx_mode_t mode = id == 0 ? SMTX_MODE_SHARED : SMTX_MODE_EXCLUSIVE;
+    mc_assert(smtx_lock_or_run(&lock, mode, help, NULL) == thrd_success, "smtx_lock_or_run");
+    if (mode == SMTX_MODE_EXCLUSIVE) {
+        write_locked();
+        smtx_unlock_exclusive(&lock);
+    } else {
+        read_locked();
+        smtx_unlock_shared(&lock);
+    }
+}
+
+/* Thread 2 broadcasts while holding the lock, so threads 0 (shared) and 1 (exclusive) are requeued
+   onto it rather than woken, and get in one after another once it is released. */
+static int ready; // guarded by the lock
+
+static void setup_broadcast(void) {
+    setup_writers();
+    smtx_cond_init(&cond);
+    mc_label(&cond.seq, "cond seq");
+    mc_label(&cond.waiters, "cond waiters");
+    mc_label(&cond.smtx, "cond smtx");
+    ready = 0;
+}
+
+/* Thread 0 signals after releasing the lock, when it can only tell thread 1 waits by the count. */
+static void signal_unlocked(int id) {
+    mc_assert(smtx_lock_exclusive(&lock) == thrd_success, "smtx_lock_exclusive");
+    if (id == 0) {
+        write_locked();
+        ready = 1;
+        smtx_unlock_exclusive(&lock);
+        smtx_cond_signal(&cond);
+        return;
+    }
+    while (!ready) {
+        mc_assert(smtx_cond_wait(&cond, &lock, SMTX_MODE_EXCLUSIVE) == thrd_success, "smtx_cond_wait");
+    }
+    write_locked();
+    smtx_unlock_exclusive(&lock);
+}
+
+static void broadcast(int id) {
+    if (id == 2) {
+        mc_assert(smtx_lock_exclusive(&lock) == thrd_success, "smtx_lock_exclusive");
+        write_locked();
+        ready = 1;
+        smtx_cond_broadcast(&cond);
+        smtx_unlock_exclusive(&lock);
+        return;
+    }
+
+    const smtx_mode_t mode = id == 0 ? SMTX_MODE_SHARED : SMTX_MODE_EXCLUSIVE;
+    mc_assert((mode == SMTX_MODE_SHARED ? smtx_lock_shared(&lock) : smtx_lock_exclusive(&lock)) == thrd_success, "locked");
+    while (!ready) {
+        mc_assert(smtx_cond_wait(&cond, &lock, mode) == thrd_success, "smtx_cond_wait");
+    }
+    if (mode == SMTX_MODE_EXCLUSIVE) {
+        write_locked();
+        smtx_unlock_exclusive(&lock);
+    } else {
+        read_locked();
+        smtx_unlock_shared(&lock);
+    }
+}
+
+/* Thread 0 takes whichever of the lock and lock2 frees first, threads 1 and 2 hold one each.
+   lock2 guards no data, only its exclusion is checked. */
+static smtx_t lock2;
+static int lock2_holders;
+
+static void setup_lock_any(void) {
+    setup_writers();
+    smtx_init(&lock2);
+    mc_label(&lock2.writer_locked, "lock2 writer_locked");
+    mc_label(&lock2.reader_count, "lock2 reader_count");
+    lock2_holders = 0;
+}
+
+static void hold_lock2(void) {
+    mc_assert(lock2_holders == 0, "lock2 held exclusively");
+    lock2_holders = 1;
+    mc_yield();
+    lock2_holders = 0;
+}
+
+static void lock_any(int id) {
+    if (id == 0) {
+        smtx_t *locks[] = {&lock, &lock2};
+        const int index = smtx_lock_any(locks, 2, SMTX_MODE_EXCLUSIVE);
+        mc_assert(index == 0 || index == 1, "smtx_lock_any");
+        if (index == 0) {
+            write_locked();
+        } else {
+            hold_lock2();
+        }
+        smtx_unlock_exclusive(locks[index]);
+    } else if (id == 1) {
+        exclusive(id);
+    } else {
+        mc_assert(smtx_lock_exclusive(&lock2) == thrd_success, "smtx_lock_exclusive");
+        hold_lock2();
+        smtx_unlock_exclusive(&lock2);
+    }
+}
+
+static void check_lock_any(void) {
+    check_released();
+    mc_assert(atomic_load_explicit(&lock2.writer_locked, memory_order_relaxed) == 0, "lock2 released");
+}
+
+/* Delegation: thread 0 serves, threads 1 and 2 each delegate a write through their mailbox and
+   ring the doorbell. The last client to finish stops the server. */
+static smtx_server_t server;
+static smtx_mailbox_t mailboxes[2];
+static atomic_uint clients;
+
+static void setup_server(void) {
+    smtx_server_init(&server, mailboxes, 2);
+    atomic_init(&clients, 2);
+    mc_label(&server.smtx.writer_locked, "server writer_locked");
+    mc_label(&server.smtx.reader_count, "server reader_count");
+    mc_label(&server.doorbell, "doorbell");
+    mc_label(&server.stop, "stop");
+    mc_label(&mailboxes[0].state, "mailbox 0");
+    mc_label(&mailboxes[1].state, "mailbox 1");
+    mc_label(&clients, "clients");
+}
+
+static void delegated_write(void *arg) {
+    (void)arg;
+    write_locked();
+}
+
+static void delegation(int id) {
+    if (id == 0) {
+        mc_assert(smtx_server_run(&server) == thrd_success, "smtx_server_run");
+        return;
+    }
+
+    mc_assert(smtx_delegate(&server, (size_t)id - 1, delegated_write, NULL) == thrd_success, "smtx_delegate");
+    if (atomic_fetch_sub_explicit(&clients, 1, memory_order_relaxed) == 1) {
+        smtx_server_stop(&server);
+    }
+}
+
+static void check_server(void) {
+    mc_assert(atomic_load_explicit(&server.smtx.writer_locked, memory_order_relaxed) == 0, "server released the lock");
+    mc_assert(atomic_load_explicit(&server.smtx.reader_count, memory_order_relaxed) == 0, "readers departed");
+    mc_assert(mc_data() == 2, "both delegated writes ran");
+}
+
+/* The test threads as fibers of the one OS thread they share: a parked fiber sleeps on its permit
+   word until an unpark sets it. */
+static atomic_uint permits[MC_THREADS];
+
+static void *fiber_current(void *ctx) {
+    (void)ctx;
+    return &permits[mc_thread()];
+}
+
+static void fiber_park_thread(void *ctx, const struct timespec *deadline) {
+    (void)ctx;
+    atomic_uint *permit = &permits[mc_thread()];
+    if (atomic_exchange_explicit(permit, 0, memory_order_acquire) == 0) {
+        futex_wait(permit, 0, deadline, 0);
+        atomic_exchange_explicit(permit, 0, memory_order_acquire);
+    }
+}
+
+static void fiber_unpark_thread(void *ctx, void *fiber) {
+    (void)ctx;
+    atomic_store_explicit((atomic_uint *)fiber, 1, memory_order_release);
+    futex_wake(fiber, 1, 0);
+}
+
+static const smtx_fiber_hooks_t fiber_hooks_of_test = {fiber_current, fiber_park_thread, fiber_unpark_thread, NULL};
+
+static void setup_fibers(void) {
+    setup_writers();
+    for (int i = 0; i < MC_THREADS; ++i) {
+        atomic_init(&permits[i], 0);
+    }
+    mc_assert(smtx_set_fiber_hooks(&fiber_hooks_of_test) == thrd_success, "smtx_set_fiber_hooks");
+    mc_label(&smtx_lot.fibers, "lot fibers");
+    mc_label(&lot_bucket(&lock.writer_locked)->busy, "lot bucket of writer_locked");
+    mc_label(&lot_bucket(&lock.reader_count)->busy, "lot bucket of reader_count");
+}
+
+static void check_fibers(void) {
+    check_released();
+    for (int i = 0; i < SMTX_LOT_BUCKETS; ++i) {
+        mc_assert(smtx_lot.buckets[i].head == NULL, "no fiber left parked");
+    }
+}
+
+/* Canaries: broken locks the checker must catch. */
+static atomic_uint flags[2];
+
+static void setup_flags(void) {
+    mc_label(&flags[0], "flag 0");
+    mc_label(&flags[1], "flag 1");
+    atomic_init(&flags[0], 0);
+    atomic_init(&flags[1], 0);
+}
+
+static void check_nothing(void) {
+}
+
+/* Dekker's entry with relaxed atomics: both stores may be missed by the other thread's load. */
+static void store_buffering(int id) {
+    atomic_store_explicit(&flags[id], 1, memory_order_relaxed);
+    if (atomic_load_explicit(&flags[!id], memory_order_relaxed) == 0) {
+        write_locked();
+    }
+}
+
+/* Data published with a relaxed store: the acquire load synchronises with nothing. */
+static void message_passing(int id) {
+    if (id == 0) {
+        mc_write_data();
+        atomic_store_explicit(&flags[0], 1, memory_order_relaxed);
+    } else if (atomic_load_explicit(&flags[0], memory_order_acquire) == 1) {
+        mc_read_data();
+    }
+}
+
+static const mc_test_t tests[] = {
+    {"shared-exclusive", 3, setup_writers, shared_exclusive, check_released, 1, false},
+    {"exclusive", 2, setup_writers, exclusive, check_released, 1, false},
+    {"prefer-readers", 3, setup_readers, shared_exclusive, check_released, 1, false},
+    {"two-phase", 3, setup_writers, two_phase, check_released, 1, false},
+    {"try", 3, setup_writers, try_locks, check_released, 1, false},
+    {"timed", 3, setup_writers, timed, check_released, 1, false},
+    {"robust-dead-owner", 2, setup_dead_owner, dead_owner, check_dead_owner, 1, false},
+    {"robust-owner-exits", 2, setup_robust, owner_exits, check_owner_exits, 1, false},
+    {"robust-cond-owner-exits", 2, setup_robust_cond, cond_owner_exits, check_owner_exits, 1, false},
+    {"deadline", 3, setup_deadline, deadline, check_released, 1, false},
+    {"deadline-timeout", 3, setup_deadline, deadline_timeout, check_released, 1, false},
+    {"shared-exclusive-spin", 3, setup_writers, shared_exclusive, check_released, 2, false},
+    {"two-phase-spin", 3, setup_writers, two_phase, check_released, 2, false},
+    {"preempt-aware", 3, setup_preempt_aware, reader_writers, check_released, 2, false},
+    {"snzi", 3, setup_snzi, shared_exclusive, check_snzi, 1, false},
+    {"pi", 3, setup_pi, reader_writers, check_released, 1, false},
+    {"pi-timed", 3, setup_pi, timed, check_released, 1, false},
+    {"wait-strategy", 3, setup_wait_strategy, shared_exclusive, check_released, 1, false},
+    {"admission", 3, setup_admission, timed, check_released, 1, false},
+    {"admission-read-window", 3, setup_read_window, read_window, check_released, 1, false},
+    {"combine", 3, setup_writers, combine, check_released, 1, false},
+    {"combine-spin", 3, setup_writers, combine, check_released, 2, false},
+    {"lock-shared-n", 3, setup_shared_n, shared_n, check_released, 1, false},
+    {"notify-drained", 3, setup_drained, notify_drained, check_released, 1, false},
+    {"lock-or-run", 3, setup_lock_or_run, lock_or_run, check_released, 1, false},
+    {"cond-broadcast", 3, setup_broadcast, broadcast, check_released, 1, false},
+    {"cond-signal", 2, setup_broadcast, signal_unlocked, check_released, 1, false},
+    {"lock-any", 3, setup_lock_any, lock_any, check_lock_any, 1, false},
+    {"delegation", 3, setup_server, delegation, check_server, 1, false},
+    {"fibers", 3, setup_fibers, shared_exclusive, check_fibers, 1, false},
+    {"fibers-timed", 3, setup_fibers, timed, check_fibers, 1, false},
+    {"canary-store-buffering", 2, setup_flags, store_buffering, check_nothing, 1, true},
+    {"canary-message-passing", 2, setup_flags, message_passing, check_nothing, 1, true},
+};
+
+
+/* Each test sees as many CPUs as it runs on. */
+static void start_test(const mc_test_t *test) {
+    smtx_set_parallelism(test->cpus);
+}
+
+int main(int argc, char **argv) {
+    // smtx.h keeps its TID and what its helpers run in TLS; spinners count themselves in and out of
+    // the spin governor on every round, which leaves nothing new for anybody to look at.
+    mc_thread_local(cached_tid(), sizeof(*cached_tid()));
+    mc_thread_local(helping(), sizeof(*helping()));
+    mc_quiet(&smtx_governor.spinning);
+    return mc_main(tests, sizeof(tests) / sizeof(tests[0]), argc, argv, start_test);
+}
@@ -0,0 +1,288 @@
+/* Model checker front end for smtx.hpp, the engine is tests/mc.c. The lock words are mc::atomic,
+   whose operations go through the engine's hooks like the fences, yields and futex calls of the
+   locks, so basic_shared_mutex (every wait policy, both fairness policies) and async_shared_mutex
+   are explored the way smtx-mc explores smtx.h.
+
+   smtx-mc-cpp [test...] runs the named tests (all by default), each in a process of its own.
+   MC_PREEMPTIONS and MC_STALE_READS in the environment raise the bounds (default 2 and 1). */
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <optional>
+#include <thread>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mc.h"
+
+namespace mc {
+
+constexpr int hook_order(std::memory_order order) noexcept {
+    return static_cast<int>(order);
+}
+
+static_assert(hook_order(std::memory_order_seq_cst) == __ATOMIC_SEQ_CST && hook_order(std::memory_order_relaxed) == __ATOMIC_RELAXED,
+              "orders are the __ATOMIC_* values");
+
+/* The part of std::atomic that smtx.hpp uses, on the engine's hooks. */
+template <class T>
+class atomic {
+public:
+    static constexpr bool is_always_lock_free = true;
+
+    constexpr atomic(T value) noexcept : value_(value) {}
+
+    atomic(const atomic &) = delete;
+    atomic &operator=(const atomic &) = delete;
+
+    T load(std::memory_order order = std::memory_order_seq_cst) const noexcept {
+        return static_cast<T>(mc_load(&value_, sizeof(T), hook_order(order)));
+    }
+
+    void store(T value, std::memory_order order = std::memory_order_seq_cst) noexcept {
+        mc_store(&value_, sizeof(T), static_cast<std::uint64_t>(value), hook_order(order));
+    }
+
+    T exchange(T value, std::memory_order order = std::memory_order_seq_cst) noexcept {
+        return rmw(MC_XCHG, value, order);
+    }
+
+    bool compare_exchange_strong(T &expected, T desired, std::memory_order success, std::memory_order failure) noexcept {
+        return mc_cas(&value_, sizeof(T), &expected, static_cast<std::uint64_t>(desired), hook_order(success), hook_order(failure));
+    }
+
+    bool compare_exchange_strong(T &expected, T desired, std::memory_order order = std::memory_order_seq_cst) noexcept {
+        const std::memory_order failure = order == std::memory_order_acq_rel ? std::memory_order_acquire
+                                        : order == std::memory_order_release ? std::memory_order_relaxed
+                                                                             : order;
+        return compare_exchange_strong(expected, desired, order, failure);
+    }
+
+    // Never fails spuriously, the retry loops around it would only spin.
+    bool compare_exchange_weak(T &expected, T desired, std::memory_order success, std::memory_order failure) noexcept {
+        return compare_exchange_strong(expected, desired, success, failure);
+    }
+
+    bool compare_exchange_weak(T &expected, T desired, std::memory_order order = std::memory_order_seq_cst) noexcept {
+        return compare_exchange_strong(expected, desired, order);
+    }
+
+    T fetch_add(T operand, std::memory_order order = std::memory_order_seq_cst) noexcept {
+        return rmw(MC_ADD, operand, order);
+    }
+
+    T fetch_sub(T operand, std::memory_order order = std::memory_order_seq_cst) noexcept {
+        return rmw(MC_SUB, operand, order);
+    }
+
+    T fetch_and(T operand, std::memory_order order = std::memory_order_seq_cst) noexcept {
+        return rmw(MC_AND, operand, order);
+    }
+
+    T fetch_or(T operand, std::memory_order order = std::memory_order_seq_cst) noexcept {
+        return rmw(MC_OR, operand, order);
+    }
+
+private:
+    T rmw(int op, T operand, std::memory_order order) noexcept {
+        return static_cast<T>(mc_rmw(&value_, sizeof(T), op, static_cast<std::uint64_t>(operand), hook_order(order)));
+    }
+
+    T value_;
+};
+
+} // namespace mc
+
+#define SMTX_HPP_ATOMIC mc::atomic
+#define SMTX_HPP_FENCE(order) mc_fence(mc::hook_order(order))
+#define SMTX_HPP_YIELD() mc_yield()
+#define syscall mc_syscall
+#include "../smtx.hpp"
+#undef syscall
+
+namespace {
+
+// Waiters park after one spin, as in smtx-mc.
+using spin = smtx::spin_policy<4, 4, 1>;
+
+// Time points either far ahead or long passed, so that time never decides a run.
+const std::chrono::steady_clock::time_point past{};
+
+std::chrono::steady_clock::time_point future() {
+    return std::chrono::steady_clock::now() + std::chrono::hours(1);
+}
+
+void read_locked() {
+    mc_enter(MC_SHARED);
+    mc_read_data();
+    mc_leave(MC_SHARED);
+}
+
+void write_locked() {
+    mc_enter(MC_EXCLUSIVE);
+    mc_write_data();
+    mc_leave(MC_EXCLUSIVE);
+}
+
+/* The tests of one basic_shared_mutex instantiation, on a mutex constructed afresh by each execution. */
+template <class Mutex>
+struct lock_test {
+    static inline std::optional<Mutex> mutex;
+
+    static void setup() {
+        mutex.emplace();
+    }
+
+    /* Thread 1 writes, the others read. */
+    static void shared_exclusive(int id) {
+        if (id == 1) {
+            mutex->lock();
+            write_locked();
+            mutex->unlock();
+        } else {
+            mutex->lock_shared();
+            read_locked();
+            mutex->unlock_shared();
+        }
+    }
+
+    static void try_locks(int id) {
+        if (id == 0) {
+            mutex->lock();
+            write_locked();
+            mutex->unlock();
+        } else if (id == 1) {
+            if (mutex->try_lock_shared()) {
+                read_locked();
+                mutex->unlock_shared();
+            }
+        } else if (mutex->try_lock()) {
+            write_locked();
+            mutex->unlock();
+        }
+    }
+
+    static void timed(int id) {
+        if (id == 0) {
+            mc_assert(mutex->try_lock_until(future()), "try_lock_until");
+            write_locked();
+            mutex->unlock();
+        } else if (id == 1) {
+            if (mutex->try_lock_until(past)) {
+                write_locked();
+                mutex->unlock();
+            }
+        } else if (mutex->try_lock_shared_until(past)) {
+            read_locked();
+            mutex->unlock_shared();
+        }
+    }
+
+    /* Both words are back to zero, waiter bits included, or the exclusive try would fail. */
+    static void check_released() {
+        mc_assert(mutex->try_lock(), "released");
+        mutex->unlock();
+    }
+};
+
+using yield_mutex = lock_test<smtx::basic_shared_mutex<spin>>;
+using yield_readers_mutex = lock_test<smtx::basic_shared_mutex<spin, smtx::yield_wait, smtx::prefer_readers>>;
+using spin_mutex = lock_test<smtx::basic_shared_mutex<spin, smtx::spin_wait>>;
+using futex_mutex = lock_test<smtx::basic_shared_mutex<spin, smtx::futex_wait>>;
+using futex_readers_mutex = lock_test<smtx::basic_shared_mutex<spin, smtx::futex_wait, smtx::prefer_readers, smtx::padded_layout<64>>>;
+
+/* A coroutine that starts at once and frees its frame when it finishes. */
+struct task {
+    struct promise_type {
+        task get_return_object() noexcept {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() noexcept {}
+
+        void unhandled_exception() noexcept {
+            std::terminate();
+        }
+    };
+};
+
+/* Coroutine 1 writes, the others read. One that is queued is resumed by whichever test thread
+   unlocks, the thread that started it has long returned by then. */
+std::optional<smtx::async_shared_mutex> async_mutex;
+int finished; // coroutines that ran to the end
+
+void setup_async() {
+    async_mutex.emplace();
+    finished = 0;
+}
+
+task async_shared_exclusive(int id) {
+    if (id == 1) {
+        co_await async_mutex->lock();
+        write_locked();
+        async_mutex->unlock();
+    } else {
+        co_await async_mutex->lock_shared();
+        read_locked();
+        async_mutex->unlock_shared();
+    }
+    finished += 1;
+}
+
+void async_thread(int id) {
+    async_shared_exclusive(id);
+}
+
+/* Thread 2 only tries, its try backs out of the lock words without unlocking. */
+void async_try(int id) {
+    if (id != 2) {
+        async_shared_exclusive(id);
+    } else if (async_mutex->try_lock_shared()) {
+        read_locked();
+        async_mutex->unlock_shared();
+    }
+}
+
+void check_async_try() {
+    mc_assert(finished == 2, "every coroutine resumed");
+    mc_assert(async_mutex->try_lock(), "released");
+    async_mutex->unlock();
+}
+
+void check_async() {
+    mc_assert(finished == 3, "every coroutine resumed");
+    mc_assert(async_mutex->try_lock(), "released");
+    async_mutex->unlock();
+}
+
+const mc_test_t tests[] = {
+    {"shared-exclusive", 3, yield_mutex::setup, yield_mutex::shared_exclusive, yield_mutex::check_released, 1, false},
+    {"prefer-readers", 3, yield_readers_mutex::setup, yield_readers_mutex::shared_exclusive, yield_readers_mutex::check_released, 1, false},
+    {"spin", 3, spin_mutex::setup, spin_mutex::shared_exclusive, spin_mutex::check_released, 1, false},
+    {"try", 3, yield_mutex::setup, yield_mutex::try_locks, yield_mutex::check_released, 1, false},
+    {"futex", 3, futex_mutex::setup, futex_mutex::shared_exclusive, futex_mutex::check_released, 1, false},
+    {"futex-prefer-readers", 3, futex_readers_mutex::setup, futex_readers_mutex::shared_exclusive, futex_readers_mutex::check_released, 1, false},
+    {"futex-timed", 3, futex_mutex::setup, futex_mutex::timed, futex_mutex::check_released, 1, false},
+    {"futex-prefer-readers-timed", 3, futex_readers_mutex::setup, futex_readers_mutex::timed, futex_readers_mutex::check_released, 1, false},
+    {"async", 3, setup_async, async_thread, check_async, 1, false},
+    {"async-try", 3, setup_async, async_try, check_async_try, 1, false},
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+    return mc_main(tests, std::size(tests), argc, argv, nullptr);
+}